@@ -17,12 +17,18 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qapi/error.h"
+#include "trace.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
@@ -41,6 +47,185 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* Rebuilding the pollfds array costs O(n) on every aio_poll() iteration,
+ * which adds up for event loops serving many NBD clients or SCSI LUNs.
+ * Past this many handlers, keep the file descriptors in an epoll set that
+ * aio_set_fd_handler() updates incrementally.  Drop back to ppoll below
+ * half of it, so that a context hovering around the threshold doesn't
+ * keep rebuilding the epoll set.
+ */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    /* Empty the set rather than closing it, another thread may be waiting
+     * on the epoll file descriptor.  Errors are ignored, the fd may not have
+     * been added in the first place.
+     */
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+        }
+    }
+    ctx->epoll_enabled = false;
+}
+
+static inline int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static inline int pfd_events_from_epoll(int epoll_events)
+{
+    return (epoll_events & EPOLLIN ? G_IO_IN : 0) |
+           (epoll_events & EPOLLOUT ? G_IO_OUT : 0) |
+           (epoll_events & EPOLLHUP ? G_IO_HUP : 0) |
+           (epoll_events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+static bool aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        int r;
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event);
+        if (r) {
+            return false;
+        }
+    }
+    ctx->epoll_enabled = true;
+    trace_aio_epoll_enable(ctx, ctx->nr_handlers);
+    return true;
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event;
+    int r;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+    if (!node->pfd.events) {
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+    } else {
+        event.data.ptr = node;
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        r = epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                      node->pfd.fd, &event);
+    }
+    if (r) {
+        /* Some file descriptors (e.g. regular files) cannot be added to an
+         * epoll set; stick to ppoll for this AioContext.
+         */
+        aio_epoll_disable(ctx);
+        ctx->epoll_available = false;
+    }
+}
+
+/* Decide whether this aio_poll() iteration waits with epoll */
+static bool aio_epoll_check_poll(AioContext *ctx)
+{
+    if (!ctx->epoll_available) {
+        return false;
+    }
+    if (ctx->epoll_enabled) {
+        if (ctx->nr_handlers >= ctx->epoll_threshold / 2) {
+            return true;
+        }
+        trace_aio_epoll_disable(ctx, ctx->nr_handlers);
+        aio_epoll_disable(ctx);
+        return false;
+    }
+    if (ctx->nr_handlers >= ctx->epoll_threshold) {
+        if (aio_epoll_try_enable(ctx)) {
+            return true;
+        }
+        aio_epoll_disable(ctx);
+        ctx->epoll_available = false;
+    }
+    return false;
+}
+
+/* Wait for events on the epoll set and store them in the handlers' revents.
+ * Called without the AioContext lock, but with walking_handlers elevated so
+ * that nodes cannot go away.
+ */
+static int aio_epoll(AioContext *ctx, struct epoll_event *events,
+                     int maxevents, int64_t timeout)
+{
+    GPollFD pfd = {
+        .fd = ctx->epollfd,
+        .events = G_IO_IN,
+    };
+    int ret;
+
+    /* epoll_wait only has millisecond resolution; use ppoll on the epoll
+     * file descriptor itself for the actual wait.
+     */
+    if (timeout > 0) {
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+    do {
+        ret = epoll_wait(ctx->epollfd, events, maxevents,
+                         timeout < 0 ? -1 : 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+void aio_context_setup(AioContext *ctx, Error **errp)
+{
+    ctx->epoll_enabled = false;
+    ctx->epoll_threshold = EPOLL_ENABLE_THRESHOLD;
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    /* Not fatal, aio_poll() just keeps using ppoll */
+    ctx->epoll_available = ctx->epollfd >= 0;
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+}
+
+#else
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+void aio_context_setup(AioContext *ctx, Error **errp)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
+#endif
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -56,6 +241,10 @@ void aio_set_fd_handler(AioContext *ctx,
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
 
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
+            ctx->nr_handlers--;
+
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
                 node->deleted = 1;
@@ -70,6 +259,8 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
+        bool is_new = false;
+
         if (node == NULL) {
             /* Alloc and insert if it's not already there */
             node = g_new0(AioHandler, 1);
@@ -77,6 +268,8 @@ void aio_set_fd_handler(AioContext *ctx,
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            is_new = true;
+            ctx->nr_handlers++;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -85,6 +278,7 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+        aio_epoll_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
@@ -98,6 +292,37 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    AioHandler *node;
+
+    node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+    assert(node);
+    node->io_poll = io_poll;
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp)
+{
+    if (max_ns < 0 || grow < 0 || shrink < 0) {
+        error_setg(errp, "polling parameters must not be negative");
+        return;
+    }
+
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * value is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -230,6 +455,88 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+    }
+
+    return progress;
+}
+
+/* Busy-wait on the poll handlers for up to @max_ns nanoseconds.
+ *
+ * Must be called with walking_handlers incremented, so that handlers
+ * removed by the poll handlers themselves are only marked as deleted.
+ *
+ * Returns true if a poll handler made progress.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    bool progress;
+    int64_t start_time, elapsed_time;
+
+    trace_run_poll_handlers_begin(ctx, max_ns);
+
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    do {
+        progress = run_poll_handlers_once(ctx);
+        elapsed_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
+    } while (!progress && elapsed_time < max_ns);
+
+    ctx->poll_time_ns += elapsed_time;
+    if (progress) {
+        ctx->poll_hits++;
+    } else {
+        ctx->poll_misses++;
+    }
+
+    trace_run_poll_handlers_end(ctx, progress);
+    return progress;
+}
+
+/* Adapt the polling time to how long aio_poll() actually had to wait */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* The event arrived within the polling window, keep it */
+        return;
+    }
+
+    if (block_ns > ctx->poll_max_ns) {
+        /* We would have had to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+        if (ctx->poll_ns != old) {
+            trace_poll_shrink(ctx, old, ctx->poll_ns);
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* A slightly longer window would have caught it, poll longer */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        if (ctx->poll_ns) {
+            ctx->poll_ns *= grow;
+        } else {
+            ctx->poll_ns = 4000; /* start polling at 4 microseconds */
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
@@ -237,6 +544,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
     int i, ret;
     bool progress;
     int64_t timeout;
+    int64_t start_time = 0;
+    bool adaptive;
+    bool use_epoll = false;
+#ifdef CONFIG_EPOLL_CREATE1
+    struct epoll_event events[128];
+#endif
 
     aio_context_acquire(ctx);
     was_dispatching = ctx->dispatching;
@@ -258,25 +571,67 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
+#ifdef CONFIG_EPOLL_CREATE1
+    use_epoll = aio_epoll_check_poll(ctx);
+#endif
+
     /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        if (!node->deleted && node->pfd.events) {
-            add_pollfd(node);
+    if (!use_epoll) {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->pfd.events) {
+                add_pollfd(node);
+            }
         }
     }
 
     timeout = blocking ? aio_compute_timeout(ctx) : 0;
 
+    /* Only a blocking wait is worth replacing with busy polling */
+    adaptive = timeout && ctx->poll_max_ns;
+    if (adaptive) {
+        int64_t poll_ns = ctx->poll_ns;
+
+        start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (timeout > 0 && poll_ns > timeout) {
+            poll_ns = timeout;
+        }
+        if (poll_ns && run_poll_handlers(ctx, poll_ns)) {
+            /* Still collect whatever file descriptors are ready */
+            progress = true;
+            timeout = 0;
+        }
+    }
+
     /* wait until next event */
     if (timeout) {
         aio_context_release(ctx);
     }
-    ret = qemu_poll_ns((GPollFD *)pollfds, npfd, timeout);
+#ifdef CONFIG_EPOLL_CREATE1
+    if (use_epoll) {
+        ret = aio_epoll(ctx, events, ARRAY_SIZE(events), timeout);
+    } else
+#endif
+    {
+        ret = qemu_poll_ns((GPollFD *)pollfds, npfd, timeout);
+    }
     if (timeout) {
         aio_context_acquire(ctx);
     }
 
+    if (adaptive) {
+        adjust_poll_time(ctx,
+                         qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time);
+    }
+
     /* if we have any readable fds, dispatch event */
+#ifdef CONFIG_EPOLL_CREATE1
+    if (use_epoll) {
+        for (i = 0; i < ret; i++) {
+            node = events[i].data.ptr;
+            node->pfd.revents = pfd_events_from_epoll(events[i].events);
+        }
+    } else
+#endif
     if (ret > 0) {
         for (i = 0; i < npfd; i++) {
             nodes[i]->pfd.revents = pollfds[i].revents;
@@ -41,6 +41,7 @@
 #include "hw/audio/audio.h"
 #include "sysemu/kvm.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "hw/i386/smbios.h"
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
@@ -54,6 +55,8 @@
 #include "hw/acpi/acpi.h"
 #include "qemu/host-utils.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/rcu.h"
+#include "qemu/sockets.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -129,6 +132,8 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* The smallest TARGET_PAGE_BITS is 10, so this is the last flag available */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static struct defconfig_file {
     const char *filename;
@@ -458,6 +463,632 @@ void migrate_compress_threads_create(void)
     }
 }
 
+/* Called within an RCU critical section */
+static RAMBlock *ram_find_block_by_idstr(const char *id)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strcmp(id, block->idstr)) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/* Multiple connection (multifd) RAM transfer
+ *
+ * Each channel has its own socket and thread.  The migration thread
+ * gathers dirty pages of one RAMBlock into a batch and hands the batch
+ * to whichever channel is idle; the channel thread checks for zero pages
+ * and writes the batch out.  Whenever the main stream finishes a round
+ * (end of ram_save_iterate/ram_save_complete) every channel sends a sync
+ * packet and the main stream carries RAM_SAVE_FLAG_MULTIFD_SYNC; the
+ * destination doesn't go past either until both sides have caught up,
+ * so a page resent in a later round can never be overtaken by an older
+ * copy on another channel.
+ */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Set in the offset of a page that is all zeroes and has no data */
+#define MULTIFD_PAGE_ZERO 0x1
+
+/* Number of pages in a single packet */
+#define MULTIFD_PAGES_PER_PACKET 64
+
+typedef struct {
+    RAMBlock *block;
+    int used;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct {
+    int id;
+    QemuThread thread;
+    /* posted by the migration thread for each new job */
+    QemuSemaphore sem;
+    /* posted once a sync packet is on the wire */
+    QemuSemaphore sem_sync;
+    /* protects everything below */
+    QemuMutex mutex;
+    QEMUFile *file;
+    bool quit;
+    int pending_job;
+    uint32_t flags;
+    MultiFDPages *pages;
+    /* statistics, folded into the totals at each sync */
+    uint64_t bytes_sent;
+    uint64_t norm_pages;
+    uint64_t dup_pages;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* pages being gathered by the migration thread */
+    MultiFDPages *pages;
+    /* posted by a channel whenever it's ready for another job */
+    QemuSemaphore channels_ready;
+    bool error;
+} *multifd_send_state;
+
+typedef struct {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* posted by the main thread to let the channel carry on past a sync */
+    QemuSemaphore sem_sync;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    /* channels connected so far */
+    int count;
+    /* posted by each channel when it reaches a sync, or fails */
+    QemuSemaphore sem_sync;
+    bool quit;
+    bool error;
+} *multifd_recv_state;
+
+/* Something went wrong with a channel; don't leave anyone waiting on it */
+static void multifd_send_set_error(MultiFDSendParams *p)
+{
+    atomic_mb_set(&multifd_send_state->error, true);
+    qemu_sem_post(&p->sem_sync);
+    qemu_sem_post(&multifd_send_state->channels_ready);
+}
+
+static void multifd_send_packet(MultiFDSendParams *p, uint32_t flags,
+                                MultiFDPages *pages)
+{
+    QEMUFile *f = p->file;
+    uint8_t *base = NULL;
+    uint64_t bytes = 8;
+    uint64_t norm = 0, dup = 0;
+    bool zero[MULTIFD_PAGES_PER_PACKET];
+    int i;
+
+    qemu_put_be32(f, flags);
+    qemu_put_be32(f, pages->used);
+    if (pages->used) {
+        size_t len = strlen(pages->block->idstr);
+
+        base = memory_region_get_ram_ptr(pages->block->mr);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)pages->block->idstr, len);
+        bytes += 1 + len;
+        for (i = 0; i < pages->used; i++) {
+            zero[i] = is_zero_range(base + pages->offset[i], TARGET_PAGE_SIZE);
+            qemu_put_be64(f, pages->offset[i] |
+                             (zero[i] ? MULTIFD_PAGE_ZERO : 0));
+        }
+        bytes += 8 * pages->used;
+        for (i = 0; i < pages->used; i++) {
+            if (zero[i]) {
+                dup++;
+                continue;
+            }
+            qemu_put_buffer_async(f, base + pages->offset[i],
+                                  TARGET_PAGE_SIZE);
+            bytes += TARGET_PAGE_SIZE;
+            norm++;
+        }
+    }
+    qemu_fflush(f);
+
+    qemu_mutex_lock(&p->mutex);
+    p->bytes_sent += bytes;
+    p->norm_pages += norm;
+    p->dup_pages += dup;
+    qemu_mutex_unlock(&p->mutex);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+    int fd;
+
+    trace_multifd_send_thread_start(p->id);
+
+    fd = tcp_connect_multifd_channel(migrate_get_current(), &local_err);
+    if (fd < 0) {
+        error_report_err(local_err);
+        multifd_send_set_error(p);
+        return NULL;
+    }
+
+    qemu_mutex_lock(&p->mutex);
+    p->file = qemu_fopen_socket(fd, "wb");
+    qemu_mutex_unlock(&p->mutex);
+
+    qemu_put_be32(p->file, MULTIFD_MAGIC);
+    qemu_put_be32(p->file, MULTIFD_VERSION);
+    qemu_put_be32(p->file, p->id);
+    qemu_put_be32(p->file, multifd_send_state->count);
+    qemu_fflush(p->file);
+    if (qemu_file_get_error(p->file)) {
+        multifd_send_set_error(p);
+        return NULL;
+    }
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        uint32_t flags;
+
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        if (!p->pending_job) {
+            qemu_mutex_unlock(&p->mutex);
+            continue;
+        }
+        flags = p->flags;
+        p->flags = 0;
+        /* The migration thread leaves p->pages alone while a job is pending */
+        qemu_mutex_unlock(&p->mutex);
+
+        multifd_send_packet(p, flags, p->pages);
+        p->pages->used = 0;
+        p->pages->block = NULL;
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending_job--;
+        qemu_mutex_unlock(&p->mutex);
+
+        if (qemu_file_get_error(p->file)) {
+            error_report("multifd: channel %d failed to send", p->id);
+            multifd_send_set_error(p);
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&p->sem_sync);
+        }
+        qemu_sem_post(&multifd_send_state->channels_ready);
+    }
+
+    trace_multifd_send_thread_end(p->id);
+    return NULL;
+}
+
+void migrate_multifd_send_threads_create(void)
+{
+    int i, thread_count;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->count = thread_count;
+    multifd_send_state->pages = g_new0(MultiFDPages, 1);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        p->id = i;
+        p->pages = g_new0(MultiFDPages, 1);
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        qemu_sem_init(&p->sem_sync, 0);
+        qemu_thread_create(&p->thread, "multifd_send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Unblock any channel stuck in a send; used when cancelling */
+void migrate_multifd_send_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->file) {
+            qemu_file_shutdown(p->file);
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+}
+
+void migrate_multifd_send_threads_join(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        if (p->file) {
+            qemu_fclose(p->file);
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        qemu_sem_destroy(&p->sem_sync);
+        g_free(p->pages);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/* Hand the gathered pages to an idle channel */
+static int multifd_send_pages(void)
+{
+    static int next_channel;
+    MultiFDSendParams *p;
+    MultiFDPages *pages;
+    int i;
+
+    if (atomic_mb_read(&multifd_send_state->error)) {
+        return -1;
+    }
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_mb_read(&multifd_send_state->error)) {
+        return -1;
+    }
+
+    /* channels_ready guarantees that at least one of them is idle */
+    for (i = next_channel;; i = (i + 1) % multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    next_channel = (i + 1) % multifd_send_state->count;
+
+    pages = p->pages;
+    p->pages = multifd_send_state->pages;
+    multifd_send_state->pages = pages;
+    p->pending_job++;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->block && pages->block != block) {
+        if (multifd_send_pages() < 0) {
+            return -1;
+        }
+    }
+
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+    if (pages->used == MULTIFD_PAGES_PER_PACKET) {
+        return multifd_send_pages();
+    }
+
+    return 0;
+}
+
+/* Wait until every channel has sent everything queued so far */
+static int multifd_send_sync_main(void)
+{
+    int i;
+
+    if (multifd_send_state->pages->used && multifd_send_pages() < 0) {
+        return -1;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->flags |= MULTIFD_FLAG_SYNC;
+        p->pending_job++;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (atomic_mb_read(&multifd_send_state->error)) {
+            return -1;
+        }
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+        qemu_sem_wait(&p->sem_sync);
+    }
+
+    return atomic_mb_read(&multifd_send_state->error) ? -1 : 0;
+}
+
+/**
+ * multifd_sync: End a round of multifd pages
+ *
+ * Must be called within the RCU critical section the pages were queued in,
+ * so that the RAMBlocks stay around until they've been sent.
+ *
+ * @f: QEMUFile of the main migration stream
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static void multifd_sync(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    trace_multifd_send_sync_main();
+    if (multifd_send_sync_main() < 0) {
+        qemu_file_set_error(f, -EIO);
+        return;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        qemu_update_position(f, p->bytes_sent);
+        *bytes_transferred += p->bytes_sent;
+        acct_info.norm_pages += p->norm_pages;
+        acct_info.dup_pages += p->dup_pages;
+        p->bytes_sent = 0;
+        p->norm_pages = 0;
+        p->dup_pages = 0;
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    *bytes_transferred += 8;
+}
+
+/* Something went wrong with a channel; let the main thread know */
+static void multifd_recv_set_error(void)
+{
+    atomic_mb_set(&multifd_recv_state->error, true);
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    QEMUFile *f = p->file;
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+    char id[256];
+
+    rcu_register_thread();
+    trace_multifd_recv_thread_start(p->id);
+
+    while (true) {
+        uint32_t flags, used, i;
+        RAMBlock *block;
+        uint8_t *base;
+        uint8_t len;
+
+        flags = qemu_get_be32(f);
+        used = qemu_get_be32(f);
+        if (qemu_file_get_error(f)) {
+            /* The source closes the channels once it's done */
+            if (!atomic_mb_read(&multifd_recv_state->quit)) {
+                multifd_recv_set_error();
+            }
+            break;
+        }
+        if (used > MULTIFD_PAGES_PER_PACKET) {
+            error_report("multifd: packet with too many pages (%u)", used);
+            multifd_recv_set_error();
+            break;
+        }
+
+        if (used) {
+            len = qemu_get_byte(f);
+            qemu_get_buffer(f, (uint8_t *)id, len);
+            id[len] = 0;
+            for (i = 0; i < used; i++) {
+                offset[i] = qemu_get_be64(f);
+            }
+
+            rcu_read_lock();
+            block = ram_find_block_by_idstr(id);
+            if (!block) {
+                rcu_read_unlock();
+                error_report("multifd: unknown RAMBlock '%s'", id);
+                multifd_recv_set_error();
+                break;
+            }
+            base = memory_region_get_ram_ptr(block->mr);
+            for (i = 0; i < used; i++) {
+                ram_addr_t page = offset[i] & TARGET_PAGE_MASK;
+
+                if (page >= block->used_length) {
+                    break;
+                }
+                if (offset[i] & MULTIFD_PAGE_ZERO) {
+                    ram_handle_compressed(base + page, 0, TARGET_PAGE_SIZE);
+                } else {
+                    qemu_get_buffer(f, base + page, TARGET_PAGE_SIZE);
+                }
+            }
+            rcu_read_unlock();
+            if (i != used) {
+                error_report("multifd: offset out of range in RAMBlock '%s'",
+                             id);
+                multifd_recv_set_error();
+                break;
+            }
+        }
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+    trace_multifd_recv_thread_end(p->id);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void migrate_multifd_recv_threads_create(void)
+{
+    int thread_count;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+}
+
+/*
+ * Start receiving on a newly accepted channel.
+ * Returns true once all the channels are connected.  Returns false and
+ * sets @errp if the channel doesn't belong to a matching source.
+ */
+bool migrate_multifd_recv_new_channel(int fd, Error **errp)
+{
+    MultiFDRecvParams *p;
+    QEMUFile *f;
+    uint32_t magic, version, id, channels;
+
+    /* The receive threads aren't coroutines and can't yield */
+    qemu_set_block(fd);
+    f = qemu_fopen_socket(fd, "rb");
+
+    /* The source sends the header as soon as it has connected */
+    magic = qemu_get_be32(f);
+    version = qemu_get_be32(f);
+    id = qemu_get_be32(f);
+    channels = qemu_get_be32(f);
+    if (qemu_file_get_error(f) || magic != MULTIFD_MAGIC ||
+        version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: bad channel header");
+        goto fail;
+    }
+    /* Otherwise we would wait for channels that never come, or run out
+     * of room for them */
+    if (channels != migrate_multifd_channels()) {
+        error_setg(errp, "multifd: the source uses %u channels, but %d "
+                   "are set here", channels, migrate_multifd_channels());
+        goto fail;
+    }
+    if (id >= channels) {
+        error_setg(errp, "multifd: invalid channel id %u", id);
+        goto fail;
+    }
+
+    p = &multifd_recv_state->params[multifd_recv_state->count++];
+    p->id = id;
+    p->file = f;
+    qemu_sem_init(&p->sem_sync, 0);
+    qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+
+    return multifd_recv_state->count == migrate_multifd_channels();
+
+fail:
+    qemu_fclose(f);
+    return false;
+}
+
+void migrate_multifd_recv_threads_join(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    atomic_mb_set(&multifd_recv_state->quit, true);
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_file_shutdown(p->file);
+        qemu_sem_post(&p->sem_sync);
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_sem_destroy(&p->sem_sync);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/* Wait for every channel to reach the sync matching the main stream's */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd stream received without the multifd "
+                     "capability enabled");
+        return -EINVAL;
+    }
+
+    trace_multifd_recv_sync_main();
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+        if (atomic_mb_read(&multifd_recv_state->error)) {
+            error_report("multifd: receive channel failed");
+            return -EIO;
+        }
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+
+    return 0;
+}
+
 /**
  * save_page_header: Write page header to wire
  *
@@ -823,6 +1454,14 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
                 acct_info.dup_pages++;
             }
         }
+    } else if (multifd_send_state) {
+        /* The channel threads take care of zero pages too */
+        if (multifd_queue_page(block, current_addr - block->offset) < 0) {
+            qemu_file_set_error(f, -EIO);
+        }
+        /* Count it against the rate limit now, it's sent asynchronously */
+        qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+        pages = 1;
     } else {
         pages = save_zero_page(f, block, offset, p, bytes_transferred);
         if (pages > 0) {
@@ -830,7 +1469,8 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
-        } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+        } else if (!ram_bulk_stage && migrate_use_xbzrle() &&
+                   !migration_in_postcopy(migrate_get_current())) {
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
             if (!last_stage) {
@@ -1033,6 +1673,134 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
     return pages;
 }
 
+/**
+ * ram_save_queued_page: Sends the next page the destination asked for
+ *
+ * Pages are sent whether or not they're dirty, since the destination may
+ * be waiting on a page that was never populated (e.g. a zero page that
+ * was skipped during precopy).
+ *
+ * Called within an RCU critical section.
+ *
+ * Returns: The number of pages written
+ *          0 means the request queue was empty
+ *
+ * @f: QEMUFile where to send the data
+ * @ms: current migration state
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_queued_page(QEMUFile *f, MigrationState *ms,
+                                bool last_stage, uint64_t *bytes_transferred)
+{
+    MigrationSrcPageRequest *entry;
+    RAMBlock *block = NULL;
+    ram_addr_t offset = 0;
+    bool done = false;
+    int pages;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    entry = QSIMPLEQ_FIRST(&ms->src_page_requests);
+    if (entry) {
+        block = entry->rb;
+        offset = entry->offset;
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            done = true;
+        }
+    }
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+
+    if (!block) {
+        return 0;
+    }
+
+    trace_ram_save_queued_page(block->idstr, offset);
+    if (test_and_clear_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+                           migration_bitmap)) {
+        migration_dirty_pages--;
+    }
+    pages = ram_save_page(f, block, offset, last_stage, bytes_transferred);
+    last_sent_block = block;
+
+    if (done) {
+        memory_region_unref(block->mr);
+        g_free(entry);
+    }
+
+    return pages;
+}
+
+/* Drop any page requests that are still queued */
+static void ram_flush_page_requests(MigrationState *ms)
+{
+    MigrationSrcPageRequest *entry;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    while ((entry = QSIMPLEQ_FIRST(&ms->src_page_requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+        memory_region_unref(entry->rb->mr);
+        g_free(entry);
+    }
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+}
+
+/**
+ * ram_save_queue_pages: Queue a range of pages the destination asked for
+ *
+ * Called from the return path thread.
+ *
+ * Returns: 0 on success, -1 on error
+ *
+ * @ms: current migration state
+ * @rbname: name of the RAMBlock the pages are in
+ * @start: offset of the first page within the RAMBlock
+ * @len: length in bytes of the range
+ */
+int ram_save_queue_pages(MigrationState *ms, const char *rbname,
+                         ram_addr_t start, ram_addr_t len)
+{
+    MigrationSrcPageRequest *new_entry;
+    RAMBlock *ramblock;
+
+    trace_ram_save_queue_pages(rbname, start, len);
+
+    rcu_read_lock();
+    ramblock = ram_find_block_by_idstr(rbname);
+    if (!ramblock) {
+        error_report("ram_save_queue_pages no block '%s'", rbname);
+        goto err;
+    }
+
+    if (!len || start + len > ramblock->used_length) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, ramblock->used_length);
+        goto err;
+    }
+
+    /* Keep the block alive until the request has been serviced */
+    new_entry = g_new0(MigrationSrcPageRequest, 1);
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+    memory_region_ref(ramblock->mr);
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+    rcu_read_unlock();
+
+    return 0;
+
+err:
+    rcu_read_unlock();
+    return -1;
+}
+
 /**
  * ram_find_and_save_block: Finds a dirty page and sends it to f
  *
@@ -1054,6 +1822,15 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     bool complete_round = false;
     int pages = 0;
     MemoryRegion *mr;
+    MigrationState *ms = migrate_get_current();
+
+    /* Pages the destination is blocked on come first */
+    if (migration_in_postcopy(ms)) {
+        pages = ram_save_queued_page(f, ms, last_stage, bytes_transferred);
+        if (pages) {
+            return pages;
+        }
+    }
 
     if (!block)
         block = QLIST_FIRST_RCU(&ram_list.blocks);
@@ -1150,6 +1927,8 @@ void free_xbzrle_decoded_buf(void)
 
 static void migration_end(void)
 {
+    ram_flush_page_requests(migrate_get_current());
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
@@ -1173,6 +1952,117 @@ static void ram_migration_cancel(void *opaque)
     migration_end();
 }
 
+/* Maximum number of ranges sent in a single discard command */
+#define MAX_DISCARDS_PER_COMMAND 12
+
+/**
+ * ram_postcopy_send_discard_bitmap: Tell the destination which pages to drop
+ *
+ * Every page that is still dirty at the switch to postcopy is either one
+ * that was never sent, or one that was sent and has since been modified;
+ * either way the destination mustn't use what it has (if anything), and
+ * will fault and ask for it instead.
+ *
+ * Called with the iothread lock held and the guest stopped.
+ *
+ * Returns: 0 on success, negative on error
+ *
+ * @ms: current migration state
+ */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+{
+    RAMBlock *block;
+    uint64_t starts[MAX_DISCARDS_PER_COMMAND];
+    uint64_t lengths[MAX_DISCARDS_PER_COMMAND];
+
+    trace_ram_postcopy_send_discard_bitmap();
+
+    rcu_read_lock();
+    /* This is the last sync; the guest is stopped */
+    migration_bitmap_sync();
+
+    /*
+     * From now on pages may be sent out of order, which the bulk stage
+     * shortcut in migration_bitmap_find_and_reset_dirty can't cope with.
+     */
+    ram_bulk_stage = false;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long end = first + (block->used_length >> TARGET_PAGE_BITS);
+        unsigned long run_start = find_next_bit(migration_bitmap, end, first);
+        unsigned int n = 0;
+
+        while (run_start < end) {
+            unsigned long run_end = find_next_zero_bit(migration_bitmap, end,
+                                                       run_start + 1);
+
+            starts[n] = (uint64_t)(run_start - first) << TARGET_PAGE_BITS;
+            lengths[n] = (uint64_t)(run_end - run_start) << TARGET_PAGE_BITS;
+            if (++n == MAX_DISCARDS_PER_COMMAND) {
+                qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                      n, starts, lengths);
+                n = 0;
+            }
+            if (run_end >= end) {
+                break;
+            }
+            run_start = find_next_bit(migration_bitmap, end, run_end + 1);
+        }
+        if (n) {
+            qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                  n, starts, lengths);
+        }
+    }
+    rcu_read_unlock();
+
+    return qemu_file_get_error(ms->file);
+}
+
+/**
+ * ram_discard_range: Discard a range of pages in a named RAMBlock
+ *
+ * Returns: 0 on success, negative on error
+ *
+ * @mis: current incoming migration state
+ * @block_name: name of the RAMBlock
+ * @start: offset of the range within the RAMBlock
+ * @length: length in bytes of the range
+ */
+int ram_discard_range(MigrationIncomingState *mis,
+                      const char *block_name,
+                      uint64_t start, size_t length)
+{
+    int ret = -1;
+    RAMBlock *rb;
+
+    trace_ram_discard_range(block_name, start, length);
+
+    rcu_read_lock();
+    rb = ram_find_block_by_idstr(block_name);
+    if (!rb) {
+        error_report("ram_discard_range: Failed to find block '%s'",
+                     block_name);
+        goto err;
+    }
+
+    if (start + length > rb->used_length) {
+        error_report("ram_discard_range: Overrun block '%s' (%" PRIu64
+                     "/%zu/" RAM_ADDR_FMT ")",
+                     block_name, start, length, rb->used_length);
+        goto err;
+    }
+
+    ret = postcopy_ram_discard_range(mis,
+                                     (uint8_t *)memory_region_get_ram_ptr(rb->mr)
+                                     + start, length);
+
+err:
+    rcu_read_unlock();
+
+    return ret;
+}
+
 static void reset_ram_globals(void)
 {
     last_seen_block = NULL;
@@ -1317,6 +2207,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    multifd_sync(f, &bytes_transferred);
     rcu_read_unlock();
 
     /*
@@ -1359,6 +2250,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    multifd_sync(f, &bytes_transferred);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     migration_end();
 
@@ -1559,16 +2451,93 @@ static void decompress_data_with_multi_threads(uint8_t *compbuf,
     }
 }
 
+/*
+ * Load RAM once postcopy is running; pages can't simply be written into
+ * guest memory because an access to a missing page would block, so each
+ * one is placed atomically.  Called from the postcopy listen thread.
+ */
+static int ram_load_postcopy(QEMUFile *f)
+{
+    int flags = 0, ret = 0;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    void *tmp_page = postcopy_get_tmp_page(mis);
+
+    if (!tmp_page) {
+        return -ENOMEM;
+    }
+
+    rcu_read_lock();
+    while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
+        ram_addr_t addr;
+        void *host;
+        uint8_t ch;
+
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        trace_ram_load_postcopy_loop((uint64_t)addr, flags);
+        switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+        case RAM_SAVE_FLAG_COMPRESS:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            ch = qemu_get_byte(f);
+            if (ch == 0) {
+                ret = postcopy_place_page_zero(mis, host);
+            } else {
+                memset(tmp_page, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, tmp_page);
+            }
+            break;
+        case RAM_SAVE_FLAG_PAGE:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            qemu_get_buffer(f, tmp_page, TARGET_PAGE_SIZE);
+            ret = qemu_file_get_error(f);
+            if (!ret) {
+                ret = postcopy_place_page(mis, host, tmp_page);
+            }
+            break;
+        case RAM_SAVE_FLAG_EOS:
+            /* normal exit */
+            break;
+        default:
+            error_report("Unknown combination of migration flags: %#x"
+                         " (postcopy mode)", flags);
+            ret = -EINVAL;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
     int len = 0;
+    PostcopyState ps = postcopy_state_get();
 
     seq_iter++;
 
     if (version_id != 4) {
-        ret = -EINVAL;
+        return -EINVAL;
+    }
+
+    if (ps == POSTCOPY_INCOMING_LISTENING || ps == POSTCOPY_INCOMING_RUNNING) {
+        return ram_load_postcopy(f);
     }
 
     /* This RCU critical section can be very long running.
@@ -1674,6 +2643,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1701,6 +2673,7 @@ static SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
+    .save_live_complete_postcopy = ram_save_complete,
     .save_live_pending = ram_save_pending,
     .load_state = ram_load,
     .cancel = ram_migration_cancel,
@@ -36,6 +36,7 @@
 #include "qmp-commands.h"
 #include "qemu/timer.h"
 #include "qapi-event.h"
+#include "migration/migration.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -65,6 +66,7 @@ struct BdrvDirtyBitmap {
     char *name;                 /* Optional non-empty unique ID */
     int64_t size;               /* Size of the bitmap (Number of sectors) */
     bool disabled;              /* Bitmap is read-only */
+    bool persistent;            /* Stored in the image by the format driver */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -80,6 +82,7 @@ static QLIST_HEAD(, BlockDriver) bdrv_drivers =
     QLIST_HEAD_INITIALIZER(bdrv_drivers);
 
 static void bdrv_dirty_bitmap_truncate(BlockDriverState *bs);
+static void bdrv_release_persistent_dirty_bitmaps(BlockDriverState *bs);
 /* If non-zero, use only whitelisted block drivers */
 static int use_bdrv_whitelist;
 
@@ -252,6 +255,7 @@ BlockDriverState *bdrv_new(void)
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
     notifier_with_return_list_init(&bs->before_write_notifiers);
+    notifier_with_return_list_init(&bs->after_write_notifiers);
     qemu_co_queue_init(&bs->throttled_reqs[0]);
     qemu_co_queue_init(&bs->throttled_reqs[1]);
     bs->refcnt = 1;
@@ -432,6 +436,27 @@ int bdrv_probe_geometry(BlockDriverState *bs, HDGeometry *geo)
     return -ENOTSUP;
 }
 
+/**
+ * Try to get a host file descriptor from which @bs can be read directly,
+ * at the same offsets and bypassing the block layer.
+ * On success return the descriptor, which must only be used for reading.
+ * On failure return -errno.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    /* Reads through the descriptor would bypass backing files,
+     * decryption and I/O throttling.
+     */
+    if (!drv || !drv->bdrv_get_host_fd || bs->backing_hd || bs->encrypted ||
+        bs->io_limits_enabled) {
+        return -ENOTSUP;
+    }
+
+    return drv->bdrv_get_host_fd(bs);
+}
+
 /*
  * Create a uniquely-named empty temporary file.
  * Return 0 upon success, otherwise a negative errno value.
@@ -899,6 +924,15 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
         goto free_and_fail;
     }
 
+    /* The bitmaps need the image size, so they can only be created now */
+    if (drv->bdrv_load_persistent_dirty_bitmaps) {
+        drv->bdrv_load_persistent_dirty_bitmaps(bs, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            local_err = NULL;
+        }
+    }
+
     assert(bdrv_opt_mem_align(bs) != 0);
     assert(bdrv_min_mem_align(bs) != 0);
     assert((bs->request_alignment != 0) || bs->sg);
@@ -1715,6 +1749,7 @@ void bdrv_reopen_abort(BDRVReopenState *reopen_state)
 void bdrv_close(BlockDriverState *bs)
 {
     BdrvAioNotifier *ban, *ban_next;
+    Error *local_err = NULL;
 
     if (bs->job) {
         block_job_cancel_sync(bs->job);
@@ -1725,6 +1760,12 @@ void bdrv_close(BlockDriverState *bs)
     notifier_list_notify(&bs->close_notifiers, bs);
 
     if (bs->drv) {
+        bdrv_store_persistent_dirty_bitmaps(bs, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+        }
+        bdrv_release_persistent_dirty_bitmaps(bs);
+
         if (bs->backing_hd) {
             BlockDriverState *backing_hd = bs->backing_hd;
             bdrv_set_backing_hd(bs, NULL);
@@ -1822,12 +1863,18 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
     /* i/o throttled req */
-    memcpy(&bs_dest->throttle_state,
-           &bs_src->throttle_state,
-           sizeof(ThrottleState));
+    bs_dest->throttle_state     = bs_src->throttle_state;
+    bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
+    bs_dest->pending_reqs[0]    = bs_src->pending_reqs[0];
+    bs_dest->pending_reqs[1]    = bs_src->pending_reqs[1];
     bs_dest->throttled_reqs[0]  = bs_src->throttled_reqs[0];
     bs_dest->throttled_reqs[1]  = bs_src->throttled_reqs[1];
-    bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
+    memcpy(&bs_dest->round_robin,
+           &bs_src->round_robin,
+           sizeof(bs_dest->round_robin));
+    memcpy(&bs_dest->throttle_timers,
+           &bs_src->throttle_timers,
+           sizeof(ThrottleTimers));
 
     /* r/w error */
     bs_dest->on_read_error      = bs_src->on_read_error;
@@ -1886,7 +1933,8 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
     assert(bs_new->io_limits_enabled == false);
-    assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->throttle_state == NULL);
+    assert(!throttle_timers_are_initialized(&bs_new->throttle_timers));
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1903,7 +1951,8 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     /* Check a few fields that should remain attached to the device */
     assert(bs_new->job == NULL);
     assert(bs_new->io_limits_enabled == false);
-    assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->throttle_state == NULL);
+    assert(!throttle_timers_are_initialized(&bs_new->throttle_timers));
 
     /* insert the nodes back into the graph node list if needed */
     if (bs_new->node_name[0] != '\0') {
@@ -1942,13 +1991,15 @@ static void bdrv_delete(BlockDriverState *bs)
     assert(!bs->job);
     assert(bdrv_op_blocker_is_empty(bs));
     assert(!bs->refcnt);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
+    /* Persistent bitmaps belong to the image and go away in bdrv_close() */
     bdrv_close(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
 
+    block_acct_cleanup(&bs->stats);
     g_free(bs);
 }
 
@@ -2778,6 +2829,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -2964,6 +3024,14 @@ void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
         error_setg_errno(errp, -ret, "Could not refresh total sector count");
         return;
     }
+
+    /* Incoming images skip the bitmaps in bdrv_open_common() */
+    if (bs->drv->bdrv_load_persistent_dirty_bitmaps) {
+        bs->drv->bdrv_load_persistent_dirty_bitmaps(bs, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+        }
+    }
 }
 
 void bdrv_invalidate_cache_all(Error **errp)
@@ -3159,6 +3227,28 @@ int bdrv_dirty_bitmap_create_successor(BlockDriverState *bs,
     return 0;
 }
 
+/* The image of a migrated VM belongs to the destination, which would not
+ * load the bitmaps, while the source would still store them at close */
+static int nb_persistent_dirty_bitmaps;
+static Error *persistent_dirty_bitmap_blocker;
+
+static void bdrv_persistent_dirty_bitmaps_changed(int delta)
+{
+    nb_persistent_dirty_bitmaps += delta;
+    assert(nb_persistent_dirty_bitmaps >= 0);
+
+    if (nb_persistent_dirty_bitmaps && !persistent_dirty_bitmap_blocker) {
+        error_setg(&persistent_dirty_bitmap_blocker, "Live migration is not "
+                   "supported while persistent dirty bitmaps exist");
+        migrate_add_blocker(persistent_dirty_bitmap_blocker);
+    } else if (!nb_persistent_dirty_bitmaps &&
+               persistent_dirty_bitmap_blocker) {
+        migrate_del_blocker(persistent_dirty_bitmap_blocker);
+        error_free(persistent_dirty_bitmap_blocker);
+        persistent_dirty_bitmap_blocker = NULL;
+    }
+}
+
 /**
  * For a bitmap with a successor, yield our name to the successor,
  * delete the old bitmap, and return a handle to the new bitmap.
@@ -3179,6 +3269,7 @@ BdrvDirtyBitmap *bdrv_dirty_bitmap_abdicate(BlockDriverState *bs,
     name = bitmap->name;
     bitmap->name = NULL;
     successor->name = name;
+    bdrv_dirty_bitmap_set_persistent(successor, bitmap->persistent);
     bitmap->successor = NULL;
     bdrv_release_dirty_bitmap(bs, bitmap);
 
@@ -3233,6 +3324,9 @@ void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
     QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
         if (bm == bitmap) {
             assert(!bdrv_dirty_bitmap_frozen(bm));
+            if (bitmap->persistent) {
+                bdrv_persistent_dirty_bitmaps_changed(-1);
+            }
             QLIST_REMOVE(bitmap, list);
             hbitmap_free(bitmap->bitmap);
             g_free(bitmap->name);
@@ -3268,6 +3362,7 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         info->has_name = !!bm->name;
         info->name = g_strdup(bm->name);
         info->status = bdrv_dirty_bitmap_status(bm);
+        info->persistent = bm->persistent;
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
@@ -3373,6 +3468,105 @@ int64_t bdrv_get_dirty_count(BdrvDirtyBitmap *bitmap)
     return hbitmap_count(bitmap->bitmap);
 }
 
+const char *bdrv_dirty_bitmap_name(const BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+/* Iterate over the dirty bitmaps of bs; pass NULL to get the first one */
+BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    return bitmap ? QLIST_NEXT(bitmap, list) : QLIST_FIRST(&bs->dirty_bitmaps);
+}
+
+void bdrv_dirty_bitmap_set_persistent(BdrvDirtyBitmap *bitmap,
+                                      bool persistent)
+{
+    assert(bitmap->name || !persistent);
+    if (bitmap->persistent != persistent) {
+        bdrv_persistent_dirty_bitmaps_changed(persistent ? 1 : -1);
+    }
+    bitmap->persistent = persistent;
+}
+
+bool bdrv_dirty_bitmap_get_persistent(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+uint64_t bdrv_dirty_bitmap_serialization_size(BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_serialization_size(bitmap->bitmap);
+}
+
+void bdrv_dirty_bitmap_serialize(BdrvDirtyBitmap *bitmap, uint8_t *buf)
+{
+    hbitmap_serialize(bitmap->bitmap, buf);
+}
+
+void bdrv_dirty_bitmap_deserialize(BdrvDirtyBitmap *bitmap,
+                                   const uint8_t *buf)
+{
+    hbitmap_deserialize(bitmap->bitmap, buf);
+}
+
+bool bdrv_can_store_persistent_dirty_bitmap(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        error_setg(errp, "Device '%s' has no medium",
+                   bdrv_get_device_or_node_name(bs));
+        return false;
+    }
+    if (!drv->bdrv_can_store_persistent_dirty_bitmap) {
+        error_setg(errp, "Format '%s' of node '%s' cannot store dirty bitmaps",
+                   drv->format_name, bdrv_get_device_or_node_name(bs));
+        return false;
+    }
+    return drv->bdrv_can_store_persistent_dirty_bitmap(bs, name, granularity,
+                                                       errp);
+}
+
+/* Write the persistent bitmaps of bs to the image.  The bitmaps are left
+ * attached to bs and keep tracking writes.
+ */
+void bdrv_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvDirtyBitmap *bm;
+
+    if (drv && drv->bdrv_store_persistent_dirty_bitmaps) {
+        drv->bdrv_store_persistent_dirty_bitmaps(bs, errp);
+        return;
+    }
+
+    /* The bitmaps may have moved to a node that cannot store them, e.g. by
+     * bdrv_append() */
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        if (bm->persistent) {
+            error_setg(errp, "Cannot store persistent dirty bitmap '%s'",
+                       bm->name);
+            return;
+        }
+    }
+}
+
+static void bdrv_release_persistent_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm, *next;
+
+    QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
+        if (bm->persistent) {
+            bdrv_release_dirty_bitmap(bs, bm);
+        }
+    }
+}
+
 /* Get a reference to bs */
 void bdrv_ref(BlockDriverState *bs)
 {
@@ -3690,8 +3884,8 @@ void bdrv_detach_aio_context(BlockDriverState *bs)
         baf->detach_aio_context(baf->opaque);
     }
 
-    if (bs->io_limits_enabled) {
-        throttle_detach_aio_context(&bs->throttle_state);
+    if (bs->throttle_state) {
+        throttle_timers_detach_aio_context(&bs->throttle_timers);
     }
     if (bs->drv->bdrv_detach_aio_context) {
         bs->drv->bdrv_detach_aio_context(bs);
@@ -3726,8 +3920,8 @@ void bdrv_attach_aio_context(BlockDriverState *bs,
     if (bs->drv->bdrv_attach_aio_context) {
         bs->drv->bdrv_attach_aio_context(bs, new_context);
     }
-    if (bs->io_limits_enabled) {
-        throttle_attach_aio_context(&bs->throttle_state, new_context);
+    if (bs->throttle_state) {
+        throttle_timers_attach_aio_context(&bs->throttle_timers, new_context);
     }
 
     QLIST_FOREACH(ban, &bs->aio_notifiers, list) {
@@ -25,6 +25,144 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
+
+void block_acct_cleanup(BlockAcctStats *stats)
+{
+    BlockAcctTimedStats *s, *next;
+
+    QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
+        g_free(s);
+    }
+    QSLIST_INIT(&stats->intervals);
+
+    block_latency_histograms_clear(stats);
+}
+
+void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
+{
+    BlockAcctTimedStats *s;
+    unsigned i;
+
+    s = g_new0(BlockAcctTimedStats, 1);
+    s->interval_length = interval_length;
+    QSLIST_INSERT_HEAD(&stats->intervals, s, entries);
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        timed_average_init(&s->latency[i], QEMU_CLOCK_REALTIME,
+                           (uint64_t) interval_length * NANOSECONDS_PER_SECOND);
+    }
+}
+
+BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
+                                              BlockAcctTimedStats *s)
+{
+    if (s == NULL) {
+        return QSLIST_FIRST(&stats->intervals);
+    } else {
+        return QSLIST_NEXT(s, entries);
+    }
+}
+
+static int block_acct_size_bucket(int64_t bytes)
+{
+    int bucket;
+
+    if (bytes <= (1 << BLOCK_ACCT_SIZE_MIN_BITS)) {
+        return 0;
+    }
+
+    bucket = 64 - clz64(bytes - 1) - BLOCK_ACCT_SIZE_MIN_BITS;
+    return MIN(bucket, BLOCK_ACCT_SIZE_BUCKETS - 1);
+}
+
+/* Returns the largest request size in bytes that @bucket counts, or 0 for the
+ * last, unbounded bucket */
+uint64_t block_acct_size_bucket_limit(int bucket)
+{
+    assert(bucket >= 0 && bucket < BLOCK_ACCT_SIZE_BUCKETS);
+
+    if (bucket == BLOCK_ACCT_SIZE_BUCKETS - 1) {
+        return 0;
+    }
+    return 1ULL << (BLOCK_ACCT_SIZE_MIN_BITS + bucket);
+}
+
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            uint64_t latency_ns)
+{
+    /* Binary search for the first boundary that is greater than the latency;
+     * its index is the index of the bin */
+    int lo = 0, hi = hist->nbins - 1;
+
+    if (hist->bins == NULL) {
+        return;
+    }
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    hist->bins[lo]++;
+}
+
+/*
+ * Enables the latency histogram for @type with the given boundaries, which
+ * must be strictly increasing, and resets its bins.  A NULL list disables the
+ * histogram.
+ */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    uint64List *entry;
+    uint64_t prev = 0;
+    int new_nbins = 1;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    for (entry = boundaries; entry; entry = entry->next) {
+        if (entry->value <= prev) {
+            return -EINVAL;
+        }
+        new_nbins++;
+        prev = entry->value;
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    hist->boundaries = NULL;
+    hist->bins = NULL;
+    hist->nbins = 0;
+
+    if (boundaries == NULL) {
+        return 0;
+    }
+
+    hist->nbins = new_nbins;
+    hist->boundaries = g_new(uint64_t, new_nbins - 1);
+    for (entry = boundaries, new_nbins = 0; entry; entry = entry->next) {
+        hist->boundaries[new_nbins++] = entry->value;
+    }
+    hist->bins = g_new0(uint64_t, hist->nbins);
+
+    return 0;
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_set(stats, i, NULL);
+    }
+}
 
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
@@ -38,12 +176,27 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
+    BlockAcctTimedStats *s;
+    int64_t latency_ns;
+    int bucket;
+
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
+    latency_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME)
+               - cookie->start_time_ns;
+
     stats->nr_bytes[cookie->type] += cookie->bytes;
     stats->nr_ops[cookie->type]++;
-    stats->total_time_ns[cookie->type] +=
-        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - cookie->start_time_ns;
+    stats->total_time_ns[cookie->type] += latency_ns;
+    bucket = block_acct_size_bucket(cookie->bytes);
+    stats->size_histogram[cookie->type][bucket]++;
+
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
+
+    QSLIST_FOREACH(s, &stats->intervals, entries) {
+        timed_average_account(&s->latency[cookie->type], latency_ns);
+    }
 }
 
 
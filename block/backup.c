@@ -25,6 +25,12 @@
 #define BACKUP_CLUSTER_SIZE (1 << BACKUP_CLUSTER_BITS)
 #define BACKUP_SECTORS_PER_CLUSTER (BACKUP_CLUSTER_SIZE / BDRV_SECTOR_SIZE)
 
+/* Adjacent clusters are copied with a single request of up to this size */
+#define BACKUP_MAX_BATCH_CLUSTERS 16
+
+/* Maximum number of copy coroutines started by the job */
+#define BACKUP_MAX_COPIES 8
+
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
@@ -34,7 +40,19 @@ typedef struct CowRequest {
     CoQueue wait_queue; /* coroutines blocked on this request */
 } CowRequest;
 
-typedef struct BackupBlockJob {
+typedef struct BackupBlockJob BackupBlockJob;
+
+/* A batch of clusters copied by a coroutine of the job */
+typedef struct BackupCopy {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int nb_clusters;
+    int ret;
+    bool error_is_read;
+    QSIMPLEQ_ENTRY(BackupCopy) next;
+} BackupCopy;
+
+struct BackupBlockJob {
     BlockJob common;
     BlockDriverState *target;
     /* bitmap for sync=dirty-bitmap */
@@ -47,7 +65,11 @@ typedef struct BackupBlockJob {
     uint64_t sectors_read;
     HBitmap *bitmap;
     QLIST_HEAD(, CowRequest) inflight_reqs;
-} BackupBlockJob;
+
+    int nb_copies;
+    bool waiting_for_copies;
+    QSIMPLEQ_HEAD(, BackupCopy) failed_copies;
+};
 
 /* See if in-flight requests overlap and wait for them to complete */
 static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
@@ -86,6 +108,23 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Return the number of sectors starting at @sector_num that read as zeroes,
+ * at most @nb_sectors.  Errors are not fatal, the data is just read then.
+ */
+static int coroutine_fn backup_zero_sectors(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors)
+{
+    int64_t ret;
+    int n;
+
+    ret = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors, &n);
+    if (ret < 0 || !(ret & BDRV_BLOCK_ZERO)) {
+        return 0;
+    }
+    return n;
+}
+
 static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read)
@@ -96,56 +135,84 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
     int ret = 0;
-    int64_t start, end;
-    int n;
+    int64_t start, end, total_sectors;
+    int n, nb_clusters, zero_sectors;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
     start = sector_num / BACKUP_SECTORS_PER_CLUSTER;
     end = DIV_ROUND_UP(sector_num + nb_sectors, BACKUP_SECTORS_PER_CLUSTER);
+    total_sectors = job->common.len / BDRV_SECTOR_SIZE;
 
     trace_backup_do_cow_enter(job, start, sector_num, nb_sectors);
 
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    while (start < end) {
         if (hbitmap_get(job->bitmap, start)) {
             trace_backup_do_cow_skip(job, start);
+            start++;
             continue; /* already copied */
         }
 
         trace_backup_do_cow_process(job, start);
 
-        n = MIN(BACKUP_SECTORS_PER_CLUSTER,
-                job->common.len / BDRV_SECTOR_SIZE -
-                start * BACKUP_SECTORS_PER_CLUSTER);
-
-        if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
+        /* Merge the following clusters that still need to be copied */
+        nb_clusters = 1;
+        while (start + nb_clusters < end &&
+               nb_clusters < BACKUP_MAX_BATCH_CLUSTERS &&
+               !hbitmap_get(job->bitmap, start + nb_clusters)) {
+            nb_clusters++;
         }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
 
-        ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, n,
-                            &bounce_qiov);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
-            }
-            goto out;
+        n = MIN(nb_clusters * BACKUP_SECTORS_PER_CLUSTER,
+                total_sectors - start * BACKUP_SECTORS_PER_CLUSTER);
+
+        /* Regions that read as zeroes are not read at all.  Only whole
+         * clusters can be marked as copied, so a partial zero cluster is
+         * read like data.
+         */
+        zero_sectors = backup_zero_sectors(bs,
+                                           start * BACKUP_SECTORS_PER_CLUSTER,
+                                           n);
+        if (zero_sectors < n) {
+            zero_sectors -= zero_sectors % BACKUP_SECTORS_PER_CLUSTER;
         }
 
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+        if (zero_sectors > 0) {
+            n = zero_sectors;
             ret = bdrv_co_write_zeroes(job->target,
                                        start * BACKUP_SECTORS_PER_CLUSTER,
                                        n, BDRV_REQ_MAY_UNMAP);
         } else {
-            ret = bdrv_co_writev(job->target,
-                                 start * BACKUP_SECTORS_PER_CLUSTER, n,
-                                 &bounce_qiov);
+            if (!bounce_buffer) {
+                bounce_buffer = qemu_blockalign(bs, BACKUP_MAX_BATCH_CLUSTERS *
+                                                    BACKUP_CLUSTER_SIZE);
+            }
+            iov.iov_base = bounce_buffer;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+            ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                &bounce_qiov);
+            if (ret < 0) {
+                trace_backup_do_cow_read_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = true;
+                }
+                goto out;
+            }
+
+            if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+                ret = bdrv_co_write_zeroes(job->target,
+                                           start * BACKUP_SECTORS_PER_CLUSTER,
+                                           n, BDRV_REQ_MAY_UNMAP);
+            } else {
+                ret = bdrv_co_writev(job->target,
+                                     start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                     &bounce_qiov);
+            }
         }
         if (ret < 0) {
             trace_backup_do_cow_write_fail(job, start, ret);
@@ -155,7 +222,9 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
             goto out;
         }
 
-        hbitmap_set(job->bitmap, start, 1);
+        nb_clusters = DIV_ROUND_UP(n, BACKUP_SECTORS_PER_CLUSTER);
+        hbitmap_set(job->bitmap, start, nb_clusters);
+        start += nb_clusters;
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
@@ -269,9 +338,142 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
+static void coroutine_fn backup_copy_entry(void *opaque)
+{
+    BackupCopy *copy = opaque;
+    BackupBlockJob *job = copy->job;
+
+    copy->ret = backup_do_cow(job->common.bs,
+                              copy->cluster * BACKUP_SECTORS_PER_CLUSTER,
+                              copy->nb_clusters * BACKUP_SECTORS_PER_CLUSTER,
+                              &copy->error_is_read);
+    if (copy->ret < 0) {
+        QSIMPLEQ_INSERT_TAIL(&job->failed_copies, copy, next);
+    } else {
+        g_free(copy);
+    }
+
+    job->nb_copies--;
+    if (job->waiting_for_copies) {
+        qemu_coroutine_enter(job->common.co, NULL);
+    }
+}
+
+static void backup_spawn_copy(BackupCopy *copy)
+{
+    Coroutine *co;
+
+    copy->job->nb_copies++;
+    co = qemu_coroutine_create(backup_copy_entry);
+    qemu_coroutine_enter(co, copy);
+}
+
+/* Wait until at most @max copies are in flight.  Failed copies are retried
+ * or reported depending on the error action.
+ */
+static int coroutine_fn backup_wait_for_copies(BackupBlockJob *job, int max)
+{
+    BackupCopy *copy;
+    int ret;
+
+    for (;;) {
+        while (job->nb_copies > max &&
+               QSIMPLEQ_EMPTY(&job->failed_copies)) {
+            job->waiting_for_copies = true;
+            qemu_coroutine_yield();
+            job->waiting_for_copies = false;
+        }
+
+        copy = QSIMPLEQ_FIRST(&job->failed_copies);
+        if (!copy) {
+            return 0;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&job->failed_copies, next);
+
+        /* Depending on error action, fail now or retry the copy */
+        if (backup_error_action(job, copy->error_is_read, -copy->ret) ==
+            BLOCK_ERROR_ACTION_REPORT) {
+            ret = copy->ret;
+            g_free(copy);
+            return ret;
+        }
+        if (yield_and_check(job)) {
+            g_free(copy);
+            continue;
+        }
+        backup_spawn_copy(copy);
+    }
+}
+
+/* Start copying @nb_clusters clusters from @cluster in a new coroutine */
+static int coroutine_fn backup_start_copy(BackupBlockJob *job,
+                                          int64_t cluster, int nb_clusters)
+{
+    int64_t end = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
+    BackupCopy *copy;
+    int ret;
+
+    ret = backup_wait_for_copies(job, BACKUP_MAX_COPIES - 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    copy = g_new0(BackupCopy, 1);
+    copy->job = job;
+    copy->cluster = cluster;
+    copy->nb_clusters = MIN(nb_clusters, end - cluster);
+    backup_spawn_copy(copy);
+
+    return 0;
+}
+
+/* Wait for all copies, whether the job succeeds or not */
+static void coroutine_fn backup_drain_copies(BackupBlockJob *job)
+{
+    BackupCopy *copy;
+
+    while (job->nb_copies > 0) {
+        job->waiting_for_copies = true;
+        qemu_coroutine_yield();
+        job->waiting_for_copies = false;
+    }
+
+    while ((copy = QSIMPLEQ_FIRST(&job->failed_copies)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&job->failed_copies, next);
+        g_free(copy);
+    }
+}
+
+/* Check whether a cluster has data in the topmost image */
+static int coroutine_fn backup_cluster_is_allocated(BlockDriverState *bs,
+                                                    int64_t cluster)
+{
+    int i, n;
+    int alloced = 0;
+
+    for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced =
+            bdrv_is_allocated(bs,
+                    cluster * BACKUP_SECTORS_PER_CLUSTER + i,
+                    BACKUP_SECTORS_PER_CLUSTER - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    return alloced;
+}
+
 static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
 {
-    bool error_is_read;
     int ret = 0;
     int clusters_per_iter;
     uint32_t granularity;
@@ -279,7 +481,6 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     int64_t cluster;
     int64_t end;
     int64_t last_cluster = -1;
-    BlockDriverState *bs = job->common.bs;
     HBitmapIter hbi;
 
     granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
@@ -296,20 +497,14 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
                                    BACKUP_CLUSTER_SIZE);
         }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
-            do {
-                if (yield_and_check(job)) {
-                    return ret;
-                }
-                ret = backup_do_cow(bs, cluster * BACKUP_SECTORS_PER_CLUSTER,
-                                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
-                if ((ret < 0) &&
-                    backup_error_action(job, error_is_read, -ret) ==
-                    BLOCK_ERROR_ACTION_REPORT) {
-                    return ret;
-                }
-            } while (ret < 0);
+        if (yield_and_check(job)) {
+            return ret;
+        }
+        ret = backup_start_copy(job, cluster, clusters_per_iter);
+        if (ret < 0) {
+            return ret;
         }
+        cluster += clusters_per_iter;
 
         /* If the bitmap granularity is smaller than the backup granularity,
          * we need to advance the iterator pointer to the next cluster. */
@@ -343,6 +538,7 @@ static void coroutine_fn backup_run(void *opaque)
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
+    QSIMPLEQ_INIT(&job->failed_copies);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
     start = 0;
@@ -368,60 +564,44 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
+        while (start < end) {
+            int nb_clusters = 0;
+
             if (yield_and_check(job)) {
                 break;
             }
 
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * BACKUP_SECTORS_PER_CLUSTER + i,
-                                BACKUP_SECTORS_PER_CLUSTER - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
+            /* Collect a batch of adjacent clusters.  In TOP mode, clusters
+             * that are only in the backing file are skipped.  FULL sync mode
+             * copies the whole drive. */
+            while (start + nb_clusters < end &&
+                   nb_clusters < BACKUP_MAX_BATCH_CLUSTERS) {
+                if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
+                    backup_cluster_is_allocated(bs, start + nb_clusters) == 0) {
+                    if (nb_clusters == 0) {
+                        start++;
                     }
+                    break;
                 }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
+                nb_clusters++;
+            }
+            if (nb_clusters == 0) {
+                continue;
             }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * BACKUP_SECTORS_PER_CLUSTER,
-                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
+
+            ret = backup_start_copy(job, start, nb_clusters);
             if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
+                break;
             }
+            start += nb_clusters;
         }
     }
 
+    if (ret >= 0 && !block_job_is_cancelled(&job->common)) {
+        ret = backup_wait_for_copies(job, 0);
+    }
+    backup_drain_copies(job);
+
     notifier_with_return_remove(&before_write);
 
     /* wait until pending backup_do_cow() calls have completed */
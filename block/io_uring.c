@@ -0,0 +1,537 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "block/block.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#include <linux/falloc.h>
+#endif
+
+/*
+ * Ring size (per-device).  Requests beyond what the rings can hold wait in
+ * the submit queue until earlier ones complete.
+ */
+#define MAX_ENTRIES 128
+
+typedef struct LuringState LuringState;
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    LuringState *s;
+    struct io_uring_sqe sqe;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    off_t offset;
+
+    /* Buffered reads can come back short before EOF; the rest is resubmitted
+     * with this */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct {
+    int plugged;
+    /* requests in the submit queue */
+    unsigned int pending;
+    /* requests in the submission ring that the kernel hasn't taken yet */
+    unsigned int in_queue;
+    /* requests taken by the kernel that haven't completed yet */
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+    /* requests that the kernel refused, completed by the completion BH */
+    QSIMPLEQ_HEAD(, LuringAIOCB) failed_queue;
+} LuringQueue;
+
+struct LuringState {
+    int ring_fd;
+    EventNotifier e;
+
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+
+    /* Submission ring, shared with the kernel */
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* Completion ring, shared with the kernel */
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe *cqes;
+
+    /* IORING_OP_FALLOCATE needs Linux 5.6 */
+    bool has_fallocate;
+};
+
+static void ioq_submit(LuringState *s);
+
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *acb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov = &acb->resubmit_qiov;
+
+    acb->total_read += nread;
+
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, acb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, acb->qiov, acb->total_read,
+                      acb->qiov->size - acb->total_read);
+
+    acb->sqe.addr = (uintptr_t)resubmit_qiov->iov;
+    acb->sqe.len = resubmit_qiov->niov;
+    acb->sqe.off = acb->offset + acb->total_read;
+
+    QSIMPLEQ_INSERT_HEAD(&s->io_q.submit_queue, acb, next);
+    s->io_q.pending++;
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *acb)
+{
+    int ret = acb->ret;
+
+    switch (acb->sqe.opcode) {
+    case IORING_OP_READV:
+        if (ret > 0 && acb->total_read + ret < acb->qiov->size) {
+            /* Not at EOF yet, go on reading */
+            luring_resubmit_short_read(s, acb, ret);
+            return;
+        }
+        if (ret >= 0) {
+            /* Short reads mean EOF, pad with zeros. */
+            ret += acb->total_read;
+            qemu_iovec_memset(acb->qiov, ret, 0, acb->qiov->size - ret);
+            ret = 0;
+        }
+        break;
+    case IORING_OP_WRITEV:
+        if (ret == acb->qiov->size) {
+            ret = 0;
+        } else if (ret >= 0) {
+            ret = -EINVAL;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (acb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&acb->resubmit_qiov);
+    }
+    acb->common.cb(acb->common.opaque, ret);
+
+    qemu_aio_unref(acb);
+}
+
+/* The completion BH reaps completed requests straight from the completion
+ * ring, without a system call, and invokes their callbacks.
+ *
+ * Like in linux-aio.c, nested event loops are supported: the ring head is
+ * advanced before each callback runs, and the BH reschedules itself so that
+ * a nested event loop picks up the remaining completions.
+ */
+static void luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (*s->cq_head == atomic_read(s->cq_tail) &&
+        QSIMPLEQ_EMPTY(&s->io_q.failed_queue)) {
+        goto submit;
+    }
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.failed_queue)) {
+        LuringAIOCB *acb = QSIMPLEQ_FIRST(&s->io_q.failed_queue);
+
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.failed_queue, next);
+        luring_process_completion(s, acb);
+    }
+
+    while (*s->cq_head != atomic_read(s->cq_tail)) {
+        unsigned head = *s->cq_head;
+        struct io_uring_cqe *cqe;
+        LuringAIOCB *acb;
+
+        smp_rmb();
+        cqe = &s->cqes[head & s->cq_mask];
+        acb = (LuringAIOCB *)(uintptr_t)cqe->user_data;
+        acb->ret = cqe->res;
+
+        /* Done with the entry, let the kernel reuse it */
+        smp_mb();
+        atomic_set(s->cq_head, head + 1);
+        s->io_q.in_flight--;
+
+        luring_process_completion(s, acb);
+    }
+
+submit:
+    /* A blocked queue is retried even when plugged, the unplug does not */
+    if ((!s->io_q.plugged || s->io_q.blocked) &&
+        (s->io_q.in_queue || !QSIMPLEQ_EMPTY(&s->io_q.submit_queue))) {
+        ioq_submit(s);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (*s->cq_head == atomic_read(s->cq_tail)) {
+        return false;
+    }
+
+    event_notifier_test_and_clear(&s->e);
+    qemu_bh_schedule(s->completion_bh);
+    return true;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    QSIMPLEQ_INIT(&io_q->failed_queue);
+    io_q->plugged = 0;
+    io_q->pending = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/*
+ * Take back the requests that the kernel did not consume from the
+ * submission ring and complete them with @ret.
+ */
+static void ioq_fail_queued(LuringState *s, int ret)
+{
+    unsigned tail = *s->sq_tail;
+    unsigned head = tail - s->io_q.in_queue;
+    unsigned i;
+
+    for (i = head; i != tail; i++) {
+        LuringAIOCB *acb;
+
+        acb = (LuringAIOCB *)(uintptr_t)s->sqes[i & s->sq_mask].user_data;
+        acb->ret = ret;
+        QSIMPLEQ_INSERT_TAIL(&s->io_q.failed_queue, acb, next);
+    }
+    atomic_set(s->sq_tail, head);
+    s->io_q.in_queue = 0;
+    qemu_bh_schedule(s->completion_bh);
+}
+
+/*
+ * Move as many queued requests as fit into the submission ring and hand
+ * them all to the kernel with a single system call.
+ */
+static void ioq_submit(LuringState *s)
+{
+    unsigned tail = *s->sq_tail;
+    LuringAIOCB *acb;
+    int ret;
+
+    /* Never have more requests outstanding than the completion ring holds */
+    while (!QSIMPLEQ_EMPTY(&s->io_q.submit_queue) &&
+           tail - atomic_read(s->sq_head) < s->sq_entries &&
+           s->io_q.in_queue + s->io_q.in_flight < s->cq_entries) {
+        unsigned idx = tail & s->sq_mask;
+
+        acb = QSIMPLEQ_FIRST(&s->io_q.submit_queue);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        s->io_q.pending--;
+
+        s->sqes[idx] = acb->sqe;
+        s->sq_array[idx] = idx;
+        tail++;
+        s->io_q.in_queue++;
+    }
+
+    /* The entries must be visible before the kernel sees the new tail */
+    smp_wmb();
+    atomic_set(s->sq_tail, tail);
+
+    if (s->io_q.in_queue == 0) {
+        return;
+    }
+
+    do {
+        ret = syscall(__NR_io_uring_enter, s->ring_fd, s->io_q.in_queue, 0, 0,
+                      NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EBUSY) {
+            ioq_fail_queued(s, -errno);
+            s->io_q.blocked = false;
+            return;
+        }
+        /* Out of resources; try again when something completes, or from
+         * the completion BH if nothing is in flight */
+        if (s->io_q.in_flight == 0) {
+            qemu_bh_schedule(s->completion_bh);
+        }
+        ret = 0;
+    }
+
+    s->io_q.in_queue -= ret;
+    s->io_q.in_flight += ret;
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    LuringState *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.submit_queue)) {
+        ioq_submit(s);
+    }
+}
+
+/*
+ * Submit a read, write, flush or discard.  Returns NULL if the kernel can't
+ * do this type of request through io_uring, in which case the caller should
+ * fall back to the thread pool.
+ */
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringState *s = aio_ctx;
+    LuringAIOCB *acb;
+    off_t offset = sector_num * BDRV_SECTOR_SIZE;
+    struct io_uring_sqe sqe;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = fd;
+
+    switch (type & QEMU_AIO_TYPE_MASK) {
+    case QEMU_AIO_WRITE:
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.addr = (uintptr_t)qiov->iov;
+        sqe.len = qiov->niov;
+        sqe.off = offset;
+        break;
+    case QEMU_AIO_READ:
+        sqe.opcode = IORING_OP_READV;
+        sqe.addr = (uintptr_t)qiov->iov;
+        sqe.len = qiov->niov;
+        sqe.off = offset;
+        break;
+    case QEMU_AIO_FLUSH:
+        sqe.opcode = IORING_OP_FSYNC;
+        sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    case QEMU_AIO_DISCARD:
+        if (!s->has_fallocate) {
+            return NULL;
+        }
+        sqe.opcode = IORING_OP_FALLOCATE;
+        sqe.off = offset;
+        sqe.addr = (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+        sqe.len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        break;
+#endif
+    default:
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    acb->s = s;
+    acb->ret = -EINPROGRESS;
+    acb->qiov = qiov;
+    acb->offset = offset;
+    acb->total_read = 0;
+    memset(&acb->resubmit_qiov, 0, sizeof(acb->resubmit_qiov));
+    acb->sqe = sqe;
+    acb->sqe.user_data = (uintptr_t)acb;
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, acb, next);
+    s->io_q.pending++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.pending >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return &acb->common;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    LuringState *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    LuringState *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, luring_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e, luring_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, luring_poll_cb);
+}
+
+static bool luring_has_op(LuringState *s, int op)
+{
+    size_t len = sizeof(struct io_uring_probe) +
+                 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = g_malloc0(len);
+    bool ret = false;
+
+    if (syscall(__NR_io_uring_register, s->ring_fd, IORING_REGISTER_PROBE,
+                probe, 256) == 0 && op <= probe->last_op) {
+        ret = probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+    }
+
+    g_free(probe);
+    return ret;
+}
+
+void *luring_init(void)
+{
+    LuringState *s;
+    struct io_uring_params p;
+    int efd;
+
+    s = g_malloc0(sizeof(*s));
+    s->sq_ptr = s->cq_ptr = s->sqes = MAP_FAILED;
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_free_state;
+    }
+
+    memset(&p, 0, sizeof(p));
+    s->ring_fd = syscall(__NR_io_uring_setup, MAX_ENTRIES, &p);
+    if (s->ring_fd < 0) {
+        goto out_close_efd;
+    }
+
+    s->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    s->sq_ptr = mmap(NULL, s->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, s->ring_fd,
+                     IORING_OFF_SQ_RING);
+    s->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    s->cq_ptr = mmap(NULL, s->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, s->ring_fd,
+                     IORING_OFF_CQ_RING);
+    s->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    s->sqes = mmap(NULL, s->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_SQES);
+    if (s->sq_ptr == MAP_FAILED || s->cq_ptr == MAP_FAILED ||
+        s->sqes == MAP_FAILED) {
+        goto out_unmap;
+    }
+
+    s->sq_head = s->sq_ptr + p.sq_off.head;
+    s->sq_tail = s->sq_ptr + p.sq_off.tail;
+    s->sq_mask = *(unsigned *)(s->sq_ptr + p.sq_off.ring_mask);
+    s->sq_entries = p.sq_entries;
+    s->sq_array = s->sq_ptr + p.sq_off.array;
+
+    s->cq_head = s->cq_ptr + p.cq_off.head;
+    s->cq_tail = s->cq_ptr + p.cq_off.tail;
+    s->cq_mask = *(unsigned *)(s->cq_ptr + p.cq_off.ring_mask);
+    s->cq_entries = p.cq_entries;
+    s->cqes = s->cq_ptr + p.cq_off.cqes;
+
+    /* Completions are signalled through the event notifier */
+    efd = event_notifier_get_fd(&s->e);
+    if (syscall(__NR_io_uring_register, s->ring_fd, IORING_REGISTER_EVENTFD,
+                &efd, 1) < 0) {
+        goto out_unmap;
+    }
+
+    s->has_fallocate = luring_has_op(s, IORING_OP_FALLOCATE);
+    ioq_init(&s->io_q);
+
+    return s;
+
+out_unmap:
+    if (s->sqes != MAP_FAILED) {
+        munmap(s->sqes, s->sqes_size);
+    }
+    if (s->cq_ptr != MAP_FAILED) {
+        munmap(s->cq_ptr, s->cq_size);
+    }
+    if (s->sq_ptr != MAP_FAILED) {
+        munmap(s->sq_ptr, s->sq_size);
+    }
+    close(s->ring_fd);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_)
+{
+    LuringState *s = s_;
+
+    munmap(s->sqes, s->sqes_size);
+    munmap(s->cq_ptr, s->cq_size);
+    munmap(s->sq_ptr, s->sq_size);
+    close(s->ring_fd);
+    event_notifier_cleanup(&s->e);
+    g_free(s);
+}
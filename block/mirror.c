@@ -20,6 +20,11 @@
 #define SLICE_TIME    100000000ULL /* ns */
 #define MAX_IN_FLIGHT 16
 
+/* In write-blocking mode, a target write that takes this many times longer
+ * than the fastest recent one means the target is congested.
+ */
+#define CONGESTION_FACTOR 4
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -40,6 +45,7 @@ typedef struct MirrorBlockJob {
     Error *replace_blocker;
     bool is_none_mode;
     BlockdevOnError on_source_error, on_target_error;
+    MirrorCopyMode copy_mode;
     bool synced;
     bool should_complete;
     int64_t sector_num;
@@ -57,6 +63,21 @@ typedef struct MirrorBlockJob {
     int in_flight;
     int sectors_in_flight;
     int ret;
+    bool waiting_for_io;
+
+    /* Limits on background copies, adapted to the target latency in
+     * write-blocking mode */
+    int max_in_flight;
+    int max_op_chunks;
+    int64_t min_latency_ns;
+
+    /* Write-blocking mode: guest writes are mirrored while this is true */
+    bool active;
+    NotifierWithReturn before_write;
+    NotifierWithReturn after_write;
+    QLIST_HEAD(, MirrorActiveOp) active_ops;
+    CoQueue active_wait;
+    int active_waiters;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -64,8 +85,17 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    int64_t write_start_ns;
 } MirrorOp;
 
+/* A guest write that is being mirrored to the target */
+typedef struct MirrorActiveOp {
+    BdrvTrackedRequest *req;
+    int64_t chunk_num;
+    int nb_chunks;
+    QLIST_ENTRY(MirrorActiveOp) next;
+} MirrorActiveOp;
+
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
 {
@@ -79,6 +109,45 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+static void mirror_update_limits(MirrorBlockJob *s, int64_t latency_ns)
+{
+    int max_op_chunks = s->buf_size / s->granularity;
+
+    /* Let the baseline creep up, so that a single fast request is not taken
+     * as a reference forever.
+     */
+    latency_ns = MAX(latency_ns, 1);
+    s->min_latency_ns += s->min_latency_ns >> 6;
+    if (s->min_latency_ns == 0 || latency_ns < s->min_latency_ns) {
+        s->min_latency_ns = latency_ns;
+    }
+
+    if (latency_ns > s->min_latency_ns * CONGESTION_FACTOR) {
+        s->max_in_flight = MAX(s->max_in_flight / 2, 1);
+        s->max_op_chunks = MAX(s->max_op_chunks / 2, 1);
+    } else if (s->max_in_flight < MAX_IN_FLIGHT) {
+        s->max_in_flight++;
+    } else if (s->max_op_chunks < max_op_chunks) {
+        s->max_op_chunks++;
+    }
+
+    trace_mirror_update_limits(s, latency_ns, s->max_in_flight,
+                               s->max_op_chunks);
+}
+
+/* Restart the guest writes that wait for in-flight chunks.  Must not be
+ * called from the job coroutine, the guest writes may re-enter it.
+ */
+static void mirror_wake_active_waiters(MirrorBlockJob *s)
+{
+    int n = s->active_waiters;
+
+    /* Waiters that still conflict queue up again at the tail */
+    while (n-- > 0 && qemu_co_enter_next(&s->active_wait)) {
+        /* nothing */
+    }
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -111,15 +180,27 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     qemu_iovec_destroy(&op->qiov);
     g_slice_free(MirrorOp, op);
 
-    /* Enter coroutine when it is not sleeping.  The coroutine sleeps to
-     * rate-limit itself.  The coroutine will eventually resume since there is
-     * a sleep timeout so don't wake it early.
+    mirror_wake_active_waiters(s);
+
+    /* Enter the coroutine only if it waits for I/O.  The coroutine sleeps to
+     * rate-limit itself and will eventually resume since there is a sleep
+     * timeout, so don't wake it early; and it must not be entered while it
+     * waits for anything else, e.g. a block status query.
      */
-    if (s->common.busy) {
+    if (s->waiting_for_io) {
         qemu_coroutine_enter(s->common.co, NULL);
     }
 }
 
+/* Wait until an in-flight operation completes */
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
 static void mirror_write_complete(void *opaque, int ret)
 {
     MirrorOp *op = opaque;
@@ -132,6 +213,9 @@ static void mirror_write_complete(void *opaque, int ret)
         if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
         }
+    } else if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        mirror_update_limits(s, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                op->write_start_ns);
     }
     mirror_iteration_done(op, ret);
 }
@@ -152,6 +236,7 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+    op->write_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
                     mirror_write_complete, op);
 }
@@ -198,7 +283,12 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
+    }
+
+    /* In write-blocking mode, a guest write may have copied it meanwhile */
+    if (!bdrv_get_dirty(source, s->dirty_bitmap, sector_num)) {
+        return 0;
     }
 
     do {
@@ -209,6 +299,9 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             assert(nb_sectors > 0);
             break;
         }
+        if (nb_chunks >= s->max_op_chunks) {
+            break;
+        }
 
         added_sectors = sectors_per_chunk;
         if (s->cow_bitmap && !test_bit(next_chunk, s->cow_bitmap)) {
@@ -234,7 +327,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
          */
         while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
             trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
-            qemu_coroutine_yield();
+            mirror_wait_for_io(s);
         }
         if (s->buf_free_count < nb_chunks + added_chunks) {
             trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
@@ -314,8 +407,166 @@ static void mirror_free_init(MirrorBlockJob *s)
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
+    }
+}
+
+static MirrorActiveOp *mirror_find_active_op(MirrorBlockJob *s,
+                                             BdrvTrackedRequest *req)
+{
+    MirrorActiveOp *op;
+
+    QLIST_FOREACH(op, &s->active_ops, next) {
+        if (op->req == req) {
+            return op;
+        }
+    }
+    return NULL;
+}
+
+/* Decide whether a guest write is mirrored synchronously.  Only writes that
+ * touch already copied chunks are; the others just dirty the bitmap and are
+ * left to the background copy.  The chunks are marked in flight until the
+ * write completes, so that neither the background copy nor other guest
+ * writes touch them in the meantime.
+ */
+static int coroutine_fn mirror_before_write_notify(
+        NotifierWithReturn *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t start, end, chunk;
+    MirrorActiveOp *op;
+
+    if (!s->active || ((req->offset | req->bytes) & (BDRV_SECTOR_SIZE - 1))) {
+        return 0;
+    }
+
+    /* Zero writes may be notified once for each part of the request */
+    if (mirror_find_active_op(s, req)) {
+        return 0;
+    }
+
+    start = req->offset / s->granularity;
+    end = DIV_ROUND_UP(req->offset + req->bytes, s->granularity);
+    if (end > DIV_ROUND_UP(s->bdev_length, s->granularity)) {
+        return 0;
     }
+
+    while (find_next_bit(s->in_flight_bitmap, end, start) < end) {
+        s->active_waiters++;
+        qemu_co_queue_wait(&s->active_wait);
+        s->active_waiters--;
+        if (!s->active) {
+            return 0;
+        }
+    }
+
+    for (chunk = start; chunk < end; chunk++) {
+        if (bdrv_get_dirty(bs, s->dirty_bitmap, chunk * sectors_per_chunk)) {
+            return 0;
+        }
+    }
+
+    op = g_new(MirrorActiveOp, 1);
+    *op = (MirrorActiveOp) {
+        .req        = req,
+        .chunk_num  = start,
+        .nb_chunks  = end - start,
+    };
+    QLIST_INSERT_HEAD(&s->active_ops, op, next);
+    bitmap_set(s->in_flight_bitmap, start, end - start);
+
+    return 0;
+}
+
+/* Copy a guest write that was claimed by mirror_before_write_notify() */
+static int coroutine_fn mirror_after_write_notify(NotifierWithReturn *notifier,
+                                                  void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, after_write);
+    BdrvTrackedRequest *req = opaque;
+    int64_t sector_num = req->offset >> BDRV_SECTOR_BITS;
+    int nb_sectors = req->bytes >> BDRV_SECTOR_BITS;
+    int64_t sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    MirrorActiveOp *op;
+    int64_t start_ns;
+    int ret;
+
+    op = mirror_find_active_op(s, req);
+    if (!op) {
+        return 0;
+    }
+
+    /* On failure, the source was dirtied and the background copy will
+     * retry; the guest write itself does not fail.
+     */
+    if (req->ret >= 0) {
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (req->qiov) {
+            ret = bdrv_co_writev(s->target, sector_num, nb_sectors, req->qiov);
+        } else {
+            ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors, 0);
+        }
+        trace_mirror_active_write(s, sector_num, nb_sectors, ret);
+
+        if (ret >= 0) {
+            mirror_update_limits(s, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                    start_ns);
+
+            /* The claimed chunks were clean before the write and nobody
+             * else could write to them while they were in flight, so the
+             * parts that the write did not touch are still in sync.  The
+             * source marked them dirty anyway, undo that.
+             */
+            bdrv_reset_dirty_bitmap(s->dirty_bitmap,
+                                    op->chunk_num * sectors_per_chunk,
+                                    op->nb_chunks * sectors_per_chunk);
+        } else if (mirror_error_action(s, false, -ret) ==
+                   BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
+            s->ret = ret;
+        }
+    }
+
+    bitmap_clear(s->in_flight_bitmap, op->chunk_num, op->nb_chunks);
+    QLIST_REMOVE(op, next);
+    g_free(op);
+
+    mirror_wake_active_waiters(s);
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+
+    return 0;
+}
+
+static void mirror_start_active(MirrorBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+
+    QLIST_INIT(&s->active_ops);
+    qemu_co_queue_init(&s->active_wait);
+    s->before_write.notify = mirror_before_write_notify;
+    s->after_write.notify = mirror_after_write_notify;
+    bdrv_add_before_write_notifier(bs, &s->before_write);
+    bdrv_add_after_write_notifier(bs, &s->after_write);
+    s->active = true;
+}
+
+static void coroutine_fn mirror_stop_active(MirrorBlockJob *s)
+{
+    /* Waiting guest writes give up when they are restarted, claimed ones
+     * wake us up when they are done.
+     */
+    s->active = false;
+    while (s->active_waiters > 0 || !QLIST_EMPTY(&s->active_ops)) {
+        mirror_wait_for_io(s);
+    }
+
+    notifier_with_return_remove(&s->before_write);
+    notifier_with_return_remove(&s->after_write);
 }
 
 typedef struct {
@@ -426,6 +677,9 @@ static void coroutine_fn mirror_run(void *opaque)
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     mirror_free_init(s);
 
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->max_op_chunks = s->buf_size / s->granularity;
+
     if (!s->is_none_mode) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
         BlockDriverState *base = s->base;
@@ -448,6 +702,13 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    /* Guest writes can only be mirrored once the dirty bitmap is complete,
+     * or chunks that the loop above has not reached yet look clean.
+     */
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        mirror_start_active(s);
+    }
+
     bdrv_dirty_iter_init(s->dirty_bitmap, &s->hbi);
     last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     for (;;) {
@@ -475,10 +736,10 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
-                qemu_coroutine_yield();
+                mirror_wait_for_io(s);
                 continue;
             } else if (cnt != 0) {
                 delay_ns = mirror_iteration(s);
@@ -547,6 +808,9 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    if (s->active) {
+        mirror_stop_active(s);
+    }
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -654,7 +918,8 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
                              BlockCompletionFunc *cb,
                              void *opaque, Error **errp,
                              const BlockJobDriver *driver,
-                             bool is_none_mode, BlockDriverState *base)
+                             bool is_none_mode, BlockDriverState *base,
+                             MirrorCopyMode copy_mode)
 {
     MirrorBlockJob *s;
 
@@ -683,6 +948,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->target = target;
     s->is_none_mode = is_none_mode;
     s->base = base;
+    s->copy_mode = copy_mode;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
 
@@ -701,7 +967,8 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   const char *replaces,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
@@ -718,7 +985,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     mirror_start_job(bs, target, replaces,
                      speed, granularity, buf_size,
                      on_source_error, on_target_error, cb, opaque, errp,
-                     &mirror_job_driver, is_none_mode, base);
+                     &mirror_job_driver, is_none_mode, base, copy_mode);
 }
 
 void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
@@ -766,7 +1033,8 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
     bdrv_ref(base);
     mirror_start_job(bs, base, NULL, speed, 0, 0,
                      on_error, on_error, cb, opaque, &local_err,
-                     &commit_active_job_driver, false, base);
+                     &commit_active_job_driver, false, base,
+                     MIRROR_COPY_MODE_BACKGROUND);
     if (local_err) {
         error_propagate(errp, local_err);
         goto error_restore_flags;
@@ -29,37 +29,51 @@
 #include "nbd-client.h"
 #include "qemu/sockets.h"
 
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ ((uint64_t)(intptr_t)conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ ((uint64_t)(intptr_t)conn))
 
-static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
+static void nbd_recv_coroutines_enter_all(NbdConnection *s)
 {
+    int queue_depth = nbd_get_client_session(s->bs)->queue_depth;
     int i;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < queue_depth; i++) {
         if (s->recv_coroutine[i]) {
             qemu_coroutine_enter(s->recv_coroutine[i], NULL);
         }
     }
 }
 
+/* A broken connection fails the whole session */
 static void nbd_teardown_connection(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
+    int i;
 
     /* finish any pending coroutines */
-    shutdown(client->sock, 2);
-    nbd_recv_coroutines_enter_all(client);
+    for (i = 0; i < client->nb_connections; i++) {
+        conn = &client->connections[i];
+        if (conn->sock != -1) {
+            shutdown(conn->sock, 2);
+            nbd_recv_coroutines_enter_all(conn);
+        }
+    }
 
     nbd_client_detach_aio_context(bs);
-    closesocket(client->sock);
-    client->sock = -1;
+    for (i = 0; i < client->nb_connections; i++) {
+        conn = &client->connections[i];
+        if (conn->sock != -1) {
+            closesocket(conn->sock);
+            conn->sock = -1;
+        }
+    }
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdConnection *s = opaque;
+    BlockDriverState *bs = s->bs;
     uint64_t i;
     int ret;
 
@@ -82,7 +96,7 @@ static void nbd_reply_ready(void *opaque)
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
     i = HANDLE_TO_INDEX(s, s->reply.handle);
-    if (i >= MAX_NBD_REQUESTS) {
+    if (i >= nbd_get_client_session(bs)->queue_depth) {
         goto fail;
     }
 
@@ -97,37 +111,37 @@ fail:
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdConnection *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine, NULL);
+    qemu_coroutine_enter(s->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NbdConnection *s,
                                struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdClientSession *client = nbd_get_client_session(s->bs);
     AioContext *aio_context;
     int rc, ret, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < client->queue_depth; i++) {
         if (s->recv_coroutine[i] == NULL) {
             s->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
-    assert(i < MAX_NBD_REQUESTS);
+    assert(i < client->queue_depth);
     request->handle = INDEX_TO_HANDLE(s, i);
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->bs);
 
     aio_set_fd_handler(aio_context, s->sock,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, s);
     if (qiov) {
-        if (!s->is_unix) {
+        if (!client->is_unix) {
             socket_set_cork(s->sock, 1);
         }
         rc = nbd_send_request(s->sock, request);
@@ -138,35 +152,163 @@ static int nbd_co_send_request(BlockDriverState *bs,
                 rc = -EIO;
             }
         }
-        if (!s->is_unix) {
+        if (!client->is_unix) {
             socket_set_cork(s->sock, 0);
         }
     } else {
         rc = nbd_send_request(s->sock, request);
     }
-    aio_set_fd_handler(aio_context, s->sock, nbd_reply_ready, NULL, bs);
+    aio_set_fd_handler(aio_context, s->sock, nbd_reply_ready, NULL, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
+/* The first extent of a block status reply */
+typedef struct NbdExtent {
+    uint32_t length;
+    uint32_t flags;
+} NbdExtent;
+
+static int nbd_co_drop(int sock, uint32_t size)
+{
+    uint8_t buf[512];
+    uint32_t n;
+
+    while (size > 0) {
+        n = MIN(size, sizeof(buf));
+        if (qemu_co_recv(sock, buf, n) != n) {
+            return -EIO;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+/* Read the payload of the structured reply chunk in s->reply.  Returns
+ * a negative value if the server broke the protocol, the error carried
+ * by an error chunk, or 0.  The length of data and hole chunks is added
+ * to *covered.
+ */
+static int nbd_co_receive_chunk(NbdConnection *s,
+                                struct nbd_request *request,
+                                QEMUIOVector *qiov, int offset,
+                                NbdExtent *extent, uint64_t *covered)
+{
+    struct nbd_reply *chunk = &s->reply;
+    uint8_t buf[4 + 8];
+    uint64_t pos;
+    uint32_t len;
+    int error;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return chunk->length ? -EINVAL : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || chunk->length < 8 ||
+            qemu_co_recv(s->sock, buf, 8) != 8) {
+            return -EINVAL;
+        }
+        pos = be64_to_cpup((uint64_t *)buf);
+        if (chunk->type == NBD_REPLY_TYPE_OFFSET_DATA) {
+            len = chunk->length - 8;
+        } else {
+            if (chunk->length != 8 + 4 ||
+                qemu_co_recv(s->sock, buf, 4) != 4) {
+                return -EINVAL;
+            }
+            len = be32_to_cpup((uint32_t *)buf);
+        }
+        if (pos < request->from || len > request->len ||
+            pos - request->from > request->len - len) {
+            return -EINVAL;
+        }
+
+        /* Chunks may not overlap, so together they can't be longer than
+         * the request */
+        *covered += len;
+        if (*covered > request->len) {
+            return -EINVAL;
+        }
+
+        offset += pos - request->from;
+        if (chunk->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            qemu_iovec_memset(qiov, offset, 0, len);
+        } else if (qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                                 offset, len) != len) {
+            return -EIO;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if (!extent || chunk->length < 4 + 8 || (chunk->length - 4) % 8 ||
+            qemu_co_recv(s->sock, buf, 4 + 8) != 4 + 8 ||
+            be32_to_cpup((uint32_t *)buf) !=
+            nbd_get_client_session(s->bs)->ext.meta_context_id) {
+            return -EINVAL;
+        }
+        extent->length = be32_to_cpup((uint32_t *)(buf + 4));
+        extent->flags = be32_to_cpup((uint32_t *)(buf + 8));
+        return nbd_co_drop(s->sock, chunk->length - (4 + 8));
+
+    default:
+        if (!NBD_REPLY_TYPE_IS_ERR(chunk->type) || chunk->length < 4 + 2 ||
+            qemu_co_recv(s->sock, buf, 4) != 4 ||
+            nbd_co_drop(s->sock, chunk->length - 4) < 0) {
+            return -EINVAL;
+        }
+        error = nbd_errno_to_system_errno(be32_to_cpup((uint32_t *)buf));
+        return error ? error : EIO;
+    }
+}
+
+static void nbd_co_receive_reply(NbdConnection *s,
     struct nbd_request *request, struct nbd_reply *reply,
-    QEMUIOVector *qiov, int offset)
+    QEMUIOVector *qiov, int offset, NbdExtent *extent)
 {
+    bool done = false;
+    uint64_t covered = 0;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
+    reply->error = 0;
+    while (!done) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        if (s->reply.handle != request->handle) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (!nbd_reply_is_structured(&s->reply)) {
+            *reply = s->reply;
+            if (qiov && reply->error == 0) {
+                ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
+            }
+            done = true;
+        } else {
+            /* A structured reply can be split in several chunks */
+            ret = nbd_co_receive_chunk(s, request, qiov, offset, extent,
+                                       &covered);
+            if (ret < 0) {
+                /* The stream cannot be trusted anymore */
+                reply->error = EIO;
+                shutdown(s->sock, 2);
+                return;
+            }
+            if (ret > 0 && reply->error == 0) {
+                reply->error = ret;
+            }
+            done = s->reply.flags & NBD_REPLY_FLAG_DONE;
+            /* A successful read must have filled the whole buffer */
+            if (done && qiov && reply->error == 0 &&
+                covered != request->len) {
                 reply->error = EIO;
             }
         }
@@ -176,26 +318,37 @@ static void nbd_co_receive_reply(NbdClientSession *s,
     }
 }
 
-static void nbd_coroutine_start(NbdClientSession *s,
+static NbdConnection *nbd_coroutine_start(NbdClientSession *client,
    struct nbd_request *request)
 {
+    NbdConnection *s = &client->connections[0];
+    int i;
+
+    /* Send the request on the least busy connection */
+    for (i = 1; i < client->nb_connections; i++) {
+        if (client->connections[i].in_flight < s->in_flight) {
+            s = &client->connections[i];
+        }
+    }
+
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
+    if (s->in_flight >= client->queue_depth - 1) {
         qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+        assert(s->in_flight < client->queue_depth);
     }
     s->in_flight++;
 
     /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
+    return s;
 }
 
-static void nbd_coroutine_end(NbdClientSession *s,
+static void nbd_coroutine_end(NbdConnection *s,
     struct nbd_request *request)
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
     s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
+    if (s->in_flight-- == nbd_get_client_session(s->bs)->queue_depth) {
         qemu_co_mutex_unlock(&s->free_sema);
     }
 }
@@ -205,6 +358,7 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int offset)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_READ };
     struct nbd_reply reply;
     ssize_t ret;
@@ -212,14 +366,14 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(conn, &request, &reply, qiov, offset, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
@@ -229,6 +383,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
                            int offset)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_WRITE };
     struct nbd_reply reply;
     ssize_t ret;
@@ -241,14 +396,14 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov, offset);
+    conn = nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(conn, &request, qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -293,6 +448,7 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
     struct nbd_reply reply;
     ssize_t ret;
@@ -308,14 +464,14 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -323,6 +479,7 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_TRIM };
     struct nbd_reply reply;
     ssize_t ret;
@@ -333,75 +490,199 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
 
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+    };
+    struct nbd_reply reply;
+    NbdExtent extent = { 0 };
+    ssize_t ret;
+
+    if (!client->ext.block_status) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num * BDRV_SECTOR_SIZE);
+    }
+
+    nb_sectors = MIN(nb_sectors, UINT32_MAX >> BDRV_SECTOR_BITS);
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    conn = nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, &extent);
+    }
+    nbd_coroutine_end(conn, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    *pnum = MIN(extent.length / 512, nb_sectors);
+    if (*pnum == 0) {
+        return -EIO;
+    }
+    if (extent.flags & NBD_STATE_HOLE) {
+        ret = 0;
+    } else {
+        ret = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+              (sector_num * BDRV_SECTOR_SIZE);
+    }
+    if (extent.flags & NBD_STATE_ZERO) {
+        ret |= BDRV_BLOCK_ZERO;
+    }
+    return ret;
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sock, NULL, NULL, NULL);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->nb_connections; i++) {
+        if (client->connections[i].sock != -1) {
+            aio_set_fd_handler(bdrv_get_aio_context(bs),
+                               client->connections[i].sock, NULL, NULL, NULL);
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sock,
-                       nbd_reply_ready, NULL, bs);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->nb_connections; i++) {
+        if (client->connections[i].sock != -1) {
+            aio_set_fd_handler(new_context, client->connections[i].sock,
+                               nbd_reply_ready, NULL,
+                               &client->connections[i]);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = {
         .type = NBD_CMD_DISC,
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->sock == -1) {
-        return;
+    for (i = 0; i < client->nb_connections; i++) {
+        conn = &client->connections[i];
+        if (conn->sock != -1) {
+            nbd_send_request(conn->sock, &request);
+        }
     }
 
-    nbd_send_request(client->sock, &request);
-
     nbd_teardown_connection(bs);
+
+    for (i = 0; i < client->nb_connections; i++) {
+        g_free(client->connections[i].recv_coroutine);
+    }
+    client->nb_connections = 0;
 }
 
-int nbd_client_init(BlockDriverState *bs, int sock, const char *export,
-                    Error **errp)
+/* Negotiate on @sock and add it to the connections of the session */
+static int nbd_connection_init(BlockDriverState *bs, int sock,
+                               const char *export, uint32_t *nbdflags,
+                               off_t *size, NBDExtensions *ext, Error **errp)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     int ret;
 
+    assert(client->nb_connections < NBD_MAX_CONNECTIONS);
+
     /* NBD handshake */
     logout("session init %s\n", export);
     qemu_set_block(sock);
-    ret = nbd_receive_negotiate(sock, export,
-                                &client->nbdflags, &client->size, errp);
+    memset(ext, 0, sizeof(*ext));
+    ret = nbd_receive_negotiate(sock, export, nbdflags, size,
+                                client->no_extensions ? NULL : ext, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
         return ret;
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
-    client->sock = sock;
+    conn = &client->connections[client->nb_connections++];
+    conn->bs = bs;
+    conn->sock = sock;
+    conn->in_flight = 0;
+    conn->recv_coroutine = g_new0(Coroutine *, client->queue_depth);
+    qemu_co_mutex_init(&conn->send_mutex);
+    qemu_co_mutex_init(&conn->free_sema);
 
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qemu_set_nonblock(sock);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    aio_set_fd_handler(bdrv_get_aio_context(bs), sock,
+                       nbd_reply_ready, NULL, conn);
 
     logout("Established connection with NBD server\n");
     return 0;
 }
+
+int nbd_client_init(BlockDriverState *bs, int sock, const char *export,
+                    Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+
+    if (!client->queue_depth) {
+        client->queue_depth = NBD_DEFAULT_QUEUE_DEPTH;
+    }
+    return nbd_connection_init(bs, sock, export, &client->nbdflags,
+                               &client->size, &client->ext, errp);
+}
+
+/* Open one more connection to the same export.  The server must have
+ * advertised NBD_FLAG_CAN_MULTI_CONN on the first one.
+ */
+int nbd_client_add_connection(BlockDriverState *bs, int sock,
+                              const char *export, Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NBDExtensions ext;
+    uint32_t nbdflags;
+    off_t size;
+    int ret;
+
+    assert(client->nbdflags & NBD_FLAG_CAN_MULTI_CONN);
+    ret = nbd_connection_init(bs, sock, export, &nbdflags, &size, &ext, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* All connections must see the same export */
+    if (nbdflags != client->nbdflags || size != client->size ||
+        memcmp(&ext, &client->ext, sizeof(ext))) {
+        error_setg(errp, "NBD server changed the export between connections");
+        return -EINVAL;
+    }
+    return 0;
+}
@@ -14,20 +14,35 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS    16
+#define NBD_DEFAULT_QUEUE_DEPTH 16
+#define NBD_MAX_QUEUE_DEPTH     1024
+#define NBD_MAX_CONNECTIONS     16
 
-typedef struct NbdClientSession {
+/* A socket connected to the server.  Requests are spread over all
+ * connections of the session.
+ */
+typedef struct NbdConnection {
+    BlockDriverState *bs;
     int sock;
-    uint32_t nbdflags;
-    off_t size;
 
     CoMutex send_mutex;
     CoMutex free_sema;
     Coroutine *send_coroutine;
     int in_flight;
 
-    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    Coroutine **recv_coroutine;     /* queue_depth entries */
     struct nbd_reply reply;
+} NbdConnection;
+
+typedef struct NbdClientSession {
+    uint32_t nbdflags;
+    off_t size;
+    NBDExtensions ext;
+    bool no_extensions;             /* server cannot negotiate extensions */
+
+    int queue_depth;                /* requests in flight per connection */
+    int nb_connections;
+    NbdConnection connections[NBD_MAX_CONNECTIONS];
 
     bool is_unix;
 } NbdClientSession;
@@ -36,6 +51,8 @@ NbdClientSession *nbd_get_client_session(BlockDriverState *bs);
 
 int nbd_client_init(BlockDriverState *bs, int sock, const char *export_name,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs, int sock,
+                              const char *export_name, Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -45,6 +62,9 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov);
 int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov);
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
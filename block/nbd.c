@@ -44,8 +44,27 @@
 typedef struct BDRVNBDState {
     NbdClientSession client;
     QemuOpts *socket_opts;
+    int connections;
 } BDRVNBDState;
 
+static QemuOptsList nbd_runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(nbd_runtime_opts.head),
+    .desc = {
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server allows it",
+        },
+        {
+            .name = "queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of requests in flight per connection",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
     URI *uri;
@@ -194,6 +213,8 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
                        Error **errp)
 {
     Error *local_err = NULL;
+    uint64_t connections, queue_depth;
+    QemuOpts *opts;
 
     if (qdict_haskey(options, "path") == qdict_haskey(options, "host")) {
         if (qdict_haskey(options, "path")) {
@@ -219,6 +240,31 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
                             &error_abort);
     }
 
+    opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return;
+    }
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    queue_depth = qemu_opt_get_number(opts, "queue-depth",
+                                      NBD_DEFAULT_QUEUE_DEPTH);
+    qemu_opts_del(opts);
+
+    if (connections < 1 || connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        return;
+    }
+    if (queue_depth < 1 || queue_depth > NBD_MAX_QUEUE_DEPTH) {
+        error_setg(errp, "queue-depth must be between 1 and %d",
+                   NBD_MAX_QUEUE_DEPTH);
+        return;
+    }
+    s->connections = connections;
+    s->client.queue_depth = queue_depth;
+
     *export = g_strdup(qdict_get_try_str(options, "export"));
     if (*export) {
         qdict_del(options, "export");
@@ -259,7 +305,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 {
     BDRVNBDState *s = bs->opaque;
     char *export = NULL;
-    int result, sock;
+    int result, sock, i;
     Error *local_err = NULL;
 
     /* Pop the config into our state object. Exit if invalid. */
@@ -279,7 +325,45 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* NBD handshake */
-    result = nbd_client_init(bs, sock, export, errp);
+    result = nbd_client_init(bs, sock, export, &local_err);
+    if (result == -ECONNRESET) {
+        /* Old servers drop the connection when asked for extensions */
+        error_free(local_err);
+        local_err = NULL;
+        s->client.no_extensions = true;
+        sock = nbd_establish_connection(bs, errp);
+        if (sock < 0) {
+            g_free(export);
+            return sock;
+        }
+        result = nbd_client_init(bs, sock, export, &local_err);
+    }
+    if (result < 0) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    /* Requests are spread over several connections only if the server
+     * guarantees that they see a consistent image.
+     */
+    if (s->client.nbdflags & NBD_FLAG_CAN_MULTI_CONN) {
+        for (i = 1; i < s->connections; i++) {
+            sock = nbd_establish_connection(bs, errp);
+            if (sock < 0) {
+                result = sock;
+                break;
+            }
+            result = nbd_client_add_connection(bs, sock, export, errp);
+            if (result < 0) {
+                break;
+            }
+        }
+        if (result < 0) {
+            nbd_client_close(bs);
+        }
+    }
+
+out:
     g_free(export);
     return result;
 }
@@ -313,6 +397,13 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     return nbd_client_co_discard(bs, sector_num, nb_sectors);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    return nbd_client_co_get_block_status(bs, sector_num, nb_sectors, pnum);
+}
+
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
@@ -395,6 +486,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -413,6 +505,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -431,6 +524,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -24,6 +24,7 @@
 
 #include "block/qapi.h"
 #include "block/block_int.h"
+#include "block/throttle-groups.h"
 #include "block/write-threshold.h"
 #include "qmp-commands.h"
 #include "qapi-visit.h"
@@ -65,7 +66,9 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
     if (bs->io_limits_enabled) {
         ThrottleConfig cfg;
-        throttle_get_config(&bs->throttle_state, &cfg);
+
+        throttle_group_get_config(bs, &cfg);
+
         info->bps     = cfg.buckets[THROTTLE_BPS_TOTAL].avg;
         info->bps_rd  = cfg.buckets[THROTTLE_BPS_READ].avg;
         info->bps_wr  = cfg.buckets[THROTTLE_BPS_WRITE].avg;
@@ -90,6 +93,9 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
         info->has_iops_size = cfg.op_size;
         info->iops_size = cfg.op_size;
+
+        info->has_group = true;
+        info->group = g_strdup(throttle_group_get_name(bs));
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -320,7 +326,88 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
-static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
+static uint64List *uint64_list_new(const uint64_t *values, int n)
+{
+    uint64List *head = NULL, **p_next = &head;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint64List *entry = g_new0(uint64List, 1);
+        entry->value = values[i];
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    return head;
+}
+
+static BlockSizeHistogramInfo *
+bdrv_query_size_histogram(BlockAcctStats *stats, enum BlockAcctType type)
+{
+    BlockSizeHistogramInfo *info = g_new0(BlockSizeHistogramInfo, 1);
+    uint64_t boundaries[BLOCK_ACCT_SIZE_BUCKETS - 1];
+    int i;
+
+    for (i = 0; i < BLOCK_ACCT_SIZE_BUCKETS - 1; i++) {
+        boundaries[i] = block_acct_size_bucket_limit(i);
+    }
+
+    info->boundaries = uint64_list_new(boundaries, ARRAY_SIZE(boundaries));
+    info->bins = uint64_list_new(stats->size_histogram[type],
+                                 BLOCK_ACCT_SIZE_BUCKETS);
+
+    return info;
+}
+
+static bool bdrv_query_latency_histogram(BlockAcctStats *stats,
+                                         enum BlockAcctType type,
+                                         BlockLatencyHistogramInfo **info)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+
+    if (hist->bins == NULL) {
+        return false;
+    }
+
+    *info = g_new0(BlockLatencyHistogramInfo, 1);
+    (*info)->boundaries = uint64_list_new(hist->boundaries, hist->nbins - 1);
+    (*info)->bins = uint64_list_new(hist->bins, hist->nbins);
+
+    return true;
+}
+
+static BlockDeviceTimedStatsList *bdrv_query_timed_stats(BlockAcctStats *stats)
+{
+    BlockDeviceTimedStatsList *head = NULL, **p_next = &head;
+    BlockAcctTimedStats *ts = NULL;
+
+    while ((ts = block_acct_interval_next(stats, ts))) {
+        BlockDeviceTimedStatsList *entry = g_new0(BlockDeviceTimedStatsList, 1);
+        BlockDeviceTimedStats *t = g_new0(BlockDeviceTimedStats, 1);
+        TimedAverage *rd = &ts->latency[BLOCK_ACCT_READ];
+        TimedAverage *wr = &ts->latency[BLOCK_ACCT_WRITE];
+        TimedAverage *fl = &ts->latency[BLOCK_ACCT_FLUSH];
+
+        t->interval_length = ts->interval_length;
+        t->min_rd_latency_ns = timed_average_min(rd);
+        t->max_rd_latency_ns = timed_average_max(rd);
+        t->avg_rd_latency_ns = timed_average_avg(rd);
+        t->min_wr_latency_ns = timed_average_min(wr);
+        t->max_wr_latency_ns = timed_average_max(wr);
+        t->avg_wr_latency_ns = timed_average_avg(wr);
+        t->min_flush_latency_ns = timed_average_min(fl);
+        t->max_flush_latency_ns = timed_average_max(fl);
+        t->avg_flush_latency_ns = timed_average_avg(fl);
+
+        entry->value = t;
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    return head;
+}
+
+static BlockStats *bdrv_query_stats(BlockDriverState *bs,
                                     bool query_backing)
 {
     BlockStats *s;
@@ -351,6 +438,26 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
     s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
     s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
 
+    s->stats->rd_size_histogram =
+        bdrv_query_size_histogram(&bs->stats, BLOCK_ACCT_READ);
+    s->stats->wr_size_histogram =
+        bdrv_query_size_histogram(&bs->stats, BLOCK_ACCT_WRITE);
+
+    s->stats->has_rd_latency_histogram =
+        bdrv_query_latency_histogram(&bs->stats, BLOCK_ACCT_READ,
+                                     &s->stats->rd_latency_histogram);
+    s->stats->has_wr_latency_histogram =
+        bdrv_query_latency_histogram(&bs->stats, BLOCK_ACCT_WRITE,
+                                     &s->stats->wr_latency_histogram);
+    s->stats->has_flush_latency_histogram =
+        bdrv_query_latency_histogram(&bs->stats, BLOCK_ACCT_FLUSH,
+                                     &s->stats->flush_latency_histogram);
+
+    s->stats->timed_stats = bdrv_query_timed_stats(&bs->stats);
+
+    s->format_specific = bdrv_get_specific_stats(bs);
+    s->has_format_specific = s->format_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file, query_backing);
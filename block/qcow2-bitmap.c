@@ -0,0 +1,490 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/error-report.h"
+
+/* On-disk bitmap directory entry, followed by the name and padded to a
+ * multiple of 8 bytes */
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    uint8_t reserved;
+    uint16_t name_size;
+} Qcow2BitmapDirEntry;
+
+static inline uint64_t bitmap_dir_entry_size(size_t name_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) + name_size, 8);
+}
+
+void qcow2_free_bitmaps(Qcow2Bitmap *bitmaps, int nb_bitmaps)
+{
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+}
+
+/*
+ * Read the bitmap directory of the image.  Returns the number of bitmaps
+ * and stores them in *pbitmaps, or returns -errno.
+ */
+int qcow2_read_bitmaps(BlockDriverState *bs, Qcow2Bitmap **pbitmaps)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapDirEntry e;
+    Qcow2Bitmap *bitmaps;
+    uint8_t *dir;
+    uint64_t pos;
+    int i, ret;
+
+    *pbitmaps = NULL;
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    dir = g_try_malloc(s->bitmap_directory_size);
+    if (dir == NULL) {
+        return -ENOMEM;
+    }
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        g_free(dir);
+        return ret;
+    }
+
+    bitmaps = g_new0(Qcow2Bitmap, s->nb_bitmaps);
+    for (i = 0, pos = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+
+        if (s->bitmap_directory_size - pos < sizeof(e)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        memcpy(&e, dir + pos, sizeof(e));
+        bm->data_offset = be64_to_cpu(e.data_offset);
+        bm->data_size = be64_to_cpu(e.data_size);
+        bm->flags = be32_to_cpu(e.flags);
+        bm->granularity_bits = e.granularity_bits;
+        bm->entry_offset = s->bitmap_directory_offset + pos;
+
+        e.name_size = be16_to_cpu(e.name_size);
+        if (e.name_size == 0 || e.name_size > QCOW2_MAX_BITMAP_NAME_SIZE ||
+            s->bitmap_directory_size - pos <
+                bitmap_dir_entry_size(e.name_size))
+        {
+            ret = -EINVAL;
+            goto fail;
+        }
+        if ((bm->flags & ~QCOW2_BITMAP_FLAGS_MASK) ||
+            bm->granularity_bits < BDRV_SECTOR_BITS ||
+            bm->granularity_bits > 31 ||
+            offset_into_cluster(s, bm->data_offset))
+        {
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        bm->name = g_strndup((char *)dir + pos + sizeof(e), e.name_size);
+        pos += bitmap_dir_entry_size(e.name_size);
+    }
+
+    g_free(dir);
+    *pbitmaps = bitmaps;
+    return s->nb_bitmaps;
+
+fail:
+    g_free(dir);
+    qcow2_free_bitmaps(bitmaps, s->nb_bitmaps);
+    return ret;
+}
+
+static int qcow2_update_bitmap_flags(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    uint64_t offset = bm->entry_offset + offsetof(Qcow2BitmapDirEntry, flags);
+    uint32_t flags = cpu_to_be32(bm->flags);
+    int ret;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, sizeof(flags));
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_pwrite(bs->file, offset, &flags, sizeof(flags));
+}
+
+/*
+ * Create the bitmaps stored in the image on bs.  Every bitmap that is
+ * loaded is marked in use on disk until it is stored again, so that a
+ * bitmap left behind by a crash is recognized and dropped instead of
+ * silently missing the writes that happened before the crash.
+ */
+void qcow2_load_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+    uint8_t *buf;
+    int i, ret, nb_bitmaps;
+
+    /* Read-only users never write the directory back, so leave it alone */
+    if (bs->read_only || (bs->open_flags & BDRV_O_INCOMING) ||
+        s->qcow_version < 3) {
+        return;
+    }
+    s->dirty_bitmaps_loaded = true;
+
+    nb_bitmaps = qcow2_read_bitmaps(bs, &bitmaps);
+    if (nb_bitmaps < 0) {
+        error_setg_errno(errp, -nb_bitmaps, "Could not read dirty bitmaps");
+        return;
+    }
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+
+        if (bm->flags & QCOW2_BITMAP_IN_USE) {
+            error_report("qcow2: Dirty bitmap '%s' was not stored cleanly "
+                         "and is dropped", bm->name);
+            continue;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                          bm->name, &local_err);
+        if (!bitmap) {
+            error_report_err(local_err);
+            local_err = NULL;
+            continue;
+        }
+
+        if (bdrv_dirty_bitmap_serialization_size(bitmap) != bm->data_size) {
+            error_report("qcow2: Dirty bitmap '%s' does not match the image "
+                         "size and is dropped", bm->name);
+            goto drop;
+        }
+
+        if (bm->data_offset) {
+            buf = g_try_malloc(bm->data_size);
+            if (buf == NULL) {
+                ret = -ENOMEM;
+            } else {
+                ret = bdrv_pread(bs->file, bm->data_offset, buf,
+                                 bm->data_size);
+            }
+            if (ret < 0) {
+                error_report("qcow2: Could not read dirty bitmap '%s': %s",
+                             bm->name, strerror(-ret));
+                g_free(buf);
+                goto drop;
+            }
+            bdrv_dirty_bitmap_deserialize(bitmap, buf);
+            g_free(buf);
+        }
+
+        bm->flags |= QCOW2_BITMAP_IN_USE;
+        ret = qcow2_update_bitmap_flags(bs, bm);
+        if (ret < 0) {
+            error_report("qcow2: Could not mark dirty bitmap '%s' in use: %s",
+                         bm->name, strerror(-ret));
+            goto drop;
+        }
+
+        if (!(bm->flags & QCOW2_BITMAP_ENABLED)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+        bdrv_dirty_bitmap_set_persistent(bitmap, true);
+        continue;
+
+drop:
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not mark dirty bitmaps in use");
+    }
+    qcow2_free_bitmaps(bitmaps, nb_bitmaps);
+}
+
+static void qcow2_free_bitmap_clusters(BlockDriverState *bs,
+                                       Qcow2Bitmap *bitmaps, int nb_bitmaps,
+                                       uint64_t dir_offset, uint64_t dir_size)
+{
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        if (bitmaps[i].data_offset) {
+            qcow2_free_clusters(bs, bitmaps[i].data_offset,
+                                bitmaps[i].data_size, QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (dir_offset) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+}
+
+static int qcow2_write_bitmap_data(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                   BdrvDirtyBitmap *bitmap)
+{
+    uint8_t *buf;
+    int64_t offset;
+    int ret;
+
+    /* An empty bitmap takes no space in the image */
+    if (bdrv_get_dirty_count(bitmap) == 0) {
+        return 0;
+    }
+
+    buf = g_try_malloc(bm->data_size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+    bdrv_dirty_bitmap_serialize(bitmap, buf);
+
+    offset = qcow2_alloc_clusters(bs, bm->data_size);
+    if (offset < 0) {
+        ret = offset;
+        goto out;
+    }
+    bm->data_offset = offset;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, bm->data_size);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_pwrite(bs->file, offset, buf, bm->data_size);
+
+out:
+    g_free(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static int qcow2_write_bitmap_directory(BlockDriverState *bs,
+                                        Qcow2Bitmap *bitmaps, int nb_bitmaps,
+                                        uint64_t *dir_offset,
+                                        uint64_t *dir_size)
+{
+    Qcow2BitmapDirEntry *e;
+    uint8_t *dir;
+    uint64_t size, pos;
+    int64_t offset;
+    int i, ret;
+
+    for (i = 0, size = 0; i < nb_bitmaps; i++) {
+        size += bitmap_dir_entry_size(strlen(bitmaps[i].name));
+    }
+    if (size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        return -EFBIG;
+    }
+
+    dir = g_malloc0(size);
+    for (i = 0, pos = 0; i < nb_bitmaps; i++) {
+        size_t name_size = strlen(bitmaps[i].name);
+
+        e = (Qcow2BitmapDirEntry *)(dir + pos);
+        e->data_offset = cpu_to_be64(bitmaps[i].data_offset);
+        e->data_size = cpu_to_be64(bitmaps[i].data_size);
+        e->flags = cpu_to_be32(bitmaps[i].flags);
+        e->granularity_bits = bitmaps[i].granularity_bits;
+        e->name_size = cpu_to_be16(name_size);
+        memcpy(dir + pos + sizeof(*e), bitmaps[i].name, name_size);
+        pos += bitmap_dir_entry_size(name_size);
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        ret = offset;
+        goto out;
+    }
+    *dir_offset = offset;
+    *dir_size = size;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_pwrite(bs->file, offset, dir, size);
+
+out:
+    g_free(dir);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Write all persistent bitmaps of bs to newly allocated clusters, point the
+ * header to them and free the previous directory.  The new bitmaps are not
+ * marked in use, so they are valid until the image is opened again.
+ */
+void qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2Bitmap *old_bitmaps = NULL, *bitmaps = NULL;
+    int old_nb_bitmaps = 0, nb_bitmaps = 0;
+    uint64_t old_dir_offset, old_dir_size, old_autoclear;
+    uint64_t dir_offset = 0, dir_size = 0;
+    int i, ret;
+
+    if (!s->dirty_bitmaps_loaded) {
+        return;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        nb_bitmaps += bdrv_dirty_bitmap_get_persistent(bitmap);
+    }
+    if (nb_bitmaps == 0 && s->nb_bitmaps == 0) {
+        return;
+    }
+
+    /* If the old directory cannot be read, its clusters are leaked */
+    old_nb_bitmaps = qcow2_read_bitmaps(bs, &old_bitmaps);
+    if (old_nb_bitmaps < 0) {
+        error_report("qcow2: Could not read old dirty bitmaps: %s",
+                     strerror(-old_nb_bitmaps));
+        old_nb_bitmaps = 0;
+    }
+
+    bitmaps = g_new0(Qcow2Bitmap, nb_bitmaps);
+    i = 0;
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        Qcow2Bitmap *bm;
+
+        if (!bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            continue;
+        }
+
+        bm = &bitmaps[i++];
+        bm->name = g_strdup(bdrv_dirty_bitmap_name(bitmap));
+        bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+        bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? QCOW2_BITMAP_ENABLED
+                                                      : 0;
+        bm->data_size = bdrv_dirty_bitmap_serialization_size(bitmap);
+
+        ret = qcow2_write_bitmap_data(bs, bm, bitmap);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write dirty bitmap '%s'",
+                             bm->name);
+            goto fail;
+        }
+    }
+
+    if (nb_bitmaps) {
+        ret = qcow2_write_bitmap_directory(bs, bitmaps, nb_bitmaps,
+                                           &dir_offset, &dir_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write dirty bitmap "
+                             "directory");
+            goto fail;
+        }
+    }
+
+    /* The header may only point to the new directory once the directory,
+     * the bitmaps and their refcounts are stable on disk */
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write dirty bitmaps");
+        goto fail;
+    }
+
+    old_dir_offset = s->bitmap_directory_offset;
+    old_dir_size = s->bitmap_directory_size;
+    old_autoclear = s->autoclear_features;
+
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear;
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        goto fail;
+    }
+
+    qcow2_free_bitmap_clusters(bs, old_bitmaps, old_nb_bitmaps,
+                               old_dir_offset, old_dir_size);
+    qcow2_free_bitmaps(old_bitmaps, old_nb_bitmaps);
+    qcow2_free_bitmaps(bitmaps, nb_bitmaps);
+    return;
+
+fail:
+    qcow2_free_bitmap_clusters(bs, bitmaps, nb_bitmaps, dir_offset, dir_size);
+    qcow2_free_bitmaps(old_bitmaps, old_nb_bitmaps);
+    qcow2_free_bitmaps(bitmaps, nb_bitmaps);
+}
+
+/* Any power-of-two granularity that the block layer accepts fits into the
+ * directory entry, so only the name and the number of bitmaps are checked */
+bool qcow2_can_store_persistent_dirty_bitmap(BlockDriverState *bs,
+                                             const char *name,
+                                             uint32_t granularity,
+                                             Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    int nb_bitmaps = 0;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent dirty bitmaps require qcow2 version 3 "
+                   "(compat=1.1)");
+        return false;
+    }
+    if (!s->dirty_bitmaps_loaded) {
+        error_setg(errp, "Persistent dirty bitmaps can only be added to "
+                   "images that were opened read-write");
+        return false;
+    }
+    if (strlen(name) > QCOW2_MAX_BITMAP_NAME_SIZE) {
+        error_setg(errp, "Bitmap name is longer than %d bytes",
+                   QCOW2_MAX_BITMAP_NAME_SIZE);
+        return false;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        nb_bitmaps += bdrv_dirty_bitmap_get_persistent(bitmap);
+    }
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent dirty bitmaps");
+        return false;
+    }
+
+    return true;
+}
@@ -24,14 +24,21 @@
 
 #include "block/block_int.h"
 #include "qemu-common.h"
+#include "qemu/queue.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/* Maximum number of tables read or written back in a single request */
+#define QCOW2_CACHE_MAX_BATCH 32
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     bool     dirty;
-    uint64_t lru_counter;
     int      ref;
+    /* Next entry in the same hash bucket, or -1 */
+    int      hash_next;
+    /* Linked into the LRU list while ref == 0 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,7 +47,20 @@ struct Qcow2Cache {
     int                     size;
     bool                    depends_on_flush;
     void                   *table_array;
-    uint64_t                lru_counter;
+
+    /* First entry of each hash bucket, or -1; hash_size is a power of 2 */
+    int                    *hash_table;
+    int                     hash_size;
+
+    /* Unreferenced entries, least recently used (or unused) first */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
+    uint64_t                readahead;
+    uint64_t                tables_written;
+    uint64_t                write_requests;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
@@ -60,6 +80,68 @@ static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
     return idx;
 }
 
+static inline int qcow2_cache_hash(BlockDriverState *bs, Qcow2Cache *c,
+                                   uint64_t offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    return (offset >> s->cluster_bits) & (c->hash_size - 1);
+}
+
+static int qcow2_cache_lookup(BlockDriverState *bs, Qcow2Cache *c,
+                              uint64_t offset)
+{
+    int i;
+
+    for (i = c->hash_table[qcow2_cache_hash(bs, c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void qcow2_cache_set_offset(BlockDriverState *bs, Qcow2Cache *c,
+                                   int i, uint64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int *p;
+
+    if (t->offset) {
+        p = &c->hash_table[qcow2_cache_hash(bs, c, t->offset)];
+        while (*p != i) {
+            p = &c->entries[*p].hash_next;
+        }
+        *p = t->hash_next;
+        t->hash_next = -1;
+    }
+
+    t->offset = offset;
+
+    if (offset) {
+        p = &c->hash_table[qcow2_cache_hash(bs, c, offset)];
+        t->hash_next = *p;
+        *p = i;
+    }
+}
+
+static void qcow2_cache_reset(Qcow2Cache *c)
+{
+    int i;
+
+    QTAILQ_INIT(&c->lru_list);
+    for (i = 0; i < c->size; i++) {
+        assert(c->entries[i].ref == 0);
+        c->entries[i].offset = 0;
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
+    }
+    for (i = 0; i < c->hash_size; i++) {
+        c->hash_table[i] = -1;
+    }
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
@@ -67,17 +149,25 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->hash_size = 1;
+    while (c->hash_size < num_tables) {
+        c->hash_size <<= 1;
+    }
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->hash_table = g_try_new(int, c->hash_size);
     c->table_array = qemu_try_blockalign(bs->file,
                                          (size_t) num_tables * s->cluster_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->hash_table || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->hash_table);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    qcow2_cache_reset(c);
+
     return c;
 }
 
@@ -90,6 +180,7 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->hash_table);
     g_free(c->entries);
     g_free(c);
 
@@ -111,18 +202,24 @@ static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
     return 0;
 }
 
-static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
+/*
+ * Write back the n dirty tables in idx[], which must be at consecutive
+ * offsets in the image file, with a single request.
+ */
+static int qcow2_cache_write_tables(BlockDriverState *bs, Qcow2Cache *c,
+                                    const int *idx, int n)
 {
     BDRVQcowState *s = bs->opaque;
+    int64_t offset = c->entries[idx[0]].offset;
+    QEMUIOVector qiov;
     int ret = 0;
+    int i;
 
-    if (!c->entries[i].dirty || !c->entries[i].offset) {
-        return 0;
+    for (i = 0; i < n; i++) {
+        trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
+                                      c == s->l2_table_cache, idx[i]);
     }
 
-    trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
-                                  c == s->l2_table_cache, i);
-
     if (c->depends) {
         ret = qcow2_cache_flush_dependency(bs, c);
     } else if (c->depends_on_flush) {
@@ -138,51 +235,99 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                offset, (int64_t) n * s->cluster_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                offset, (int64_t) n * s->cluster_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                offset, (int64_t) n * s->cluster_size);
     }
 
     if (ret < 0) {
         return ret;
     }
 
-    if (c == s->refcount_block_cache) {
-        BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
-    } else if (c == s->l2_table_cache) {
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+    qemu_iovec_init(&qiov, n);
+    for (i = 0; i < n; i++) {
+        if (c == s->refcount_block_cache) {
+            BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
+        } else if (c == s->l2_table_cache) {
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+        }
+        qemu_iovec_add(&qiov, qcow2_cache_get_table_addr(bs, c, idx[i]),
+                       s->cluster_size);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
-                      qcow2_cache_get_table_addr(bs, c, i), s->cluster_size);
+    ret = bdrv_pwritev(bs->file, offset, &qiov);
+    qemu_iovec_destroy(&qiov);
     if (ret < 0) {
         return ret;
     }
 
-    c->entries[i].dirty = false;
+    for (i = 0; i < n; i++) {
+        c->entries[idx[i]].dirty = false;
+    }
+    c->tables_written += n;
+    c->write_requests++;
 
     return 0;
 }
 
+static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    if (!c->entries[i].dirty || !c->entries[i].offset) {
+        return 0;
+    }
+
+    return qcow2_cache_write_tables(bs, c, &i, 1);
+}
+
+static int qcow2_cache_table_cmp(const void *a, const void *b)
+{
+    const Qcow2CachedTable *ta = *(Qcow2CachedTable * const *) a;
+    const Qcow2CachedTable *tb = *(Qcow2CachedTable * const *) b;
+
+    return ta->offset < tb->offset ? -1 : ta->offset > tb->offset;
+}
+
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable **dirty;
+    int idx[QCOW2_CACHE_MAX_BATCH];
     int result = 0;
     int ret;
-    int i;
+    int i, n, batch;
 
     trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
 
+    /* Write back dirty tables in offset order, merging adjacent ones */
+    dirty = g_new(Qcow2CachedTable *, c->size);
+    n = 0;
     for (i = 0; i < c->size; i++) {
-        ret = qcow2_cache_entry_flush(bs, c, i);
+        if (c->entries[i].dirty && c->entries[i].offset) {
+            dirty[n++] = &c->entries[i];
+        }
+    }
+    qsort(dirty, n, sizeof(*dirty), qcow2_cache_table_cmp);
+
+    for (i = 0; i < n; i += batch) {
+        for (batch = 0; batch < QCOW2_CACHE_MAX_BATCH && i + batch < n;
+             batch++) {
+            if (dirty[i + batch]->offset !=
+                dirty[i]->offset + (int64_t) batch * s->cluster_size) {
+                break;
+            }
+            idx[batch] = dirty[i + batch] - c->entries;
+        }
+
+        ret = qcow2_cache_write_tables(bs, c, idx, batch);
         if (ret < 0 && result != -ENOSPC) {
             result = ret;
         }
     }
+    g_free(dirty);
 
     if (result == 0) {
         ret = bdrv_flush(bs->file);
@@ -224,88 +369,145 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
-    int ret, i;
+    int ret;
 
     ret = qcow2_cache_flush(bs, c);
     if (ret < 0) {
         return ret;
     }
 
-    for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+    qcow2_cache_reset(c);
+
+    return 0;
+}
+
+/*
+ * Take the least recently used unreferenced entry out of the cache so that
+ * it can be reused, writing it back first if it is dirty.  Returns the
+ * entry index or -errno.
+ */
+static int qcow2_cache_evict(BlockDriverState *bs, Qcow2Cache *c)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *t;
+    int i, ret;
+
+    t = QTAILQ_FIRST(&c->lru_list);
+    if (!t) {
+        /* This can't happen in current synchronous code, but leave the check
+         * here as a reminder for whoever starts using AIO with the cache */
+        abort();
     }
 
-    c->lru_counter = 0;
+    i = t - c->entries;
+    trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
+                                        c == s->l2_table_cache, i);
 
-    return 0;
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (t->offset) {
+        c->evictions++;
+    }
+    QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+    qcow2_cache_set_offset(bs, c, i, 0);
+
+    return i;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
-    uint64_t offset, void **table, bool read_from_disk)
+    uint64_t offset, int readahead, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
-    int i;
+    int idx[QCOW2_CACHE_MAX_BATCH];
+    int i, j, n;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
+    i = qcow2_cache_lookup(bs, c, offset);
+    if (i >= 0) {
+        c->hits++;
+        if (c->entries[i].ref == 0) {
+            QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru_entry);
         }
-    } while (i != lookup_index);
-
-    if (min_lru_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+        goto found;
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
-    trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
-                                        c == s->l2_table_cache, i);
+    c->misses++;
+    i = qcow2_cache_evict(bs, c);
     if (i < 0) {
         return i;
     }
+    idx[0] = i;
+    n = 1;
 
-    ret = qcow2_cache_entry_flush(bs, c, i);
-    if (ret < 0) {
-        return ret;
-    }
-
-    trace_qcow2_cache_get_read(qemu_coroutine_self(),
-                               c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
     if (read_from_disk) {
+        /*
+         * Load the following tables with the same request, as long as they
+         * aren't cached yet and can replace clean tables; a quarter of the
+         * cache at most, so that readahead can't push out everything else.
+         */
+        readahead = MIN(readahead, QCOW2_CACHE_MAX_BATCH - 1);
+        readahead = MIN(readahead, c->size / 4);
+        while (n <= readahead) {
+            Qcow2CachedTable *t = QTAILQ_FIRST(&c->lru_list);
+            uint64_t next = offset + (uint64_t) n * s->cluster_size;
+
+            if (!t || t->dirty || qcow2_cache_lookup(bs, c, next) >= 0) {
+                break;
+            }
+            ret = qcow2_cache_evict(bs, c);
+            assert(ret >= 0);
+            idx[n++] = ret;
+        }
+
+        trace_qcow2_cache_get_read(qemu_coroutine_self(),
+                                   c == s->l2_table_cache, i);
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(bs, c, i),
-                         s->cluster_size);
+        if (n == 1) {
+            ret = bdrv_pread(bs->file, offset,
+                             qcow2_cache_get_table_addr(bs, c, i),
+                             s->cluster_size);
+        } else {
+            QEMUIOVector qiov;
+
+            qemu_iovec_init(&qiov, n);
+            for (j = 0; j < n; j++) {
+                qemu_iovec_add(&qiov, qcow2_cache_get_table_addr(bs, c, idx[j]),
+                               s->cluster_size);
+            }
+            ret = bdrv_preadv(bs->file, offset, &qiov);
+            qemu_iovec_destroy(&qiov);
+        }
+
         if (ret < 0) {
+            /* Hand the entries back as unused ones */
+            while (n--) {
+                QTAILQ_INSERT_HEAD(&c->lru_list, &c->entries[idx[n]],
+                                   lru_entry);
+            }
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(bs, c, i, offset);
+
+    /* The tables read ahead are unreferenced, but most recently used */
+    for (j = 1; j < n; j++) {
+        qcow2_cache_set_offset(bs, c, idx[j],
+                               offset + (uint64_t) j * s->cluster_size);
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[idx[j]], lru_entry);
+    }
+    c->readahead += n - 1;
 
     /* And return the right table */
 found:
@@ -321,13 +523,24 @@ found:
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
-    return qcow2_cache_do_get(bs, c, offset, table, true);
+    return qcow2_cache_do_get(bs, c, offset, 0, table, true);
+}
+
+/*
+ * Like qcow2_cache_get(), but on a cache miss also load up to readahead
+ * tables that directly follow offset in the image file in the same request.
+ * The caller must know that they are tables of the same kind.
+ */
+int qcow2_cache_get_readahead(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, int readahead, void **table)
+{
+    return qcow2_cache_do_get(bs, c, offset, readahead, table, true);
 }
 
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
-    return qcow2_cache_do_get(bs, c, offset, table, false);
+    return qcow2_cache_do_get(bs, c, offset, 0, table, false);
 }
 
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
@@ -338,7 +551,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
     *table = NULL;
 
     if (c->entries[i].ref == 0) {
-        c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -351,3 +564,19 @@ void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
     assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
 }
+
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c)
+{
+    Qcow2CacheStats *stats = g_new(Qcow2CacheStats, 1);
+
+    *stats = (Qcow2CacheStats){
+        .hits           = c->hits,
+        .misses         = c->misses,
+        .evictions      = c->evictions,
+        .readahead      = c->readahead,
+        .tables_written = c->tables_written,
+        .write_requests = c->write_requests,
+    };
+
+    return stats;
+}
@@ -22,8 +22,6 @@
  * THE SOFTWARE.
  */
 
-#include <zlib.h>
-
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
@@ -125,6 +123,10 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     s->l1_table = new_l1_table;
     old_l1_size = s->l1_size;
     s->l1_size = new_l1_size;
+    qcow2_metadata_index_remove(bs, QCOW2_OL_ACTIVE_L1, old_l1_table_offset,
+                                old_l1_size * sizeof(uint64_t));
+    qcow2_metadata_index_add(bs, QCOW2_OL_ACTIVE_L1, new_l1_table_offset,
+                             new_l1_size * sizeof(uint64_t));
     qcow2_free_clusters(bs, old_l1_table_offset, old_l1_size * sizeof(uint64_t),
                         QCOW2_DISCARD_OTHER);
     return 0;
@@ -145,13 +147,27 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
  * the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t l1_index,
+    uint64_t l2_offset, uint64_t **l2_table)
 {
     BDRVQcowState *s = bs->opaque;
+    int readahead = 0;
     int ret;
 
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    /* On sequential access, also load the following L2 tables if they are
+     * stored right after this one */
+    if (l1_index == s->l2_last_l1_index + 1) {
+        while (readahead < QCOW2_L2_READAHEAD &&
+               l1_index + readahead + 1 < s->l1_size &&
+               (s->l1_table[l1_index + readahead + 1] & L1E_OFFSET_MASK) ==
+               l2_offset + (uint64_t) (readahead + 1) * s->cluster_size) {
+            readahead++;
+        }
+    }
+    s->l2_last_l1_index = l1_index;
+
+    ret = qcow2_cache_get_readahead(bs, s->l2_table_cache, l2_offset,
+                                    readahead, (void **) l2_table);
 
     return ret;
 }
@@ -215,7 +231,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -238,7 +254,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->cluster_size);
     } else {
         uint64_t* old_table;
 
@@ -274,6 +290,14 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
+    if (old_l2_offset & L1E_OFFSET_MASK) {
+        qcow2_metadata_index_remove(bs, QCOW2_OL_ACTIVE_L2,
+                                    old_l2_offset & L1E_OFFSET_MASK,
+                                    s->cluster_size);
+    }
+    qcow2_metadata_index_add(bs, QCOW2_OL_ACTIVE_L2, l2_offset,
+                             s->cluster_size);
+
     *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
@@ -285,7 +309,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -298,12 +322,12 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcowState *s, uint64_t nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -312,8 +336,8 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) != QCOW2_CLUSTER_COMPRESSED);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
@@ -321,12 +345,14 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_free_clusters(BDRVQcowState *s,
+        uint64_t nb_clusters, uint64_t *l2_table, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        int type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                       l2_index + i));
 
         if (type != QCOW2_CLUSTER_UNALLOCATED) {
             break;
@@ -336,6 +362,45 @@ static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_tab
     return i;
 }
 
+/*
+ * Counts the subclusters of the same type as subcluster @sc_index of the
+ * cluster at @l2_index, starting at that subcluster and looking at up to
+ * @nb_clusters clusters.  Allocated subclusters are only counted while they
+ * are contiguous in the image file.
+ */
+static int count_contiguous_subclusters(BDRVQcowState *s, int nb_clusters,
+                                        int sc_index, uint64_t *l2_table,
+                                        int l2_index)
+{
+    uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    uint64_t expected_offset = l2_entry & L2E_OFFSET_MASK;
+    int type = qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, sc_index);
+    int i, j, count = 0;
+
+    for (i = 0; i < nb_clusters; i++) {
+        l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+
+        if (type == QCOW2_CLUSTER_NORMAL &&
+            (l2_entry & L2E_OFFSET_MASK) != expected_offset) {
+            break;
+        }
+
+        for (j = (i == 0 ? sc_index : 0); j < s->subclusters_per_cluster;
+             j++) {
+            if (qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, j) != type) {
+                return count;
+            }
+            count++;
+        }
+
+        expected_offset += s->cluster_size;
+    }
+
+    return count;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -426,6 +491,54 @@ out:
 }
 
 
+/*
+ * qcow2_get_cluster_offset() for images with extended L2 entries.  The type
+ * returned describes the subcluster that contains @offset, and
+ * *nb_available is set to the number of sectors from the start of the
+ * cluster to the end of the last subcluster that can be accessed the same
+ * way.
+ */
+static int get_subcluster_offset(BlockDriverState *bs, uint64_t offset,
+                                 uint64_t *l2_table, int l2_index,
+                                 int nb_clusters, uint64_t *cluster_offset,
+                                 uint64_t *nb_available)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    int sc_index = offset_to_sc_index(s, offset);
+    int type, count;
+
+    type = qcow2_get_subcluster_type(s, *cluster_offset, l2_bitmap, sc_index);
+    switch (type) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        /* Compressed clusters can only be processed one by one */
+        *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
+        *nb_available = s->cluster_sectors;
+        return type;
+    case QCOW2_CLUSTER_ZERO:
+    case QCOW2_CLUSTER_UNALLOCATED:
+        *cluster_offset = 0;
+        break;
+    case QCOW2_CLUSTER_NORMAL:
+        *cluster_offset &= L2E_OFFSET_MASK;
+        if (offset_into_cluster(s, *cluster_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
+                                    PRIx64 " unaligned (L2 index: %#x)",
+                                    *cluster_offset, l2_index);
+            return -EIO;
+        }
+        break;
+    default:
+        abort();
+    }
+
+    count = count_contiguous_subclusters(s, nb_clusters, sc_index,
+                                         l2_table, l2_index);
+    *nb_available = (uint64_t)(sc_index + count) * s->subcluster_sectors;
+
+    return type;
+}
+
 /*
  * get_cluster_offset
  *
@@ -495,7 +608,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* load the l2 table in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, l1_index, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
@@ -503,9 +616,20 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
+    if (has_subclusters(s)) {
+        ret = get_subcluster_offset(bs, offset, l2_table, l2_index,
+                                    nb_clusters, cluster_offset,
+                                    &nb_available);
+        if (ret < 0) {
+            goto fail;
+        }
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+        goto out;
+    }
+
     ret = qcow2_get_cluster_type(*cluster_offset);
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
@@ -521,19 +645,19 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             ret = -EIO;
             goto fail;
         }
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_free_clusters(s, nb_clusters, l2_table, l2_index);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
@@ -609,7 +733,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
         /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
+        ret = l2_load(bs, l1_index, l2_offset, &l2_table);
         if (ret < 0) {
             return ret;
         }
@@ -622,7 +746,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                                 QCOW2_DISCARD_OTHER);
         }
     }
@@ -667,7 +791,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -691,7 +815,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    set_l2_bitmap(s, l2_table, l2_index, 0);
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     return cluster_offset;
@@ -726,6 +851,28 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     return 0;
 }
 
+/*
+ * Returns the allocation bits of the L2 bitmap for cluster @i of the
+ * allocation described by @m, i.e. the subclusters that contain either guest
+ * data or COW data after the request has completed.
+ */
+static uint64_t l2meta_alloc_bitmap(BDRVQcowState *s, QCowL2Meta *m, int i)
+{
+    int64_t cluster_start = (int64_t) i << s->cluster_bits;
+    int64_t start = m->cow_start.offset - cluster_start;
+    int64_t end = m->cow_end.offset
+                + (m->cow_end.nb_sectors << BDRV_SECTOR_BITS) - cluster_start;
+
+    start = MAX(start, 0);
+    end = MIN(end, s->cluster_size);
+    if (start >= end) {
+        return 0;
+    }
+
+    return QCOW_OFLAG_SUB_ALLOC_RANGE(start >> s->subcluster_bits,
+        DIV_ROUND_UP(end, s->subcluster_size));
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
@@ -770,18 +917,46 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     assert(l2_index + m->nb_clusters <= s->l2_size);
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t alloc_bitmap = 0;
+
+        if (has_subclusters(s)) {
+            alloc_bitmap = l2meta_alloc_bitmap(s, m, i);
+        }
+
+        /* Subclusters of an existing cluster were allocated in place, so only
+         * the bitmap changes */
+        if (m->keep_old) {
+            uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+
+            bitmap |= alloc_bitmap;
+            bitmap &= ~(alloc_bitmap << 32);
+            set_l2_bitmap(s, l2_table, l2_index + i, bitmap);
+            continue;
+        }
+
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
 	 * The first one to complete updates l2 table with pointer to its
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        if (old_entry != 0) {
+            old_cluster[j++] = old_entry;
+        }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
-     }
+        set_l2_entry(s, l2_table, l2_index + i,
+                     (cluster_offset + (i << s->cluster_bits))
+                     | QCOW_OFLAG_COPIED);
+
+        /* Subclusters that weren't written keep reading as zeroes */
+        if (has_subclusters(s) &&
+            qcow2_get_cluster_type(old_entry) == QCOW2_CLUSTER_ZERO)
+        {
+            alloc_bitmap |= (~alloc_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) << 32;
+        }
+        set_l2_bitmap(s, l2_table, l2_index + i, alloc_bitmap);
+    }
 
 
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
@@ -795,7 +970,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -817,7 +992,7 @@ static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -868,6 +1043,13 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        /* With subclusters, an allocation updates the L2 bitmap of whole
+         * clusters, so serialise all requests touching the same cluster */
+        if (has_subclusters(s)) {
+            old_start = start_of_cluster(s, old_start);
+            old_end = align_offset(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -905,6 +1087,84 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
     return 0;
 }
 
+static bool subcluster_is_allocated(BDRVQcowState *s, uint64_t *l2_table,
+                                    int l2_index, int sc)
+{
+    int i = l2_index + sc / s->subclusters_per_cluster;
+
+    return qcow2_get_subcluster_type(s, get_l2_entry(s, l2_table, i),
+                                     get_l2_bitmap(s, l2_table, i),
+                                     sc % s->subclusters_per_cluster)
+           == QCOW2_CLUSTER_NORMAL;
+}
+
+/*
+ * Writing to unallocated or zero subclusters of a cluster that is already
+ * allocated and doesn't need COW still changes its L2 bitmap.  If the area
+ * of @bytes bytes at @guest_offset touches such subclusters, add a QCowL2Meta
+ * to *m that allocates them in place (i.e. in the existing host cluster at
+ * @host_cluster_offset) and copies the unwritten parts of the first and last
+ * subcluster.
+ */
+static void handle_copied_subclusters(BlockDriverState *bs,
+    uint64_t guest_offset, uint64_t bytes, uint64_t *l2_table, int l2_index,
+    uint64_t host_cluster_offset, QCowL2Meta **m)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t start = offset_into_cluster(s, guest_offset);
+    uint64_t end = start + bytes;
+    int first_sc = start >> s->subcluster_bits;
+    int last_sc = DIV_ROUND_UP(end, s->subcluster_size) - 1;
+    QCowL2Meta *old_m = *m;
+    int sc;
+
+    for (sc = first_sc; sc <= last_sc; sc++) {
+        if (!subcluster_is_allocated(s, l2_table, l2_index, sc)) {
+            break;
+        }
+    }
+    if (sc > last_sc) {
+        return;
+    }
+
+    *m = g_malloc0(sizeof(**m));
+
+    **m = (QCowL2Meta) {
+        .next           = old_m,
+
+        .alloc_offset   = host_cluster_offset,
+        .offset         = start_of_cluster(s, guest_offset),
+        .nb_clusters    = size_to_clusters(s, end),
+        .nb_available   = end >> BDRV_SECTOR_BITS,
+        .keep_old       = true,
+
+        .cow_start = {
+            .offset     = start,
+            .nb_sectors = 0,
+        },
+        .cow_end = {
+            .offset     = end,
+            .nb_sectors = 0,
+        },
+    };
+
+    if (!subcluster_is_allocated(s, l2_table, l2_index, first_sc)) {
+        uint64_t sc_start = (uint64_t) first_sc << s->subcluster_bits;
+
+        (*m)->cow_start.offset = sc_start;
+        (*m)->cow_start.nb_sectors = (start - sc_start) >> BDRV_SECTOR_BITS;
+    }
+
+    if (!subcluster_is_allocated(s, l2_table, l2_index, last_sc)) {
+        uint64_t sc_end = (uint64_t) (last_sc + 1) << s->subcluster_bits;
+
+        (*m)->cow_end.nb_sectors = (sc_end - end) >> BDRV_SECTOR_BITS;
+    }
+
+    qemu_co_queue_init(&(*m)->dependent_requests);
+    QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
+}
+
 /*
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If
@@ -960,7 +1220,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -987,8 +1247,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
@@ -996,6 +1255,12 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
 
+        if (has_subclusters(s)) {
+            handle_copied_subclusters(bs, guest_offset, *bytes, l2_table,
+                                      l2_index,
+                                      cluster_offset & L2E_OFFSET_MASK, m);
+        }
+
         ret = 1;
     } else {
         ret = 0;
@@ -1090,6 +1355,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *l2_table;
     uint64_t entry;
     unsigned int nb_clusters;
+    int first_type, last_type;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1114,7 +1380,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
@@ -1128,6 +1394,10 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
+    first_type = qcow2_get_cluster_type(entry);
+    last_type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                    l2_index + nb_clusters - 1));
+
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     /* Allocate, if necessary at a given offset in the image file */
@@ -1198,6 +1468,28 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
             .nb_sectors = avail_sectors - nb_sectors,
         },
     };
+
+    /* Clusters that had no data yet only need COW for the subclusters that
+     * the request touches, the other subclusters stay unallocated or zero */
+    if (has_subclusters(s)) {
+        if (first_type == QCOW2_CLUSTER_UNALLOCATED ||
+            first_type == QCOW2_CLUSTER_ZERO)
+        {
+            int sc_start = alloc_n_start & ~(s->subcluster_sectors - 1);
+
+            (*m)->cow_start.offset = sc_start * BDRV_SECTOR_SIZE;
+            (*m)->cow_start.nb_sectors = alloc_n_start - sc_start;
+        }
+        if (last_type == QCOW2_CLUSTER_UNALLOCATED ||
+            last_type == QCOW2_CLUSTER_ZERO)
+        {
+            int sc_end = align_offset(nb_sectors, s->subcluster_sectors);
+
+            (*m)->cow_end.nb_sectors = MIN((*m)->cow_end.nb_sectors,
+                                           sc_end - nb_sectors);
+        }
+    }
+
     qemu_co_queue_init(&(*m)->dependent_requests);
     QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
 
@@ -1342,58 +1634,6 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
-{
-    BDRVQcowState *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
-
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
-        s->cluster_cache_offset = coffset;
-    }
-    return 0;
-}
-
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
  * all clusters in the same L2 table) and returns the number of discarded
@@ -1419,7 +1659,7 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_l2_entry;
 
-        old_l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_table, l2_index + i);
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1458,10 +1698,11 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
         if (!full_discard && s->qcow_version >= 3) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
         } else {
-            l2_table[l2_index + i] = cpu_to_be64(0);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
         }
+        set_l2_bitmap(s, l2_table, l2_index + i, 0);
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_l2_entry, 1, type);
@@ -1538,16 +1779,18 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
         if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
+        set_l2_bitmap(s, l2_table, l2_index + i, 0);
     }
 
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
@@ -1659,7 +1902,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             int64_t offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
             bool preallocated = offset != 0;
@@ -1672,7 +1915,8 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                 if (!bs->backing_hd) {
                     /* not backed; therefore we can simply deallocate the
                      * cluster */
-                    l2_table[j] = 0;
+                    set_l2_entry(s, l2_table, j, 0);
+                    set_l2_bitmap(s, l2_table, j, 0);
                     l2_dirty = true;
                     continue;
                 }
@@ -1731,10 +1975,12 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             }
 
             if (l2_refcount == 1) {
-                l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                set_l2_entry(s, l2_table, j, offset | QCOW_OFLAG_COPIED);
             } else {
-                l2_table[j] = cpu_to_be64(offset);
+                set_l2_entry(s, l2_table, j, offset);
             }
+            set_l2_bitmap(s, l2_table, j,
+                          has_subclusters(s) ? QCOW_L2_BITMAP_ALL_ALLOC : 0);
             l2_dirty = true;
         }
 
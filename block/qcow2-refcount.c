@@ -26,6 +26,7 @@
 #include "block/block_int.h"
 #include "block/qcow2.h"
 #include "qemu/range.h"
+#include "qemu/bitmap.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -117,9 +118,125 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    qcow2_alloc_bitmap_invalidate(bs);
+    qcow2_metadata_index_invalidate(bs);
     g_free(s->refcount_table);
 }
 
+/*
+ * The allocation bitmap has one bit per host cluster, set if the cluster has
+ * a non-zero refcount.  It lets alloc_clusters_noref() find runs of free
+ * clusters without walking the refcount blocks.  It is built lazily and kept
+ * in sync by every function that changes a refcount; code that replaces the
+ * refcount structures wholesale must call qcow2_alloc_bitmap_invalidate().
+ */
+
+/* Drop the allocation bitmap; it is rebuilt on the next allocation */
+void qcow2_alloc_bitmap_invalidate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    g_free(s->alloc_bitmap);
+    s->alloc_bitmap = NULL;
+    s->alloc_bitmap_size = 0;
+}
+
+/* Mark @nb_clusters clusters starting at @cluster_index as used or free */
+static void alloc_bitmap_update(BDRVQcowState *s, uint64_t cluster_index,
+                                uint64_t nb_clusters, bool used)
+{
+    uint64_t end = cluster_index + nb_clusters;
+
+    if (!s->alloc_bitmap) {
+        return;
+    }
+
+    if (used) {
+        if (end > s->alloc_bitmap_size) {
+            /* Grow geometrically so that appending stays cheap */
+            uint64_t new_size = MAX(end, s->alloc_bitmap_size * 3 / 2);
+            new_size = ROUND_UP(new_size, BITS_PER_LONG);
+            s->alloc_bitmap = bitmap_zero_extend(s->alloc_bitmap,
+                                                 s->alloc_bitmap_size,
+                                                 new_size);
+            s->alloc_bitmap_size = new_size;
+        }
+        bitmap_set(s->alloc_bitmap, cluster_index, nb_clusters);
+    } else if (cluster_index < s->alloc_bitmap_size) {
+        end = MIN(end, s->alloc_bitmap_size);
+        bitmap_clear(s->alloc_bitmap, cluster_index, end - cluster_index);
+    }
+}
+
+/* Build the allocation bitmap from the refcount blocks */
+static int alloc_bitmap_load(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t i, j;
+    int ret;
+
+    assert(!s->alloc_bitmap);
+    s->alloc_bitmap = bitmap_new(BITS_PER_LONG);
+    s->alloc_bitmap_size = BITS_PER_LONG;
+
+    for (i = 0; i < s->refcount_table_size; i++) {
+        uint64_t refblock_offset = s->refcount_table[i] & REFT_OFFSET_MASK;
+        void *refcount_block;
+
+        if (!refblock_offset) {
+            continue;
+        }
+        if (offset_into_cluster(s, refblock_offset)) {
+            ret = -EIO;
+            goto fail;
+        }
+
+        ret = qcow2_cache_get(bs, s->refcount_block_cache, refblock_offset,
+                              &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        for (j = 0; j < s->refcount_block_size; j++) {
+            if (s->get_refcount(refcount_block, j)) {
+                alloc_bitmap_update(s, (i << s->refcount_block_bits) + j, 1,
+                                    true);
+            }
+        }
+
+        qcow2_cache_put(bs, s->refcount_block_cache, &refcount_block);
+    }
+
+    return 0;
+
+fail:
+    qcow2_alloc_bitmap_invalidate(bs);
+    return ret;
+}
+
+/*
+ * Returns the index of the first cluster at or after @start that begins a
+ * run of @nb_clusters free clusters.
+ */
+static uint64_t alloc_bitmap_find_free(BDRVQcowState *s, uint64_t start,
+                                       uint64_t nb_clusters)
+{
+    uint64_t end;
+
+    while (start < s->alloc_bitmap_size) {
+        start = find_next_zero_bit(s->alloc_bitmap, s->alloc_bitmap_size,
+                                   start);
+        end = find_next_bit(s->alloc_bitmap, s->alloc_bitmap_size, start);
+        /* Everything past the end of the bitmap is free */
+        if (end >= s->alloc_bitmap_size || end - start >= nb_clusters) {
+            break;
+        }
+        start = end;
+    }
+
+    return start;
+}
+
 
 static uint64_t get_refcount_ro0(const void *refcount_array, uint64_t index)
 {
@@ -394,6 +511,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             (s->refcount_block_size - 1);
         s->set_refcount(*refcount_block, block_index, 1);
+        alloc_bitmap_update(s, new_block >> s->cluster_bits, 1, true);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -439,6 +557,8 @@ static int alloc_refcount_block(BlockDriverState *bs,
         }
 
         s->refcount_table[refcount_table_index] = new_block;
+        qcow2_metadata_index_add(bs, QCOW2_OL_REFCOUNT_BLOCK, new_block,
+                                 s->cluster_size);
 
         /* The new refcount block may be where the caller intended to put its
          * data, so let it restart the search. */
@@ -532,6 +652,8 @@ static int alloc_refcount_block(BlockDriverState *bs,
     for (i = 0; i < table_clusters + blocks_clusters; i++) {
         s->set_refcount(new_blocks, block++, 1);
     }
+    alloc_bitmap_update(s, meta_offset >> s->cluster_bits,
+                        table_clusters + blocks_clusters, true);
 
     /* Write refcount blocks to disk */
     BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_ALLOC_WRITE_BLOCKS);
@@ -578,6 +700,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table = new_table;
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
+    qcow2_metadata_index_invalidate(bs);
 
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
@@ -749,6 +872,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         s->set_refcount(refcount_block, block_index, refcount);
+        alloc_bitmap_update(s, cluster_index, 1, refcount != 0);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
             update_refcount_discard(bs, cluster_offset, s->cluster_size);
@@ -825,6 +949,20 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
     }
 
     nb_clusters = size_to_clusters(s, size);
+
+    if (!s->alloc_bitmap) {
+        /* If the index cannot be built, fall back to scanning the refcount
+         * blocks below */
+        alloc_bitmap_load(bs);
+    }
+
+    if (s->alloc_bitmap) {
+        s->free_cluster_index = alloc_bitmap_find_free(s, s->free_cluster_index,
+                                                       nb_clusters);
+        s->free_cluster_index += nb_clusters;
+        goto done;
+    }
+
 retry:
     for(i = 0; i < nb_clusters; i++) {
         uint64_t next_cluster_index = s->free_cluster_index++;
@@ -837,6 +975,8 @@ retry:
         }
     }
 
+done:
+
     /* Make sure that all offsets in the "allocated" range are representable
      * in an int64_t */
     if (s->free_cluster_index > 0 &&
@@ -1096,7 +1236,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             for(j = 0; j < s->l2_size; j++) {
                 uint64_t cluster_index;
 
-                offset = be64_to_cpu(l2_table[j]);
+                offset = get_l2_entry(s, l2_table, j);
                 old_offset = offset;
                 offset &= ~QCOW_OFLAG_COPIED;
 
@@ -1167,7 +1307,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                             s->refcount_block_cache);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
+                    set_l2_entry(s, l2_table, j, offset);
                     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
                                                  l2_table);
                 }
@@ -1356,15 +1496,14 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t *l2_table, l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
+    int i, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
+    l2_table = g_malloc(s->cluster_size);
 
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
+    ret = bdrv_pread(bs->file, l2_offset, l2_table, s->cluster_size);
     if (ret < 0) {
         fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
         res->check_errors++;
@@ -1373,7 +1512,20 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+        /* Only normal clusters have a subcluster bitmap, and a subcluster
+         * can't be both allocated and zero */
+        if (qcow2_get_cluster_type(l2_entry) == QCOW2_CLUSTER_NORMAL ?
+            (l2_bitmap & (l2_bitmap >> 32) & QCOW_L2_BITMAP_ALL_ALLOC) :
+            l2_bitmap)
+        {
+            fprintf(stderr, "ERROR: invalid subcluster bitmap %#" PRIx64
+                    " for L2 entry %#" PRIx64 " (L2 offset: %#" PRIx64
+                    ", L2 index: %#x)\n", l2_bitmap, l2_entry, l2_offset, i);
+            res->corruptions++;
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1594,8 +1746,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+        ret = bdrv_pread(bs->file, l2_offset, l2_table, s->cluster_size);
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1604,7 +1755,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1624,9 +1775,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -1818,6 +1969,39 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* dirty bitmaps */
+    if (s->nb_bitmaps) {
+        Qcow2Bitmap *bitmaps;
+        int nb_bitmaps;
+
+        nb_bitmaps = qcow2_read_bitmaps(bs, &bitmaps);
+        if (nb_bitmaps < 0) {
+            fprintf(stderr, "ERROR reading dirty bitmap directory: %s\n",
+                    strerror(-nb_bitmaps));
+            res->corruptions++;
+            nb_bitmaps = 0;
+        }
+        for (i = 0; i < nb_bitmaps; i++) {
+            if (!bitmaps[i].data_offset) {
+                continue;
+            }
+            ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                                bitmaps[i].data_offset, bitmaps[i].data_size);
+            if (ret < 0) {
+                qcow2_free_bitmaps(bitmaps, nb_bitmaps);
+                return ret;
+            }
+        }
+        qcow2_free_bitmaps(bitmaps, nb_bitmaps);
+
+        ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                            s->bitmap_directory_offset,
+                            s->bitmap_directory_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* refcount data */
     ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
                         s->refcount_table_offset,
@@ -2155,6 +2339,8 @@ write_refblocks:
     s->refcount_table = on_disk_reftable;
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
+    qcow2_alloc_bitmap_invalidate(bs);
+    qcow2_metadata_index_invalidate(bs);
 
     return 0;
 
@@ -2284,13 +2470,254 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     ret = 0;
 
 fail:
+    if (fix) {
+        /* Repairs may have rewritten refcount blocks behind our back */
+        qcow2_alloc_bitmap_invalidate(bs);
+        qcow2_metadata_index_invalidate(bs);
+    }
     g_free(refcount_table);
 
     return ret;
 }
 
-#define overlaps_with(ofs, sz) \
-    ranges_overlap(offset, size, ofs, sz)
+/*
+ * The metadata index lists every host cluster that holds metadata checked by
+ * qcow2_check_metadata_overlap() together with the kind of metadata stored
+ * there, so that a check is a binary search instead of a walk over all L1,
+ * L2 and refcount tables (and a read of every snapshot L1 table for
+ * QCOW2_OL_INACTIVE_L2).
+ *
+ * It is built from the in-memory tables only, never from refcounts, so that
+ * it still protects against refcount corruption.  Allocating an L2 table or
+ * a refcount block updates it incrementally; rarer operations that move the
+ * L1 table, the refcount table or the snapshots simply invalidate it so that
+ * it is rebuilt on the next check.
+ */
+
+void qcow2_metadata_index_invalidate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    g_free(s->metadata_index);
+    s->metadata_index = NULL;
+    s->metadata_index_len = 0;
+    s->metadata_index_alloc = 0;
+    s->metadata_index_valid = false;
+}
+
+/* Returns the position of the first entry with cluster_index >= @cluster */
+static size_t metadata_index_find(BDRVQcowState *s, uint64_t cluster)
+{
+    size_t lo = 0, hi = s->metadata_index_len;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->metadata_index[mid].cluster_index < cluster) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static void metadata_index_insert(BDRVQcowState *s, size_t pos,
+                                  uint64_t cluster, int type)
+{
+    if (s->metadata_index_len == s->metadata_index_alloc) {
+        s->metadata_index_alloc = MAX(64, s->metadata_index_alloc * 2);
+        s->metadata_index = g_renew(Qcow2MetadataCluster, s->metadata_index,
+                                    s->metadata_index_alloc);
+    }
+
+    memmove(&s->metadata_index[pos + 1], &s->metadata_index[pos],
+            (s->metadata_index_len - pos) * sizeof(Qcow2MetadataCluster));
+    s->metadata_index[pos] = (Qcow2MetadataCluster) {
+        .cluster_index = cluster,
+        .types         = type,
+    };
+    s->metadata_index_len++;
+}
+
+void qcow2_metadata_index_add(BlockDriverState *bs, int type,
+                              uint64_t offset, uint64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster, end;
+
+    if (!s->metadata_index_valid || !size) {
+        return;
+    }
+
+    end = size_to_clusters(s, offset_into_cluster(s, offset) + size) +
+          (offset >> s->cluster_bits);
+    for (cluster = offset >> s->cluster_bits; cluster < end; cluster++) {
+        size_t pos = metadata_index_find(s, cluster);
+
+        if (pos < s->metadata_index_len &&
+            s->metadata_index[pos].cluster_index == cluster) {
+            s->metadata_index[pos].types |= type;
+        } else {
+            metadata_index_insert(s, pos, cluster, type);
+        }
+    }
+}
+
+void qcow2_metadata_index_remove(BlockDriverState *bs, int type,
+                                 uint64_t offset, uint64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster, end;
+
+    if (!s->metadata_index_valid || !size) {
+        return;
+    }
+
+    end = size_to_clusters(s, offset_into_cluster(s, offset) + size) +
+          (offset >> s->cluster_bits);
+    for (cluster = offset >> s->cluster_bits; cluster < end; cluster++) {
+        size_t pos = metadata_index_find(s, cluster);
+
+        if (pos == s->metadata_index_len ||
+            s->metadata_index[pos].cluster_index != cluster) {
+            continue;
+        }
+
+        s->metadata_index[pos].types &= ~type;
+        if (!s->metadata_index[pos].types) {
+            memmove(&s->metadata_index[pos], &s->metadata_index[pos + 1],
+                    (s->metadata_index_len - pos - 1) *
+                    sizeof(Qcow2MetadataCluster));
+            s->metadata_index_len--;
+        }
+    }
+}
+
+/* Appends entries without keeping the index sorted; used while building */
+static void metadata_index_append(BDRVQcowState *s, int type,
+                                  uint64_t offset, uint64_t size)
+{
+    uint64_t cluster, end;
+
+    end = size_to_clusters(s, offset_into_cluster(s, offset) + size) +
+          (offset >> s->cluster_bits);
+    for (cluster = offset >> s->cluster_bits; cluster < end; cluster++) {
+        metadata_index_insert(s, s->metadata_index_len, cluster, type);
+    }
+}
+
+static int metadata_cluster_cmp(const void *a, const void *b)
+{
+    const Qcow2MetadataCluster *ca = a, *cb = b;
+
+    if (ca->cluster_index < cb->cluster_index) {
+        return -1;
+    }
+    return ca->cluster_index > cb->cluster_index;
+}
+
+static int metadata_index_build(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    size_t i, j;
+    int ret;
+
+    assert(!s->metadata_index_valid && !s->metadata_index);
+
+    if (s->l1_size) {
+        metadata_index_append(s, QCOW2_OL_ACTIVE_L1, s->l1_table_offset,
+                              s->l1_size * sizeof(uint64_t));
+    }
+
+    if (s->refcount_table_size) {
+        metadata_index_append(s, QCOW2_OL_REFCOUNT_TABLE,
+                              s->refcount_table_offset,
+                              s->refcount_table_size * sizeof(uint64_t));
+    }
+
+    if (s->snapshots_size) {
+        metadata_index_append(s, QCOW2_OL_SNAPSHOT_TABLE, s->snapshots_offset,
+                              s->snapshots_size);
+    }
+
+    for (i = 0; s->snapshots && i < s->nb_snapshots; i++) {
+        if (s->snapshots[i].l1_size) {
+            metadata_index_append(s, QCOW2_OL_INACTIVE_L1,
+                                  s->snapshots[i].l1_table_offset,
+                                  s->snapshots[i].l1_size * sizeof(uint64_t));
+        }
+    }
+
+    for (i = 0; s->l1_table && i < s->l1_size; i++) {
+        if (s->l1_table[i] & L1E_OFFSET_MASK) {
+            metadata_index_append(s, QCOW2_OL_ACTIVE_L2,
+                                  s->l1_table[i] & L1E_OFFSET_MASK,
+                                  s->cluster_size);
+        }
+    }
+
+    for (i = 0; s->refcount_table && i < s->refcount_table_size; i++) {
+        if (s->refcount_table[i] & REFT_OFFSET_MASK) {
+            metadata_index_append(s, QCOW2_OL_REFCOUNT_BLOCK,
+                                  s->refcount_table[i] & REFT_OFFSET_MASK,
+                                  s->cluster_size);
+        }
+    }
+
+    /* Reading every snapshot L1 table is what makes this check expensive,
+     * so only do it if it has been asked for */
+    for (i = 0; (s->overlap_check & QCOW2_OL_INACTIVE_L2) && s->snapshots &&
+                i < s->nb_snapshots; i++) {
+        uint64_t l1_ofs = s->snapshots[i].l1_table_offset;
+        uint32_t l1_sz  = s->snapshots[i].l1_size;
+        uint64_t l1_sz2 = l1_sz * sizeof(uint64_t);
+        uint64_t *l1 = g_try_malloc(l1_sz2);
+
+        if (l1_sz2 && l1 == NULL) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+
+        ret = bdrv_pread(bs->file, l1_ofs, l1, l1_sz2);
+        if (ret < 0) {
+            g_free(l1);
+            goto fail;
+        }
+
+        for (j = 0; j < l1_sz; j++) {
+            uint64_t l2_ofs = be64_to_cpu(l1[j]) & L1E_OFFSET_MASK;
+            if (l2_ofs) {
+                metadata_index_append(s, QCOW2_OL_INACTIVE_L2, l2_ofs,
+                                      s->cluster_size);
+            }
+        }
+
+        g_free(l1);
+    }
+
+    /* Sort and merge the entries that refer to the same cluster */
+    if (s->metadata_index_len) {
+        qsort(s->metadata_index, s->metadata_index_len,
+              sizeof(Qcow2MetadataCluster), metadata_cluster_cmp);
+        for (i = 1, j = 0; i < s->metadata_index_len; i++) {
+            if (s->metadata_index[i].cluster_index ==
+                s->metadata_index[j].cluster_index) {
+                s->metadata_index[j].types |= s->metadata_index[i].types;
+            } else {
+                s->metadata_index[++j] = s->metadata_index[i];
+            }
+        }
+        s->metadata_index_len = j + 1;
+    }
+
+    s->metadata_index_valid = true;
+    return 0;
+
+fail:
+    qcow2_metadata_index_invalidate(bs);
+    return ret;
+}
 
 /*
  * Checks if the given offset into the image file is actually free to use by
@@ -2311,7 +2738,9 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
 {
     BDRVQcowState *s = bs->opaque;
     int chk = s->overlap_check & ~ign;
-    int i, j;
+    uint64_t end;
+    size_t i;
+    int ret;
 
     if (!size) {
         return 0;
@@ -2323,86 +2752,28 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
         }
     }
 
-    /* align range to test to cluster boundaries */
-    size = align_offset(offset_into_cluster(s, offset) + size, s->cluster_size);
-    offset = start_of_cluster(s, offset);
-
-    if ((chk & QCOW2_OL_ACTIVE_L1) && s->l1_size) {
-        if (overlaps_with(s->l1_table_offset, s->l1_size * sizeof(uint64_t))) {
-            return QCOW2_OL_ACTIVE_L1;
-        }
-    }
-
-    if ((chk & QCOW2_OL_REFCOUNT_TABLE) && s->refcount_table_size) {
-        if (overlaps_with(s->refcount_table_offset,
-            s->refcount_table_size * sizeof(uint64_t))) {
-            return QCOW2_OL_REFCOUNT_TABLE;
-        }
-    }
-
-    if ((chk & QCOW2_OL_SNAPSHOT_TABLE) && s->snapshots_size) {
-        if (overlaps_with(s->snapshots_offset, s->snapshots_size)) {
-            return QCOW2_OL_SNAPSHOT_TABLE;
-        }
-    }
-
-    if ((chk & QCOW2_OL_INACTIVE_L1) && s->snapshots) {
-        for (i = 0; i < s->nb_snapshots; i++) {
-            if (s->snapshots[i].l1_size &&
-                overlaps_with(s->snapshots[i].l1_table_offset,
-                s->snapshots[i].l1_size * sizeof(uint64_t))) {
-                return QCOW2_OL_INACTIVE_L1;
-            }
-        }
-    }
-
-    if ((chk & QCOW2_OL_ACTIVE_L2) && s->l1_table) {
-        for (i = 0; i < s->l1_size; i++) {
-            if ((s->l1_table[i] & L1E_OFFSET_MASK) &&
-                overlaps_with(s->l1_table[i] & L1E_OFFSET_MASK,
-                s->cluster_size)) {
-                return QCOW2_OL_ACTIVE_L2;
-            }
-        }
+    if (!(chk & ~QCOW2_OL_MAIN_HEADER)) {
+        return 0;
     }
 
-    if ((chk & QCOW2_OL_REFCOUNT_BLOCK) && s->refcount_table) {
-        for (i = 0; i < s->refcount_table_size; i++) {
-            if ((s->refcount_table[i] & REFT_OFFSET_MASK) &&
-                overlaps_with(s->refcount_table[i] & REFT_OFFSET_MASK,
-                s->cluster_size)) {
-                return QCOW2_OL_REFCOUNT_BLOCK;
-            }
+    if (!s->metadata_index_valid) {
+        ret = metadata_index_build(bs);
+        if (ret < 0) {
+            return ret;
         }
     }
 
-    if ((chk & QCOW2_OL_INACTIVE_L2) && s->snapshots) {
-        for (i = 0; i < s->nb_snapshots; i++) {
-            uint64_t l1_ofs = s->snapshots[i].l1_table_offset;
-            uint32_t l1_sz  = s->snapshots[i].l1_size;
-            uint64_t l1_sz2 = l1_sz * sizeof(uint64_t);
-            uint64_t *l1 = g_try_malloc(l1_sz2);
-            int ret;
-
-            if (l1_sz2 && l1 == NULL) {
-                return -ENOMEM;
-            }
-
-            ret = bdrv_pread(bs->file, l1_ofs, l1, l1_sz2);
-            if (ret < 0) {
-                g_free(l1);
-                return ret;
-            }
-
-            for (j = 0; j < l1_sz; j++) {
-                uint64_t l2_ofs = be64_to_cpu(l1[j]) & L1E_OFFSET_MASK;
-                if (l2_ofs && overlaps_with(l2_ofs, s->cluster_size)) {
-                    g_free(l1);
-                    return QCOW2_OL_INACTIVE_L2;
-                }
-            }
+    /* align range to test to cluster boundaries */
+    end = size_to_clusters(s, offset_into_cluster(s, offset) + size) +
+          (offset >> s->cluster_bits);
 
-            g_free(l1);
+    for (i = metadata_index_find(s, offset >> s->cluster_bits);
+         i < s->metadata_index_len &&
+         s->metadata_index[i].cluster_index < end; i++)
+    {
+        int types = s->metadata_index[i].types & chk;
+        if (types) {
+            return 1 << ctz32(types);
         }
     }
 
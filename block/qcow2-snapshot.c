@@ -38,6 +38,7 @@ void qcow2_free_snapshots(BlockDriverState *bs)
     g_free(s->snapshots);
     s->snapshots = NULL;
     s->nb_snapshots = 0;
+    qcow2_metadata_index_invalidate(bs);
 }
 
 int qcow2_read_snapshots(BlockDriverState *bs)
@@ -125,6 +126,7 @@ int qcow2_read_snapshots(BlockDriverState *bs)
 
     assert(offset - s->snapshots_offset <= INT_MAX);
     s->snapshots_size = offset - s->snapshots_offset;
+    qcow2_metadata_index_invalidate(bs);
     return 0;
 
 fail:
@@ -264,6 +266,7 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
                         QCOW2_DISCARD_SNAPSHOT);
     s->snapshots_offset = snapshots_offset;
     s->snapshots_size = snapshots_size;
+    qcow2_metadata_index_invalidate(bs);
     return 0;
 
 fail:
@@ -423,12 +426,14 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     }
     s->snapshots = new_snapshot_list;
     s->snapshots[s->nb_snapshots++] = *sn;
+    qcow2_metadata_index_invalidate(bs);
 
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         g_free(s->snapshots);
         s->snapshots = old_snapshot_list;
         s->nb_snapshots--;
+        qcow2_metadata_index_invalidate(bs);
         goto fail;
     }
 
@@ -551,6 +556,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     for(i = 0;i < s->l1_size; i++) {
         s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
     }
+    qcow2_metadata_index_invalidate(bs);
 
     if (ret < 0) {
         goto fail;
@@ -603,6 +609,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
             s->snapshots + snapshot_index + 1,
             (s->nb_snapshots - snapshot_index - 1) * sizeof(sn));
     s->nb_snapshots--;
+    qcow2_metadata_index_invalidate(bs);
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret,
@@ -728,6 +735,7 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
     for(i = 0;i < s->l1_size; i++) {
         be64_to_cpus(&s->l1_table[i]);
     }
+    qcow2_metadata_index_invalidate(bs);
 
     return 0;
 }
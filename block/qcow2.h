@@ -59,6 +59,22 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* With extended L2 entries, each cluster is divided into subclusters whose
+ * state is described by a second 64-bit word in the L2 entry: bit x is set if
+ * subcluster x is allocated, bit 32 + x if it reads as zeros.  The bitmap is
+ * only meaningful for QCOW2_CLUSTER_NORMAL entries and must be 0 otherwise. */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_OFLAG_SUB_ALLOC(x)    (1ULL << (x))
+#define QCOW_OFLAG_SUB_ZERO(x)     (QCOW_OFLAG_SUB_ALLOC(x) << 32)
+/* Subclusters [x, y) */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(x, y) \
+    (QCOW_OFLAG_SUB_ALLOC(y) - QCOW_OFLAG_SUB_ALLOC(x))
+#define QCOW_L2_BITMAP_ALL_ALLOC   QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32)
+#define QCOW_L2_BITMAP_ALL_ZEROES  (QCOW_L2_BITMAP_ALL_ALLOC << 32)
+
+/* Subclusters must not be smaller than a sector */
+#define MIN_EXTL2_CLUSTER_BITS 14
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
@@ -75,6 +91,13 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Maximum number of clusters compressed or decompressed concurrently in the
+ * thread pool by a single image */
+#define QCOW2_MAX_THREADS 4
+
+/* Number of L2 tables that are read ahead on sequential access */
+#define QCOW2_L2_READAHEAD 4
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -116,6 +139,12 @@ typedef struct QCowHeader {
 
     uint32_t refcount_order;
     uint32_t header_length;
+
+    /* Additional fields */
+    uint8_t compression_type;
+
+    /* header must be a multiple of 8 */
+    uint8_t padding[7];
 } QEMU_PACKED QCowHeader;
 
 typedef struct QEMU_PACKED QCowSnapshotHeader {
@@ -176,11 +205,24 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION   = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_COMPRESSION
+                                 | QCOW2_INCOMPAT_EXTL2,
+};
+
+/* Compression types for the compression_type header field */
+enum {
+    QCOW2_COMPRESSION_TYPE_ZLIB = 0,
+    QCOW2_COMPRESSION_TYPE_ZSTD = 1,
+    QCOW2_COMPRESSION_TYPE_MAX,
 };
 
 /* Compatible feature bits */
@@ -191,6 +233,15 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS       =
+        1 << QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_DIRTY_BITMAPS,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -206,6 +257,41 @@ typedef struct Qcow2Feature {
     char    name[46];
 } QEMU_PACKED Qcow2Feature;
 
+/* Dirty bitmap directory entry flags */
+enum {
+    QCOW2_BITMAP_IN_USE         = 1 << 0,
+    QCOW2_BITMAP_ENABLED        = 1 << 1,
+
+    QCOW2_BITMAP_FLAGS_MASK     = QCOW2_BITMAP_IN_USE
+                                | QCOW2_BITMAP_ENABLED,
+};
+
+#define QCOW2_MAX_BITMAPS 65535
+#define QCOW2_MAX_BITMAP_NAME_SIZE 1023
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (64 * 1024 * 1024)
+
+typedef struct Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
+
+typedef struct Qcow2Bitmap {
+    char *name;
+    uint32_t flags;
+    int granularity_bits;
+    uint64_t data_offset;   /* 0 if no bit is set */
+    uint64_t data_size;
+    uint64_t entry_offset;  /* host offset of the directory entry */
+} Qcow2Bitmap;
+
+/* A host cluster holding metadata, see qcow2_check_metadata_overlap() */
+typedef struct Qcow2MetadataCluster {
+    uint64_t cluster_index;
+    int types; /* bitmask of QCow2MetadataOverlap values */
+} Qcow2MetadataCluster;
+
 typedef struct Qcow2DiscardRegion {
     BlockDriverState *bs;
     uint64_t offset;
@@ -222,6 +308,10 @@ typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
+    int subcluster_bits;
+    int subcluster_size;
+    int subcluster_sectors;
+    int subclusters_per_cluster; /* 1 without extended L2 entries */
     int l2_bits;
     int l2_size;
     int l1_size;
@@ -236,10 +326,12 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    /* L1 index of the last L2 table loaded, to detect sequential access */
+    uint64_t l2_last_l1_index;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    uint8_t compression_type; /* QCOW2_COMPRESSION_TYPE_* */
+    int nb_threads;
+    CoQueue thread_wait_queue;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -248,6 +340,20 @@ typedef struct BDRVQcowState {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* In-memory index of the clusters with a non-zero refcount, built from
+     * the refcount blocks on the first allocation.  Clusters at or past
+     * alloc_bitmap_size are free.  NULL if the index is not available. */
+    unsigned long *alloc_bitmap;
+    uint64_t alloc_bitmap_size;
+
+    /* Index of the host clusters that qcow2_check_metadata_overlap() has to
+     * protect, sorted by cluster_index.  Built on the first check and then
+     * updated as metadata is allocated or moved. */
+    Qcow2MetadataCluster *metadata_index;
+    size_t metadata_index_len;
+    size_t metadata_index_alloc;
+    bool metadata_index_valid;
+
     CoMutex lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
@@ -278,6 +384,11 @@ typedef struct BDRVQcowState {
     uint64_t compatible_features;
     uint64_t autoclear_features;
 
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_offset;
+    uint64_t bitmap_directory_size;
+    bool dirty_bitmaps_loaded; /* the image's bitmaps are now owned by bs */
+
     size_t unknown_header_fields_size;
     void* unknown_header_fields;
     QLIST_HEAD(, Qcow2UnknownHeaderExtension) unknown_header_ext;
@@ -325,6 +436,13 @@ typedef struct QCowL2Meta
     /** Number of newly allocated clusters */
     int nb_clusters;
 
+    /**
+     * Whether the clusters at alloc_offset are the ones already referenced by
+     * the L2 table.  Only the subcluster bitmap of their L2 entries needs an
+     * update then.
+     */
+    bool keep_old;
+
     /**
      * Requests that overlap with this allocation and wait to be restarted
      * when the allocating request has completed.
@@ -456,6 +574,72 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+static inline bool has_subclusters(BDRVQcowState *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+/* Size of an L2 entry in uint64_t words */
+static inline int l2_entry_words(BDRVQcowState *s)
+{
+    return has_subclusters(s) ? 2 : 1;
+}
+
+static inline uint64_t get_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                    int idx)
+{
+    return be64_to_cpu(l2_table[idx * l2_entry_words(s)]);
+}
+
+static inline void set_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    l2_table[idx * l2_entry_words(s)] = cpu_to_be64(entry);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                     int idx)
+{
+    return has_subclusters(s) ? be64_to_cpu(l2_table[idx * 2 + 1]) : 0;
+}
+
+static inline void set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                 int idx, uint64_t bitmap)
+{
+    if (has_subclusters(s)) {
+        l2_table[idx * 2 + 1] = cpu_to_be64(bitmap);
+    } else {
+        assert(bitmap == 0);
+    }
+}
+
+static inline int offset_to_sc_index(BDRVQcowState *s, int64_t offset)
+{
+    return offset_into_cluster(s, offset) >> s->subcluster_bits;
+}
+
+/*
+ * Returns the type of subcluster @sc_index of the cluster described by
+ * @l2_entry and @l2_bitmap.  Without extended L2 entries, this is the type of
+ * the whole cluster.
+ */
+static inline int qcow2_get_subcluster_type(BDRVQcowState *s,
+                                            uint64_t l2_entry,
+                                            uint64_t l2_bitmap, int sc_index)
+{
+    int type = qcow2_get_cluster_type(l2_entry);
+
+    if (!has_subclusters(s) || type != QCOW2_CLUSTER_NORMAL) {
+        return type;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index)) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        return QCOW2_CLUSTER_ZERO;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 {
@@ -496,6 +680,7 @@ void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_alloc_bitmap_invalidate(BlockDriverState *bs);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
                        uint64_t *refcount);
@@ -522,17 +707,30 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 
 void qcow2_process_discards(BlockDriverState *bs, int ret);
 
+void qcow2_metadata_index_invalidate(BlockDriverState *bs);
+void qcow2_metadata_index_add(BlockDriverState *bs, int type,
+                              uint64_t offset, uint64_t size);
+void qcow2_metadata_index_remove(BlockDriverState *bs, int type,
+                                 uint64_t offset, uint64_t size);
 int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
                                  int64_t size);
 int qcow2_pre_write_overlap_check(BlockDriverState *bs, int ign, int64_t offset,
                                   int64_t size);
 
+/* qcow2-threads.c functions */
+bool qcow2_compression_type_supported(int compression_type);
+ssize_t coroutine_fn
+qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                  const void *src, size_t src_size);
+ssize_t coroutine_fn
+qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                    const void *src, size_t src_size);
+
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -570,6 +768,16 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmaps(BlockDriverState *bs, Qcow2Bitmap **pbitmaps);
+void qcow2_free_bitmaps(Qcow2Bitmap *bitmaps, int nb_bitmaps);
+void qcow2_load_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+void qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+bool qcow2_can_store_persistent_dirty_bitmap(BlockDriverState *bs,
+                                             const char *name,
+                                             uint32_t granularity,
+                                             Error **errp);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
@@ -585,8 +793,11 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c);
 
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int qcow2_cache_get_readahead(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, int readahead, void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c);
 
 #endif
@@ -0,0 +1,725 @@
+/*
+ * Block driver that caches image data in host RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "qemu/atomic.h"
+
+/*
+ * The cache is a set-associative table of fixed-size chunks.  Each chunk of
+ * the image maps to one set of CACHE_WAYS slots, and the least recently used
+ * slot of the set is replaced on a miss.  Only clean data is kept: writes go
+ * straight to the image and drop the chunks that they touch.
+ *
+ * The table can be mapped from a file (a memfd passed with add-fd, or a file
+ * on tmpfs) so that several processes using the same image, typically the
+ * base of many backing chains, share one copy of its data.  Everything in
+ * the mapping is therefore accessed with atomics.  Each slot has a sequence
+ * counter that is odd while the slot is being modified; readers check that
+ * it did not change while they copied the data, and fall back to the image
+ * if it did.  A generation counter is bumped by every write so that data
+ * read from the image concurrently with a write is never inserted.
+ *
+ * A shared cache records the device, inode and modification time of the
+ * image.  Opening it for another image fails, and opening it after the image
+ * was modified behind its back (e.g. a stale file on tmpfs) empties it.
+ */
+
+#define CACHE_MAGIC                 0x4843414351454d55ULL
+#define CACHE_WAYS                  8
+#define CACHE_DEFAULT_SIZE          (64 * 1024 * 1024)
+#define CACHE_DEFAULT_CHUNK_SIZE    (64 * 1024)
+#define CACHE_MAX_CHUNK_SIZE        (2 * 1024 * 1024)
+
+typedef struct CacheHeader {
+    uint64_t magic;
+    uint64_t chunk_size;
+    uint64_t nb_slots;
+    uint64_t image_size;
+    uint64_t image_dev;         /* identity of the image, shared caches only */
+    uint64_t image_ino;
+    int64_t image_mtime_sec;
+    int64_t image_mtime_nsec;
+    uint64_t clock;             /* LRU clock, incremented on every hit */
+    uint32_t generation;        /* incremented on every write */
+    uint32_t reserved;
+} CacheHeader;
+
+typedef struct CacheSlot {
+    uint32_t seq;               /* odd while the slot is being modified */
+    uint32_t reserved;
+    uint64_t tag;               /* chunk index + 1, or 0 if the slot is free */
+    uint64_t stamp;             /* LRU clock at the last hit */
+} CacheSlot;
+
+typedef struct BDRVRamCacheState {
+    void *map;
+    size_t map_size;
+    int fd;                     /* only valid for shared caches */
+
+    CacheHeader *header;
+    CacheSlot *slots;
+    uint8_t *data;
+
+    uint64_t chunk_size;
+    uint64_t nb_slots;
+    uint64_t nb_sets;
+} BDRVRamCacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "ram-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of cached data",
+        },
+        {
+            .name = "chunk-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the cache",
+        },
+        {
+            .name = "shared-path",
+            .type = QEMU_OPT_STRING,
+            .help = "File to map the cache from, so that it can be shared "
+                    "with other processes",
+        },
+        { /* end of list */ }
+    },
+};
+
+static CacheSlot *cache_set(BDRVRamCacheState *s, uint64_t chunk)
+{
+    return &s->slots[(chunk % s->nb_sets) * CACHE_WAYS];
+}
+
+static uint8_t *cache_slot_data(BDRVRamCacheState *s, CacheSlot *slot)
+{
+    return s->data + (slot - s->slots) * s->chunk_size;
+}
+
+static bool cache_slot_trylock(CacheSlot *slot)
+{
+    uint32_t seq = atomic_read(&slot->seq);
+
+    return !(seq & 1) && atomic_cmpxchg(&slot->seq, seq, seq + 1) == seq;
+}
+
+static void cache_slot_unlock(CacheSlot *slot)
+{
+    /* __sync builtins are full barriers, no smp_wmb() needed */
+    atomic_inc(&slot->seq);
+}
+
+static CacheSlot *cache_lookup(BDRVRamCacheState *s, uint64_t chunk)
+{
+    CacheSlot *set = cache_set(s, chunk);
+    int i;
+
+    for (i = 0; i < CACHE_WAYS; i++) {
+        if (atomic_read(&set[i].tag) == chunk + 1) {
+            return &set[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Copy @bytes at @offset into chunk @chunk to @qiov, at @qiov_offset.
+ * Returns false (and possibly leaves garbage in @qiov) if the chunk is not
+ * cached.
+ */
+static bool cache_read_chunk(BDRVRamCacheState *s, uint64_t chunk,
+                             uint64_t offset, uint64_t bytes,
+                             QEMUIOVector *qiov, size_t qiov_offset)
+{
+    CacheSlot *slot = cache_lookup(s, chunk);
+    uint32_t seq;
+
+    if (!slot) {
+        return false;
+    }
+
+    seq = atomic_read(&slot->seq);
+    smp_rmb();
+    if ((seq & 1) || atomic_read(&slot->tag) != chunk + 1) {
+        return false;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, cache_slot_data(s, slot) + offset,
+                        bytes);
+
+    smp_rmb();
+    if (atomic_read(&slot->seq) != seq) {
+        return false;
+    }
+
+    atomic_set(&slot->stamp, atomic_fetch_inc(&s->header->clock));
+    return true;
+}
+
+/*
+ * Insert chunk @chunk with the data in @buf, unless the image was written
+ * since @generation was sampled.  This is best effort: if the victim slot is
+ * busy, the chunk is simply not cached.
+ */
+static void cache_insert(BDRVRamCacheState *s, uint64_t chunk, const uint8_t *buf,
+                         uint32_t generation)
+{
+    CacheSlot *set = cache_set(s, chunk);
+    CacheSlot *victim = NULL;
+    uint64_t victim_tag = 0;
+    int i;
+
+    for (i = 0; i < CACHE_WAYS; i++) {
+        uint64_t tag = atomic_read(&set[i].tag);
+
+        if (tag == chunk + 1) {
+            return;
+        }
+        if (!victim || (victim_tag != 0 &&
+            (tag == 0 || atomic_read(&set[i].stamp) <
+                         atomic_read(&victim->stamp))))
+        {
+            victim = &set[i];
+            victim_tag = tag;
+        }
+    }
+
+    if (!cache_slot_trylock(victim)) {
+        return;
+    }
+
+    if (atomic_read(&s->header->generation) == generation) {
+        memcpy(cache_slot_data(s, victim), buf, s->chunk_size);
+        atomic_set(&victim->tag, chunk + 1);
+        atomic_set(&victim->stamp, atomic_fetch_inc(&s->header->clock));
+
+        /* cache_drop_slot() does not wait for us, check again now that the
+         * tag is visible */
+        smp_mb();
+        if (atomic_read(&s->header->generation) != generation) {
+            atomic_set(&victim->tag, 0);
+        }
+    }
+
+    cache_slot_unlock(victim);
+}
+
+/*
+ * Drop @slot if it holds @tag, or unconditionally if @tag is 0.  The caller
+ * must have bumped the generation.
+ *
+ * This never waits for the slot lock, whose owner may be another process that
+ * died.  If the slot is busy, the tag is cleared without the lock: readers
+ * already miss a locked slot, and an insertion in progress checks the
+ * generation again after publishing its tag.
+ */
+static void cache_drop_slot(CacheSlot *slot, uint64_t tag)
+{
+    if (!cache_slot_trylock(slot)) {
+        if (tag == 0) {
+            atomic_set(&slot->tag, 0);
+        } else {
+            atomic_cmpxchg(&slot->tag, tag, 0);
+        }
+        return;
+    }
+
+    if (tag == 0 || atomic_read(&slot->tag) == tag) {
+        atomic_set(&slot->tag, 0);
+    }
+    cache_slot_unlock(slot);
+}
+
+static void cache_invalidate_all(BDRVRamCacheState *s)
+{
+    uint64_t i;
+
+    atomic_inc(&s->header->generation);
+    for (i = 0; i < s->nb_slots; i++) {
+        cache_drop_slot(&s->slots[i], 0);
+    }
+}
+
+static void cache_invalidate(BDRVRamCacheState *s, int64_t sector_num,
+                             int nb_sectors)
+{
+    uint64_t first, last, chunk;
+    int i;
+
+    if (nb_sectors <= 0) {
+        return;
+    }
+
+    first = sector_num * BDRV_SECTOR_SIZE / s->chunk_size;
+    last = ((sector_num + nb_sectors) * BDRV_SECTOR_SIZE - 1) / s->chunk_size;
+    if (last - first >= s->nb_sets) {
+        cache_invalidate_all(s);
+        return;
+    }
+
+    atomic_inc(&s->header->generation);
+    for (chunk = first; chunk <= last; chunk++) {
+        CacheSlot *set = cache_set(s, chunk);
+        for (i = 0; i < CACHE_WAYS; i++) {
+            cache_drop_slot(&set[i], chunk + 1);
+        }
+    }
+}
+
+/*
+ * Read @nb_chunks chunks starting at @first from the image into @buf and
+ * insert them into the cache.  The part of the last chunk that lies beyond
+ * the end of the image is zeroed.
+ */
+static int coroutine_fn cache_fill(BlockDriverState *bs, uint64_t first,
+                                   uint64_t nb_chunks, uint8_t *buf)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    uint64_t offset = first * s->chunk_size;
+    uint64_t bytes = nb_chunks * s->chunk_size;
+    uint64_t image_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint32_t generation;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint64_t i;
+    int ret;
+
+    if (offset + bytes > image_size) {
+        memset(buf + (image_size - offset), 0, offset + bytes - image_size);
+        bytes = image_size - offset;
+    }
+
+    iov = (struct iovec) {
+        .iov_base   = buf,
+        .iov_len    = bytes,
+    };
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    generation = atomic_read(&s->header->generation);
+    smp_rmb();
+
+    ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                        bytes >> BDRV_SECTOR_BITS, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < nb_chunks; i++) {
+        cache_insert(s, first + i, buf + i * s->chunk_size, generation);
+    }
+
+    return 0;
+}
+
+static int coroutine_fn cache_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                       int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    uint64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    uint64_t end = offset + nb_sectors * BDRV_SECTOR_SIZE;
+    size_t qiov_offset = 0;
+
+    while (offset < end) {
+        uint64_t chunk = offset / s->chunk_size;
+        uint64_t chunk_offset = offset % s->chunk_size;
+        uint64_t bytes = MIN(end - offset, s->chunk_size - chunk_offset);
+        uint64_t nb_chunks;
+        uint8_t *buf;
+        int ret;
+
+        if (cache_read_chunk(s, chunk, chunk_offset, bytes, qiov,
+                             qiov_offset))
+        {
+            offset += bytes;
+            qiov_offset += bytes;
+            continue;
+        }
+
+        /* Read the whole run of missing chunks with a single request */
+        nb_chunks = 1;
+        while ((chunk + nb_chunks) * s->chunk_size < end &&
+               !cache_lookup(s, chunk + nb_chunks))
+        {
+            nb_chunks++;
+        }
+
+        buf = qemu_try_blockalign(bs->file, nb_chunks * s->chunk_size);
+        if (buf == NULL) {
+            return -ENOMEM;
+        }
+
+        ret = cache_fill(bs, chunk, nb_chunks, buf);
+        if (ret < 0) {
+            qemu_vfree(buf);
+            return ret;
+        }
+
+        bytes = MIN(end, (chunk + nb_chunks) * s->chunk_size) - offset;
+        qemu_iovec_from_buf(qiov, qiov_offset, buf + chunk_offset, bytes);
+        qemu_vfree(buf);
+
+        offset += bytes;
+        qiov_offset += bytes;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn cache_co_writev(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        QEMUIOVector *qiov)
+{
+    int ret;
+
+    /* Invalidate even on failure, part of the request may have been written */
+    ret = bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
+    cache_invalidate(bs->opaque, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int coroutine_fn cache_co_write_zeroes(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors,
+                                              BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = bdrv_co_write_zeroes(bs->file, sector_num, nb_sectors, flags);
+    cache_invalidate(bs->opaque, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int coroutine_fn cache_co_discard(BlockDriverState *bs,
+                                         int64_t sector_num, int nb_sectors)
+{
+    int ret;
+
+    ret = bdrv_co_discard(bs->file, sector_num, nb_sectors);
+    cache_invalidate(bs->opaque, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int64_t coroutine_fn cache_co_get_block_status(BlockDriverState *bs,
+                                                      int64_t sector_num,
+                                                      int nb_sectors,
+                                                      int *pnum)
+{
+    *pnum = nb_sectors;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID | BDRV_BLOCK_DATA |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static int64_t cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file);
+}
+
+static int cache_truncate(BlockDriverState *bs, int64_t offset)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_truncate(bs->file, offset);
+    cache_invalidate_all(s);
+    if (ret == 0) {
+        atomic_set(&s->header->image_size, offset);
+    }
+
+    return ret;
+}
+
+static int cache_has_zero_init(BlockDriverState *bs)
+{
+    return bdrv_has_zero_init(bs->file);
+}
+
+static int cache_probe_blocksizes(BlockDriverState *bs, BlockSizes *bsz)
+{
+    return bdrv_probe_blocksizes(bs->file, bsz);
+}
+
+static int cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static bool cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                              BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file, candidate);
+}
+
+static void cache_set_pointers(BDRVRamCacheState *s)
+{
+    s->header = s->map;
+    s->slots = (CacheSlot *)(s->header + 1);
+    s->data = (uint8_t *)s->map + s->map_size - s->nb_slots * s->chunk_size;
+}
+
+static void cache_set_image_stat(CacheHeader *h, const struct stat *st)
+{
+    h->image_dev = st->st_dev;
+    h->image_ino = st->st_ino;
+    h->image_mtime_sec = st->st_mtim.tv_sec;
+    h->image_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static void cache_init_header(BDRVRamCacheState *s, int64_t image_size,
+                              const struct stat *image_st)
+{
+    CacheHeader *h = s->map;
+
+    h->magic = CACHE_MAGIC;
+    h->chunk_size = s->chunk_size;
+    h->nb_slots = s->nb_slots;
+    h->image_size = image_size;
+    if (image_st) {
+        cache_set_image_stat(h, image_st);
+    }
+}
+
+static int cache_map_shared(BDRVRamCacheState *s, const char *path,
+                            BlockDriverState *file, int64_t image_size,
+                            Error **errp)
+{
+    CacheHeader *h;
+    struct stat st, image_st;
+    int ret;
+
+    if (stat(file->filename, &image_st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not identify image '%s' for "
+                         "the shared cache", file->filename);
+        return ret;
+    }
+
+    s->fd = qemu_open(path, O_RDWR | O_CREAT, 0600);
+    if (s->fd < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not open '%s'", path);
+        return ret;
+    }
+
+    /* Serialize the initialization with other users of the file */
+    if (flock(s->fd, LOCK_EX) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not lock '%s'", path);
+        return ret;
+    }
+
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat '%s'", path);
+        goto out;
+    }
+
+    if (st.st_size == 0) {
+        if (ftruncate(s->fd, s->map_size) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not resize '%s'", path);
+            goto out;
+        }
+    } else if (st.st_size != s->map_size) {
+        error_setg(errp, "Shared cache '%s' has a different size", path);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map '%s'", path);
+        goto out;
+    }
+    cache_set_pointers(s);
+
+    h = s->header;
+    if (h->magic == 0) {
+        cache_init_header(s, image_size, &image_st);
+    } else if (h->magic != CACHE_MAGIC || h->chunk_size != s->chunk_size ||
+               h->nb_slots != s->nb_slots ||
+               h->image_dev != image_st.st_dev ||
+               h->image_ino != image_st.st_ino)
+    {
+        error_setg(errp, "Shared cache '%s' was created for a different "
+                   "image or with different options", path);
+        ret = -EINVAL;
+        goto out;
+    } else if (atomic_read(&h->image_size) != image_size ||
+               h->image_mtime_sec != image_st.st_mtim.tv_sec ||
+               h->image_mtime_nsec != image_st.st_mtim.tv_nsec)
+    {
+        /* The image was modified since the cache was last opened, maybe
+         * without going through it */
+        cache_invalidate_all(s);
+        atomic_set(&h->image_size, image_size);
+        cache_set_image_stat(h, &image_st);
+    }
+
+    ret = 0;
+out:
+    flock(s->fd, LOCK_UN);
+    return ret;
+}
+
+static int cache_map_anon(BDRVRamCacheState *s, int64_t image_size,
+                          Error **errp)
+{
+    /* Pages are only allocated when a chunk is first inserted */
+    s->map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        error_setg_errno(errp, errno, "Could not allocate cache");
+        return -ENOMEM;
+    }
+    cache_set_pointers(s);
+
+    cache_init_header(s, image_size, NULL);
+    return 0;
+}
+
+static void cache_unmap(BDRVRamCacheState *s)
+{
+    if (s->map) {
+        munmap(s->map, s->map_size);
+        s->map = NULL;
+    }
+    if (s->fd >= 0) {
+        qemu_close(s->fd);
+        s->fd = -1;
+    }
+}
+
+static int cache_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    BDRVRamCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *shared_path;
+    uint64_t size, header_size, map_size;
+    int64_t image_size;
+    int ret;
+
+    s->fd = -1;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    size = qemu_opt_get_size(opts, "size", CACHE_DEFAULT_SIZE);
+    s->chunk_size = qemu_opt_get_size(opts, "chunk-size",
+                                      CACHE_DEFAULT_CHUNK_SIZE);
+    shared_path = qemu_opt_get(opts, "shared-path");
+
+    if (s->chunk_size < BDRV_SECTOR_SIZE ||
+        s->chunk_size > CACHE_MAX_CHUNK_SIZE ||
+        (s->chunk_size & (s->chunk_size - 1)))
+    {
+        error_setg(errp, "Chunk size must be a power of two between 512 and %d",
+                   CACHE_MAX_CHUNK_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->nb_slots = size / s->chunk_size / CACHE_WAYS * CACHE_WAYS;
+    s->nb_sets = s->nb_slots / CACHE_WAYS;
+    if (s->nb_slots == 0) {
+        error_setg(errp, "Cache size must be at least %d chunks", CACHE_WAYS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    header_size = ROUND_UP(sizeof(CacheHeader) +
+                           s->nb_slots * sizeof(CacheSlot), getpagesize());
+    map_size = header_size + s->nb_slots * s->chunk_size;
+    if (map_size > SIZE_MAX) {
+        error_setg(errp, "Cache size too large");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->map_size = map_size;
+
+    image_size = bdrv_getlength(bs->file);
+    if (image_size < 0) {
+        error_setg_errno(errp, -image_size, "Could not get image size");
+        ret = image_size;
+        goto fail;
+    }
+
+    if (shared_path) {
+        ret = cache_map_shared(s, shared_path, bs->file, image_size, errp);
+    } else {
+        ret = cache_map_anon(s, image_size, errp);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        cache_unmap(s);
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void cache_close(BlockDriverState *bs)
+{
+    BDRVRamCacheState *s = bs->opaque;
+
+    cache_unmap(s);
+}
+
+static BlockDriver bdrv_ram_cache = {
+    .format_name            = "ram-cache",
+    .instance_size          = sizeof(BDRVRamCacheState),
+
+    .bdrv_open              = cache_open,
+    .bdrv_close             = cache_close,
+    .bdrv_reopen_prepare    = cache_reopen_prepare,
+
+    .bdrv_co_readv          = cache_co_readv,
+    .bdrv_co_writev         = cache_co_writev,
+    .bdrv_co_write_zeroes   = cache_co_write_zeroes,
+    .bdrv_co_discard        = cache_co_discard,
+    .bdrv_co_get_block_status = cache_co_get_block_status,
+
+    .bdrv_getlength         = cache_getlength,
+    .bdrv_truncate          = cache_truncate,
+    .bdrv_has_zero_init     = cache_has_zero_init,
+    .bdrv_probe_blocksizes  = cache_probe_blocksizes,
+
+    .is_filter              = true,
+    .bdrv_recurse_is_first_non_filter = cache_recurse_is_first_non_filter,
+};
+
+static void bdrv_ram_cache_init(void)
+{
+    bdrv_register(&bdrv_ram_cache);
+}
+
+block_init(bdrv_ram_cache_init);
@@ -339,6 +339,34 @@ static bool check_throttle_config(ThrottleConfig *cfg, Error **errp)
 
 typedef enum { MEDIA_DISK, MEDIA_CDROM } DriveMediaType;
 
+/* Parses a colon separated list of interval lengths in seconds and, if @stats
+ * is not NULL, adds them to @stats */
+static bool parse_stats_intervals(BlockAcctStats *stats, const char *str,
+                                  Error **errp)
+{
+    char **intervals = g_strsplit(str, ":", 0);
+    bool ret = true;
+    int i;
+
+    for (i = 0; intervals[i]; i++) {
+        unsigned long long length;
+
+        if (parse_uint_full(intervals[i], &length, 10) < 0 ||
+            length == 0 || length > UINT_MAX) {
+            error_setg(errp, "Invalid interval length: '%s'", intervals[i]);
+            ret = false;
+            break;
+        }
+
+        if (stats) {
+            block_acct_add_interval(stats, length);
+        }
+    }
+
+    g_strfreev(intervals);
+    return ret;
+}
+
 /* Takes the ownership of bs_opts */
 static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
                                    Error **errp)
@@ -350,6 +378,8 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockBackend *blk;
     BlockDriverState *bs;
     ThrottleConfig cfg;
+    const char *throttling_group;
+    const char *stats_intervals;
     int snapshot = 0;
     bool copy_on_read;
     Error *error = NULL;
@@ -401,12 +431,18 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         bdrv_flags |= BDRV_O_NO_FLUSH;
     }
 
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
-        if (!strcmp(buf, "native")) {
-            bdrv_flags |= BDRV_O_NATIVE_AIO;
-        } else if (!strcmp(buf, "threads")) {
+        if (!strcmp(buf, "threads")) {
             /* this is the default */
+#ifdef CONFIG_LINUX_AIO
+        } else if (!strcmp(buf, "native")) {
+            bdrv_flags |= BDRV_O_NATIVE_AIO;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        } else if (!strcmp(buf, "io_uring")) {
+            bdrv_flags |= BDRV_O_IO_URING;
+#endif
         } else {
            error_setg(errp, "invalid aio option");
            goto early_err;
@@ -459,6 +495,8 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
     cfg.op_size = qemu_opt_get_number(opts, "throttling.iops-size", 0);
 
+    throttling_group = qemu_opt_get(opts, "throttling.group");
+
     if (!check_throttle_config(&cfg, &error)) {
         error_propagate(errp, error);
         goto early_err;
@@ -500,6 +538,12 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    stats_intervals = qemu_opt_get(opts, "stats-intervals");
+    if (stats_intervals &&
+        !parse_stats_intervals(NULL, stats_intervals, errp)) {
+        goto early_err;
+    }
+
     /* init */
     if ((!file || !*file) && !has_driver_specific_opts) {
         blk = blk_new_with_bs(qemu_opts_id(opts), errp);
@@ -543,11 +587,19 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
     bs->detect_zeroes = detect_zeroes;
 
+    if (stats_intervals) {
+        parse_stats_intervals(bdrv_get_stats(bs), stats_intervals,
+                              &error_abort);
+    }
+
     bdrv_set_on_error(bs, on_read_error, on_write_error);
 
     /* disk I/O throttling */
     if (throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(bs);
+        if (!throttling_group) {
+            throttling_group = blk_name(blk);
+        }
+        bdrv_io_limits_enable(bs, throttling_group);
         bdrv_set_io_limits(bs, &cfg);
     }
 
@@ -711,6 +763,8 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
 
         { "iops_size",      "throttling.iops-size" },
 
+        { "group",          "throttling.group" },
+
         { "readonly",       "read-only" },
     };
 
@@ -1951,7 +2005,9 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_wr_max,
                                int64_t iops_wr_max,
                                bool has_iops_size,
-                               int64_t iops_size, Error **errp)
+                               int64_t iops_size,
+                               bool has_group,
+                               const char *group, Error **errp)
 {
     ThrottleConfig cfg;
     BlockDriverState *bs;
@@ -2004,25 +2060,119 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
 
-    if (!bs->io_limits_enabled && throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !throttle_enabled(&cfg)) {
+    if (throttle_enabled(&cfg)) {
+        /* Enable I/O limits if they're not enabled yet, otherwise
+         * just update the throttling group. */
+        if (!bs->io_limits_enabled) {
+            bdrv_io_limits_enable(bs, has_group ? group : device);
+        } else if (has_group) {
+            bdrv_io_limits_update_group(bs, group);
+        }
+        /* Set the new throttling configuration */
+        bdrv_set_io_limits(bs, &cfg);
+    } else if (bs->io_limits_enabled) {
+        /* If all throttling settings are set to 0, disable I/O limits */
         bdrv_io_limits_disable(bs);
     }
 
-    if (bs->io_limits_enabled) {
-        bdrv_set_io_limits(bs, &cfg);
+    aio_context_release(aio_context);
+}
+
+/* Power of two latency histogram boundaries from 2^10 ns to 2^34 ns */
+#define LATENCY_LOG2_MIN_BITS   10
+#define LATENCY_LOG2_MAX_BITS   34
+
+static uint64List *latency_log2_boundaries(void)
+{
+    uint64List *head = NULL;
+    int i;
+
+    for (i = LATENCY_LOG2_MAX_BITS; i >= LATENCY_LOG2_MIN_BITS; i--) {
+        uint64List *entry = g_new0(uint64List, 1);
+        entry->value = 1ULL << i;
+        entry->next = head;
+        head = entry;
+    }
+
+    return head;
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     bool has_log2, bool log2,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    BlockDriverState *bs;
+    AioContext *aio_context;
+    uint64List *log2_boundaries = NULL;
+    uint64List *type_boundaries[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ]   = has_boundaries_read ? boundaries_read : NULL,
+        [BLOCK_ACCT_WRITE]  = has_boundaries_write ? boundaries_write : NULL,
+        [BLOCK_ACCT_FLUSH]  = has_boundaries_flush ? boundaries_flush : NULL,
+    };
+    int i;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+    bs = blk_bs(blk);
+
+    if (has_log2 && log2) {
+        log2_boundaries = latency_log2_boundaries();
+    }
+
+    /* Check all lists before changing anything */
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        uint64List *entry;
+        uint64_t prev = 0;
+
+        if (!type_boundaries[i]) {
+            type_boundaries[i] = has_boundaries ? boundaries : log2_boundaries;
+        }
+
+        for (entry = type_boundaries[i]; entry; entry = entry->next) {
+            if (entry->value <= prev) {
+                error_setg(errp, "Histogram boundaries must be greater than "
+                           "zero and strictly ascending");
+                goto out;
+            }
+            prev = entry->value;
+        }
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        int ret = block_latency_histogram_set(bdrv_get_stats(bs), i,
+                                              type_boundaries[i]);
+        assert(ret == 0);
     }
 
     aio_context_release(aio_context);
+
+out:
+    qapi_free_uint64List(log2_boundaries);
 }
 
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2048,7 +2198,15 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (has_persistent && persistent &&
+        !bdrv_can_store_persistent_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap && has_persistent) {
+        bdrv_dirty_bitmap_set_persistent(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -2631,6 +2789,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_buf_size, int64_t buf_size,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockBackend *blk;
@@ -2659,6 +2818,9 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_granularity) {
         granularity = 0;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
     if (!has_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
@@ -2799,7 +2961,7 @@ void qmp_drive_mirror(const char *device, const char *target,
      */
     mirror_start(bs, target_bs,
                  has_replaces ? replaces : NULL,
-                 speed, granularity, buf_size, sync,
+                 speed, granularity, buf_size, sync, copy_mode,
                  on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
@@ -3188,6 +3350,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.iops-size",
             .type = QEMU_OPT_NUMBER,
             .help = "when limiting by iops max size of an I/O in bytes",
+        },{
+            .name = "throttling.group",
+            .type = QEMU_OPT_STRING,
+            .help = "name of the block throttling group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -3196,6 +3362,11 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "detect-zeroes",
             .type = QEMU_OPT_STRING,
             .help = "try to optimize zero writes (off, on, unmap)",
+        },{
+            .name = "stats-intervals",
+            .type = QEMU_OPT_STRING,
+            .help = "colon-separated list of intervals "
+                    "for collecting I/O statistics, in seconds",
         },
         { /* end of list */ }
     },
@@ -39,6 +39,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/rcu.h"
 #include "qapi-event.h"
 #include "hw/nmi.h"
 
@@ -541,6 +542,31 @@ void configure_icount(QemuOpts *opts, Error **errp)
                    get_ticks_per_sec() / 10);
 }
 
+/***********************************************************/
+/* TCG vCPU threading */
+
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = opts ? qemu_opt_get(opts, "thread") : NULL;
+
+    if (!t || strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+    } else if (strcmp(t, "multi") == 0) {
+#ifndef TARGET_SUPPORTS_MTTCG
+        error_setg(errp, "multi-threaded TCG is not supported for this "
+                   "target");
+#else
+        if (use_icount) {
+            error_setg(errp, "No MTTCG when icount is enabled");
+        } else {
+            mttcg_enabled = true;
+        }
+#endif
+    } else {
+        error_setg(errp, "Invalid 'thread' setting %s", t);
+    }
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -785,6 +811,23 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/* true if the current thread holds qemu_global_mutex */
+static __thread bool iothread_locked;
+
+/* Exclusive sections for multi-threaded TCG: a vCPU thread that needs to
+ * modify state used by translated code (tb_flush, or the TLB of another
+ * vCPU) waits until every other vCPU thread is out of cpu_exec.  This
+ * mirrors the start_exclusive/end_exclusive machinery of linux-user.
+ */
+static QemuMutex exclusive_lock;
+static QemuCond exclusive_cond;
+static QemuCond exclusive_resume;
+static int pending_cpus;
+static int parked_cpus;
+static __thread bool in_exclusive_section;
+static bool tb_flush_requested;
+static bool tlb_flush_requested;
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -799,6 +842,9 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init(&exclusive_lock);
+    qemu_cond_init(&exclusive_cond);
+    qemu_cond_init(&exclusive_resume);
 
     qemu_thread_get_self(&io_thread);
 }
@@ -909,6 +955,174 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+static void qemu_tcg_mt_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
+/* Wait for pending exclusive operations to complete.  The exclusive lock
+   must be held.  */
+static inline void exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&exclusive_resume, &exclusive_lock);
+    }
+}
+
+/* Start an exclusive operation.  Must only be called from outside
+   cpu_exec, without holding the iothread mutex.  */
+static void start_exclusive(void)
+{
+    CPUState *other_cpu;
+
+    qemu_mutex_lock(&exclusive_lock);
+    exclusive_idle();
+
+    pending_cpus = 1;
+    /* Make all other cpus stop executing.  */
+    CPU_FOREACH(other_cpu) {
+        if (other_cpu->running) {
+            pending_cpus++;
+            cpu_exit(other_cpu);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_cond_wait(&exclusive_cond, &exclusive_lock);
+    }
+    in_exclusive_section = true;
+}
+
+/* Finish an exclusive operation.  */
+static void end_exclusive(void)
+{
+    in_exclusive_section = false;
+    pending_cpus = 0;
+    qemu_cond_broadcast(&exclusive_resume);
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+/* Wait for exclusive ops to finish, and begin cpu execution.  */
+static void cpu_exec_start(CPUState *cpu)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    exclusive_idle();
+    cpu->running = true;
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+/* Mark cpu as not executing, and release pending exclusive ops.  */
+static void cpu_exec_end(CPUState *cpu)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    cpu->running = false;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&exclusive_cond);
+        }
+    }
+    exclusive_idle();
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+bool qemu_tcg_in_exclusive_section(void)
+{
+    return in_exclusive_section;
+}
+
+/* Let exclusive sections run while a vCPU thread waits in the middle of
+ * cpu_exec, e.g. in pause_all_vcpus.  The thread will return to its TB,
+ * so the translation buffer must not be flushed meanwhile.
+ */
+static void cpu_exec_park(CPUState *cpu)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    parked_cpus++;
+    qemu_mutex_unlock(&exclusive_lock);
+    cpu_exec_end(cpu);
+}
+
+static void cpu_exec_unpark(CPUState *cpu)
+{
+    cpu_exec_start(cpu);
+    qemu_mutex_lock(&exclusive_lock);
+    parked_cpus--;
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+void qemu_tcg_request_tb_flush(void)
+{
+    CPUState *cpu;
+
+    atomic_set(&tb_flush_requested, true);
+    CPU_FOREACH(cpu) {
+        cpu_exit(cpu);
+    }
+}
+
+bool qemu_tcg_request_tlb_flush(CPUState *cpu, bool all, vaddr addr)
+{
+    CPUState *self = current_cpu;
+
+    if (!self || !self->running || in_exclusive_section) {
+        return false;
+    }
+
+    qemu_mutex_lock(&exclusive_lock);
+    if (all || cpu->tlb_flush_nb_pages == CPU_TLB_FLUSH_MAX_PAGES) {
+        cpu->tlb_flush_all = true;
+    } else {
+        cpu->tlb_flush_pages[cpu->tlb_flush_nb_pages++] = addr;
+    }
+    atomic_set(&tlb_flush_requested, true);
+    qemu_mutex_unlock(&exclusive_lock);
+
+    /* Leave cpu_exec after this TB; qemu_tcg_handle_exclusive_work runs
+       before the next one.  */
+    cpu_exit(self);
+    return true;
+}
+
+static void qemu_tcg_do_tlb_flushes(void)
+{
+    CPUState *cpu;
+    int i;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->tlb_flush_all) {
+            tlb_flush(cpu, 1);
+        } else {
+            for (i = 0; i < cpu->tlb_flush_nb_pages; i++) {
+                tlb_flush_page(cpu, cpu->tlb_flush_pages[i]);
+            }
+        }
+        cpu->tlb_flush_all = false;
+        cpu->tlb_flush_nb_pages = 0;
+    }
+}
+
+static void qemu_tcg_handle_exclusive_work(CPUState *cpu)
+{
+    if (!atomic_read(&tb_flush_requested) &&
+        !atomic_read(&tlb_flush_requested)) {
+        return;
+    }
+    start_exclusive();
+    if (tb_flush_requested && !parked_cpus) {
+        tb_flush_requested = false;
+        tb_flush(cpu->env_ptr);
+    }
+    if (tlb_flush_requested) {
+        tlb_flush_requested = false;
+        qemu_tcg_do_tlb_flushes();
+    }
+    end_exclusive();
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
@@ -925,6 +1139,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     int r;
 
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     cpu->can_do_io = 1;
@@ -999,15 +1214,19 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 }
 
 static void tcg_exec_all(void);
+static int tcg_cpu_exec(CPUArchState *env);
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
 
+    rcu_register_thread();
+
     qemu_tcg_init_cpu_signals();
     qemu_thread_get_self(cpu->thread);
 
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
     CPU_FOREACH(cpu) {
         cpu->thread_id = qemu_get_thread_id();
         cpu->created = true;
@@ -1044,6 +1263,46 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* Multi-threaded TCG: one host thread per vCPU.  Guest code runs without
+ * the iothread mutex; it is taken by the memory API for MMIO and around
+ * interrupt delivery.
+ */
+static void *qemu_tcg_mt_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->can_do_io = 1;
+    current_cpu = cpu;
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            qemu_mutex_unlock_iothread();
+            qemu_tcg_handle_exclusive_work(cpu);
+            cpu_exec_start(cpu);
+            r = tcg_cpu_exec(cpu->env_ptr);
+            cpu_exec_end(cpu);
+            qemu_tcg_handle_exclusive_work(cpu);
+            qemu_mutex_lock_iothread();
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_tcg_mt_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1086,7 +1345,10 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (tcg_enabled() && qemu_tcg_mttcg_enabled()) {
+        /* the vCPU thread polls exit_request between TBs */
+        cpu_exit(cpu);
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -1116,10 +1378,19 @@ bool qemu_in_vcpu_thread(void)
     return current_cpu && qemu_cpu_is_self(current_cpu);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
 void qemu_mutex_lock_iothread(void)
 {
     atomic_inc(&iothread_requesting_mutex);
-    if (!tcg_enabled() || !first_cpu || !first_cpu->thread) {
+    /* In the multi-threaded TCG case the vCPU threads do not hold the
+     * mutex while running guest code, so there is nobody to kick.
+     */
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() ||
+        !first_cpu || !first_cpu->thread) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
     } else {
@@ -1130,10 +1401,12 @@ void qemu_mutex_lock_iothread(void)
         atomic_dec(&iothread_requesting_mutex);
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    iothread_locked = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    iothread_locked = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
@@ -1153,6 +1426,7 @@ static int all_vcpus_paused(void)
 void pause_all_vcpus(void)
 {
     CPUState *cpu;
+    CPUState *self = NULL;
 
     qemu_clock_enable(QEMU_CLOCK_VIRTUAL, false);
     CPU_FOREACH(cpu) {
@@ -1162,7 +1436,14 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (qemu_tcg_mttcg_enabled()) {
+            /* The other vCPU threads may need an exclusive section before
+               they can stop, so do not block it while waiting for them.  */
+            if (current_cpu->running) {
+                self = current_cpu;
+                cpu_exec_park(self);
+            }
+        } else if (!kvm_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1177,6 +1458,10 @@ void pause_all_vcpus(void)
             qemu_cpu_kick(cpu);
         }
     }
+
+    if (self) {
+        cpu_exec_unpark(self);
+    }
 }
 
 void cpu_resume(CPUState *cpu)
@@ -1205,6 +1490,24 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
 
     tcg_cpu_address_space_init(cpu, cpu->as);
 
+    if (qemu_tcg_mttcg_enabled()) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+                 cpu->cpu_index);
+        qemu_thread_create(cpu->thread, thread_name,
+                           qemu_tcg_mt_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
+#ifdef _WIN32
+        cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
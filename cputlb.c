@@ -29,6 +29,7 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
+#include "qemu/main-loop.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
@@ -36,6 +37,50 @@
 /* statistics */
 int tlb_flush_count;
 
+/* With multi-threaded TCG a vCPU's TLB may only be modified by its own
+ * thread, or while it is stopped in an exclusive section.  Flushes that
+ * translated code requests for other vCPUs, e.g. broadcast TLB
+ * invalidations, are done in an exclusive section before the requesting
+ * vCPU goes on, so they are synchronous.  Flushes requested from outside
+ * translated code are queued as work items for the target vCPU and are
+ * asynchronous.
+ */
+static bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created &&
+           !qemu_cpu_is_self(cpu) && !qemu_tcg_in_exclusive_section();
+}
+
+static void tlb_queue_flush_work(CPUState *cpu, void (*func)(void *data),
+                                 void *data)
+{
+    if (qemu_mutex_iothread_locked()) {
+        async_run_on_cpu(cpu, func, data);
+    } else {
+        qemu_mutex_lock_iothread();
+        async_run_on_cpu(cpu, func, data);
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+struct TLBFlushPageWork {
+    CPUState *cpu;
+    target_ulong addr;
+};
+
+static void tlb_flush_work(void *data)
+{
+    tlb_flush(data, 1);
+}
+
+static void tlb_flush_page_work(void *data)
+{
+    struct TLBFlushPageWork *work = data;
+
+    tlb_flush_page(work->cpu, work->addr);
+    g_free(work);
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -52,6 +97,13 @@ void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
 
+    if (tlb_flush_is_remote(cpu)) {
+        if (!qemu_tcg_request_tlb_flush(cpu, true, 0)) {
+            tlb_queue_flush_work(cpu, tlb_flush_work, cpu);
+        }
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
@@ -87,6 +139,19 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     int i;
     int mmu_idx;
 
+    if (tlb_flush_is_remote(cpu)) {
+        struct TLBFlushPageWork *work;
+
+        if (qemu_tcg_request_tlb_flush(cpu, false, addr)) {
+            return;
+        }
+        work = g_new(struct TLBFlushPageWork, 1);
+        work->cpu = cpu;
+        work->addr = addr;
+        tlb_queue_flush_work(cpu, tlb_flush_page_work, work);
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
@@ -150,7 +215,10 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write |= TLB_NOTDIRTY;
+            /* may race with the owning vCPU thread under MTTCG; the
+               store must not tear */
+            atomic_set(&tlb_entry->addr_write,
+                       tlb_entry->addr_write | TLB_NOTDIRTY);
         }
     }
 }
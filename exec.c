@@ -1765,24 +1765,14 @@ static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
  * pointer, such as a reference to the region that includes the incoming
  * ram_addr_t.
  */
-MemoryRegion *qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
+/* Called within an RCU critical section.  */
+static RAMBlock *qemu_ram_block_from_host(uint8_t *host)
 {
     RAMBlock *block;
-    uint8_t *host = ptr;
-    MemoryRegion *mr;
-
-    if (xen_enabled()) {
-        rcu_read_lock();
-        *ram_addr = xen_ram_addr_from_mapcache(ptr);
-        mr = qemu_get_ram_block(*ram_addr)->mr;
-        rcu_read_unlock();
-        return mr;
-    }
 
-    rcu_read_lock();
     block = atomic_rcu_read(&ram_list.mru_block);
     if (block && block->host && host - block->host < block->max_length) {
-        goto found;
+        return block;
     }
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
@@ -1791,20 +1781,59 @@ MemoryRegion *qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
             continue;
         }
         if (host - block->host < block->max_length) {
-            goto found;
+            return block;
         }
     }
 
-    rcu_read_unlock();
     return NULL;
+}
+
+MemoryRegion *qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
+{
+    RAMBlock *block;
+    uint8_t *host = ptr;
+    MemoryRegion *mr;
+
+    if (xen_enabled()) {
+        rcu_read_lock();
+        *ram_addr = xen_ram_addr_from_mapcache(ptr);
+        mr = qemu_get_ram_block(*ram_addr)->mr;
+        rcu_read_unlock();
+        return mr;
+    }
+
+    rcu_read_lock();
+    block = qemu_ram_block_from_host(host);
+    if (!block) {
+        rcu_read_unlock();
+        return NULL;
+    }
 
-found:
     *ram_addr = block->offset + (host - block->host);
     mr = block->mr;
     rcu_read_unlock();
     return mr;
 }
 
+/* Like qemu_ram_addr_from_host, but returns the RAMBlock's name and the
+ * offset of @ptr within that block, which is what the migration stream
+ * uses to identify a page.  Must be called within an RCU critical section;
+ * the returned string is only valid until the end of it.
+ */
+const char *qemu_ram_get_idstr_from_host(void *ptr, ram_addr_t *offset)
+{
+    RAMBlock *block;
+    uint8_t *host = ptr;
+
+    block = qemu_ram_block_from_host(host);
+    if (!block) {
+        return NULL;
+    }
+
+    *offset = host - block->host;
+    return block->idstr;
+}
+
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
@@ -0,0 +1,291 @@
+/*
+ * Virtio network device dataplane
+ *
+ * Process the receive and transmit virtqueues of a virtio-net device in an
+ * IOThread, with the backend file descriptors polled from the same
+ * AioContext.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "hw/virtio/virtio-net.h"
+#include "hw/virtio/virtio-bus.h"
+#include "net/net.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+/* Context: QEMU global mutex held */
+void virtio_net_set_iothread(VirtIONet *n, IOThread *iothread, Error **errp)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+    /* Don't try if transport does not support notifiers. */
+    if (!k->set_guest_notifiers || !k->set_host_notifier) {
+        error_setg(errp, "transport does not support notifiers, "
+                   "cannot use iothread");
+        return;
+    }
+
+    assert(!n->ctx);
+    n->ctx = iothread_get_aio_context(iothread);
+}
+
+static void virtio_net_iothread_handle_rx(EventNotifier *notifier)
+{
+    VirtIONetVring *vring = container_of(notifier, VirtIONetVring,
+                                         host_notifier);
+    VirtIONetQueue *q = vring->q;
+    VirtIONet *n = q->n;
+
+    event_notifier_test_and_clear(notifier);
+    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, q - n->vqs));
+}
+
+static void virtio_net_iothread_handle_tx(EventNotifier *notifier)
+{
+    VirtIONetVring *vring = container_of(notifier, VirtIONetVring,
+                                         host_notifier);
+    VirtIONetQueue *q = vring->q;
+
+    event_notifier_test_and_clear(notifier);
+    if (unlikely(q->tx_waiting)) {
+        return;
+    }
+    q->tx_waiting = 1;
+    vring_disable_notification(VIRTIO_DEVICE(q->n), &vring->vring);
+    qemu_bh_schedule(q->dp_tx_bh);
+}
+
+static VirtIONetVring *virtio_net_vring_init(VirtIONetQueue *q,
+                                             VirtQueue *vq,
+                                             EventNotifierHandler *handler,
+                                             int n)
+{
+    VirtIONet *s = q->n;
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONetVring *r;
+    int rc;
+
+    /* Set up virtqueue notify */
+    rc = k->set_host_notifier(qbus->parent, n, true);
+    if (rc != 0) {
+        error_report("virtio-net: Failed to set host notifier (%d)", rc);
+        return NULL;
+    }
+
+    r = g_new0(VirtIONetVring, 1);
+    r->host_notifier = *virtio_queue_get_host_notifier(vq);
+    r->guest_notifier = *virtio_queue_get_guest_notifier(vq);
+    r->q = q;
+
+    if (!vring_setup(&r->vring, VIRTIO_DEVICE(s), n)) {
+        error_report("virtio-net: VRing setup failed");
+        k->set_host_notifier(qbus->parent, n, false);
+        g_free(r);
+        return NULL;
+    }
+
+    aio_set_event_notifier(s->ctx, &r->host_notifier, handler);
+    return r;
+}
+
+/* assumes n->ctx held */
+static void virtio_net_clear_aio(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_vring) {
+            aio_set_event_notifier(n->ctx, &q->rx_vring->host_notifier, NULL);
+        }
+        if (q->tx_vring) {
+            aio_set_event_notifier(n->ctx, &q->tx_vring->host_notifier, NULL);
+        }
+        if (q->dp_tx_bh) {
+            qemu_bh_delete(q->dp_tx_bh);
+            q->dp_tx_bh = NULL;
+        }
+    }
+}
+
+static void virtio_net_vring_teardown(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_vring) {
+            vring_teardown(&q->rx_vring->vring, vdev, i * 2);
+            k->set_host_notifier(qbus->parent, i * 2, false);
+            g_free(q->rx_vring);
+            q->rx_vring = NULL;
+        }
+        if (q->tx_vring) {
+            vring_teardown(&q->tx_vring->vring, vdev, i * 2 + 1);
+            k->set_host_notifier(qbus->parent, i * 2 + 1, false);
+            g_free(q->tx_vring);
+            q->tx_vring = NULL;
+        }
+    }
+}
+
+/* Complete or drop transmits that the backend has queued, so that no
+ * element popped through one of virtqueue or vring is completed through
+ * the other.
+ */
+static void virtio_net_purge_tx(VirtIONet *n, int queues)
+{
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+    }
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_dataplane_start(VirtIONet *n, int queues)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+    int rc;
+
+    if (n->dataplane_started ||
+        n->dataplane_starting ||
+        n->dataplane_fenced) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (!qemu_net_has_aio_context(peer)) {
+            error_report("virtio-net: netdev %s cannot be used from an "
+                         "iothread, falling back to the main loop",
+                         peer ? peer->name : "(none)");
+            n->dataplane_fenced = true;
+            return;
+        }
+    }
+
+    n->dataplane_starting = true;
+    trace_virtio_net_dataplane_start(n, queues);
+
+    virtio_net_purge_tx(n, queues);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->tx_timer) {
+            timer_del(q->tx_timer);
+        } else {
+            qemu_bh_cancel(q->tx_bh);
+        }
+    }
+
+    /* Set up guest notifier (irq) */
+    rc = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (rc != 0) {
+        error_report("virtio-net: Failed to set guest notifiers (%d), "
+                     "ensure -enable-kvm is set", rc);
+        n->dataplane_fenced = true;
+        goto fail_guest_notifiers;
+    }
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->rx_vring = virtio_net_vring_init(q, q->rx_vq,
+                                            virtio_net_iothread_handle_rx,
+                                            i * 2);
+        if (!q->rx_vring) {
+            n->dataplane_fenced = true;
+            goto fail_vrings;
+        }
+        q->tx_vring = virtio_net_vring_init(q, q->tx_vq,
+                                            virtio_net_iothread_handle_tx,
+                                            i * 2 + 1);
+        if (!q->tx_vring) {
+            n->dataplane_fenced = true;
+            goto fail_vrings;
+        }
+        q->dp_tx_bh = aio_bh_new(n->ctx, virtio_net_tx_bh, q);
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        qemu_net_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, n->ctx);
+
+        /* Pick up work that the main loop left behind */
+        if (q->tx_waiting) {
+            qemu_bh_schedule(q->dp_tx_bh);
+        }
+        event_notifier_set(&q->rx_vring->host_notifier);
+    }
+
+    n->dataplane_queues = queues;
+    n->dataplane_starting = false;
+    n->dataplane_started = true;
+    aio_context_release(n->ctx);
+    return;
+
+fail_vrings:
+    virtio_net_clear_aio(n);
+    aio_context_release(n->ctx);
+    virtio_net_vring_teardown(n);
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+fail_guest_notifiers:
+    n->dataplane_starting = false;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    /* Better luck next time. */
+    if (n->dataplane_fenced) {
+        n->dataplane_fenced = false;
+        return;
+    }
+    if (!n->dataplane_started || n->dataplane_stopping) {
+        return;
+    }
+    n->dataplane_stopping = true;
+    trace_virtio_net_dataplane_stop(n);
+
+    aio_context_acquire(n->ctx);
+
+    virtio_net_clear_aio(n);
+    virtio_net_purge_tx(n, n->dataplane_queues);
+    for (i = 0; i < n->dataplane_queues; i++) {
+        qemu_net_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, NULL);
+    }
+
+    aio_context_release(n->ctx);
+
+    /* Sync vring state back to virtqueue so that non-dataplane processing
+     * can continue when we disable the host notifiers.
+     */
+    virtio_net_vring_teardown(n);
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, n->dataplane_queues * 2, false);
+    n->dataplane_queues = 0;
+    n->dataplane_stopping = false;
+    n->dataplane_started = false;
+}
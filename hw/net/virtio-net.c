@@ -24,6 +24,8 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "hw/virtio/dataplane/vring-accessors.h"
+#include "migration/migration.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -68,6 +70,71 @@ static int vq2q(int queue_index)
  * - we could suppress RX interrupt if we were so inclined.
  */
 
+/* Queue accessors that go through the dataplane vring when one is active */
+
+static bool virtio_net_vq_pop(VirtIONet *n, VirtQueue *vq, VirtIONetVring *r,
+                              VirtQueueElement *elem)
+{
+    if (r) {
+        return vring_pop(VIRTIO_DEVICE(n), &r->vring, elem) >= 0;
+    }
+    return virtqueue_pop(vq, elem);
+}
+
+static void virtio_net_vq_fill(VirtIONet *n, VirtQueue *vq, VirtIONetVring *r,
+                               VirtQueueElement *elem, unsigned int len,
+                               unsigned int idx)
+{
+    if (r) {
+        vring_fill(VIRTIO_DEVICE(n), &r->vring, elem, len, idx);
+    } else {
+        virtqueue_fill(vq, elem, len, idx);
+    }
+}
+
+static void virtio_net_vq_flush(VirtIONet *n, VirtQueue *vq, VirtIONetVring *r,
+                                unsigned int count)
+{
+    if (r) {
+        vring_flush(VIRTIO_DEVICE(n), &r->vring, count);
+    } else {
+        virtqueue_flush(vq, count);
+    }
+}
+
+static void virtio_net_vq_push(VirtIONet *n, VirtQueue *vq, VirtIONetVring *r,
+                               VirtQueueElement *elem, unsigned int len)
+{
+    virtio_net_vq_fill(n, vq, r, elem, len, 0);
+    virtio_net_vq_flush(n, vq, r, 1);
+}
+
+static void virtio_net_vq_notify(VirtIONet *n, VirtQueue *vq,
+                                 VirtIONetVring *r)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (!r) {
+        virtio_notify(vdev, vq);
+    } else if (vring_should_notify(vdev, &r->vring)) {
+        event_notifier_set(&r->guest_notifier);
+    }
+}
+
+static void virtio_net_vq_set_notification(VirtIONet *n, VirtQueue *vq,
+                                           VirtIONetVring *r, int enable)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (!r) {
+        virtio_queue_set_notification(vq, enable);
+    } else if (enable) {
+        vring_enable_notification(vdev, &r->vring);
+    } else {
+        vring_disable_notification(vdev, &r->vring);
+    }
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -155,6 +222,26 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    int queues = n->multiqueue ? n->curr_queues : 1;
+
+    if (!n->ctx) {
+        return;
+    }
+
+    if (n->dataplane_started && n->dataplane_queues != queues) {
+        virtio_net_dataplane_stop(n);
+    }
+
+    if (virtio_net_started(n, status) && !n->vhost_started &&
+        !n->dataplane_disabled) {
+        virtio_net_dataplane_start(n, queues);
+    } else {
+        virtio_net_dataplane_stop(n);
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -163,6 +250,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
@@ -173,7 +261,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             queue_status = status;
         }
 
-        if (!q->tx_waiting) {
+        if (!q->tx_waiting || q->tx_vring) {
             continue;
         }
 
@@ -800,6 +888,14 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
+    AioContext *ctx = n->dataplane_started ? n->ctx : NULL;
+
+    /* The control queue stays in the main loop, but the state it changes
+     * is used by the iothread.
+     */
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
 
     while (virtqueue_pop(vq, &elem)) {
         if (iov_size(elem.in_sg, elem.in_num) < sizeof(status) ||
@@ -835,6 +931,10 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         virtio_notify(vdev, vq);
         g_free(iov2);
     }
+
+    if (ctx) {
+        aio_context_release(ctx);
+    }
 }
 
 /* RX */
@@ -872,6 +972,22 @@ static int virtio_net_can_receive(NetClientState *nc)
 static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
     VirtIONet *n = q->n;
+
+    if (q->rx_vring) {
+        VirtIODevice *vdev = VIRTIO_DEVICE(n);
+        Vring *vring = &q->rx_vring->vring;
+
+        /* There is no avail_bytes for vrings; virtio_net_receive() puts
+         * the buffers back if a mergeable packet does not fit.
+         */
+        if (!vring_more_avail(vdev, vring) &&
+            vring_enable_notification(vdev, vring)) {
+            return 0;
+        }
+        vring_disable_notification(vdev, vring);
+        return 1;
+    }
+
     if (virtio_queue_empty(q->rx_vq) ||
         (n->mergeable_rx_bufs &&
          !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
@@ -1028,9 +1144,17 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
         total = 0;
 
-        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+        if (!virtio_net_vq_pop(n, q->rx_vq, q->rx_vring, &elem)) {
             if (i == 0)
                 return -1;
+            if (q->rx_vring) {
+                /* Wait for the guest to add more buffers */
+                vring_unpop(vdev, &q->rx_vring->vring, i);
+                if (!vring_enable_notification(vdev, &q->rx_vring->vring)) {
+                    event_notifier_set(&q->rx_vring->host_notifier);
+                }
+                return 0;
+            }
             error_report("virtio-net unexpected empty queue: "
                          "i %zd mergeable %d offset %zd, size %zd, "
                          "guest hdr len %zd, host hdr len %zd "
@@ -1083,7 +1207,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtio_net_vq_fill(n, q->rx_vq, q->rx_vring, &elem, total, i++);
     }
 
     if (mhdr_cnt) {
@@ -1093,8 +1217,8 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    virtio_net_vq_flush(n, q->rx_vq, q->rx_vring, i);
+    virtio_net_vq_notify(n, q->rx_vq, q->rx_vring);
 
     return size;
 }
@@ -1105,14 +1229,19 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_vq_push(n, q->tx_vq, q->tx_vring, &q->async_tx.elem, 0);
+    virtio_net_vq_notify(n, q->tx_vq, q->tx_vring);
 
     q->async_tx.elem.out_num = q->async_tx.len = 0;
 
-    virtio_queue_set_notification(q->tx_vq, 1);
+    if (n->dataplane_starting || n->dataplane_stopping) {
+        /* Dataplane is switching over, let whoever takes over flush */
+        q->tx_waiting = 1;
+        return;
+    }
+
+    virtio_net_vq_set_notification(n, q->tx_vq, q->tx_vring, 1);
     virtio_net_flush_tx(q);
 }
 
@@ -1129,11 +1258,11 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     }
 
     if (q->async_tx.elem.out_num) {
-        virtio_queue_set_notification(q->tx_vq, 0);
+        virtio_net_vq_set_notification(n, q->tx_vq, q->tx_vring, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
+    while (virtio_net_vq_pop(n, q->tx_vq, q->tx_vring, &elem)) {
         ssize_t ret, len;
         unsigned int out_num = elem.out_num;
         struct iovec *out_sg = &elem.out_sg[0];
@@ -1174,7 +1303,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
                                       out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
+            virtio_net_vq_set_notification(n, q->tx_vq, q->tx_vring, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
             return -EBUSY;
@@ -1182,8 +1311,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         len += ret;
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtio_net_vq_push(n, q->tx_vq, q->tx_vring, &elem, 0);
+        virtio_net_vq_notify(n, q->tx_vq, q->tx_vring);
 
         if (++num_packets >= n->tx_burst) {
             break;
@@ -1256,7 +1385,12 @@ static void virtio_net_tx_timer(void *opaque)
     virtio_net_flush_tx(q);
 }
 
-static void virtio_net_tx_bh(void *opaque)
+static void virtio_net_tx_schedule(VirtIONetQueue *q)
+{
+    qemu_bh_schedule(q->tx_vring ? q->dp_tx_bh : q->tx_bh);
+}
+
+void virtio_net_tx_bh(void *opaque)
 {
     VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
@@ -1285,7 +1419,7 @@ static void virtio_net_tx_bh(void *opaque)
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
     if (ret >= n->tx_burst) {
-        qemu_bh_schedule(q->tx_bh);
+        virtio_net_tx_schedule(q);
         q->tx_waiting = 1;
         return;
     }
@@ -1293,10 +1427,10 @@ static void virtio_net_tx_bh(void *opaque)
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
-    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_vq_set_notification(n, q->tx_vq, q->tx_vring, 1);
     if (virtio_net_flush_tx(q) > 0) {
-        virtio_queue_set_notification(q->tx_vq, 0);
-        qemu_bh_schedule(q->tx_bh);
+        virtio_net_vq_set_notification(n, q->tx_vq, q->tx_vring, 0);
+        virtio_net_tx_schedule(q);
         q->tx_waiting = 1;
     }
 }
@@ -1546,6 +1680,25 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+/* Disable dataplane during live migration since vrings do not update the
+ * dirty memory bitmap.
+ */
+static void virtio_net_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIONet *n = container_of(notifier, VirtIONet, migration_state_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    MigrationState *mig = data;
+
+    if (migration_in_setup(mig)) {
+        n->dataplane_disabled = true;
+        virtio_net_set_status(vdev, vdev->status);
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        n->dataplane_disabled = false;
+        virtio_net_set_status(vdev, vdev->status);
+    }
+}
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -1553,6 +1706,16 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     NetClientState *nc;
     int i;
 
+    if (n->net_conf.iothread) {
+        Error *err = NULL;
+
+        virtio_net_set_iothread(n, n->net_conf.iothread, &err);
+        if (err) {
+            error_propagate(errp, err);
+            return;
+        }
+    }
+
     virtio_net_set_config_size(n, n->host_features);
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
@@ -1636,6 +1799,11 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     nc = qemu_get_queue(n->nic);
     nc->rxfilter_notify_enabled = 1;
 
+    if (n->ctx) {
+        n->migration_state_notifier.notify = virtio_net_migration_state_changed;
+        add_migration_state_change_notifier(&n->migration_state_notifier);
+    }
+
     n->qdev = dev;
     register_savevm(dev, "virtio-net", -1, VIRTIO_NET_VM_VERSION,
                     virtio_net_save, virtio_net_load, n);
@@ -1647,9 +1815,13 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     VirtIONet *n = VIRTIO_NET(dev);
     int i;
 
-    /* This will stop vhost backend if appropriate. */
+    /* This will stop vhost backend or dataplane if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+    if (n->ctx) {
+        remove_migration_state_change_notifier(&n->migration_state_notifier);
+    }
+
     unregister_savevm(dev, "virtio-net", n);
 
     g_free(n->netclient_name);
@@ -1693,6 +1865,10 @@ static void virtio_net_instance_init(Object *obj)
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, &error_abort);
 }
 
 static Property virtio_net_properties[] = {
@@ -416,15 +416,23 @@ out:
     return ret;
 }
 
-/* After we've used one of their buffers, we tell them about it.
- *
- * Stolen from linux/drivers/vhost/vhost.c.
+/* Put back the last @num elements returned by vring_pop() so that they are
+ * returned again.  The elements must already have been released with
+ * vring_fill() and not yet flushed.
  */
-void vring_push(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem,
-                int len)
+void vring_unpop(VirtIODevice *vdev, Vring *vring, unsigned int num)
+{
+    vring->last_avail_idx -= num;
+}
+
+/* Record a used buffer at offset @idx past the current used index without
+ * making it visible to the guest.  Call vring_flush() to publish a batch of
+ * buffers at once.
+ */
+void vring_fill(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem,
+                int len, unsigned int idx)
 {
     unsigned int head = elem->index;
-    uint16_t new;
 
     vring_unmap_element(elem);
 
@@ -433,19 +441,43 @@ void vring_push(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem,
         return;
     }
 
+    idx = (vring->last_used_idx + idx) % vring->vr.num;
+
     /* The virtqueue contains a ring of used buffers.  Get a pointer to the
      * next entry in that used ring. */
-    vring_set_used_ring_id(vdev, vring, vring->last_used_idx % vring->vr.num,
-                           head);
-    vring_set_used_ring_len(vdev, vring, vring->last_used_idx % vring->vr.num,
-                            len);
+    vring_set_used_ring_id(vdev, vring, idx, head);
+    vring_set_used_ring_len(vdev, vring, idx, len);
+}
+
+/* Publish @count buffers previously recorded with vring_fill() */
+void vring_flush(VirtIODevice *vdev, Vring *vring, unsigned int count)
+{
+    uint16_t old, new;
+
+    /* Don't touch vring if a fatal error occurred */
+    if (vring->broken) {
+        return;
+    }
 
     /* Make sure buffer is written before we update index. */
     smp_wmb();
 
-    new = ++vring->last_used_idx;
+    old = vring->last_used_idx;
+    new = vring->last_used_idx = old + count;
     vring_set_used_idx(vdev, vring, new);
-    if (unlikely((int16_t)(new - vring->signalled_used) < (uint16_t)1)) {
+    if (unlikely((int16_t)(new - vring->signalled_used) <
+                 (uint16_t)(new - old))) {
         vring->signalled_used_valid = false;
     }
 }
+
+/* After we've used one of their buffers, we tell them about it.
+ *
+ * Stolen from linux/drivers/vhost/vhost.c.
+ */
+void vring_push(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem,
+                int len)
+{
+    vring_fill(vdev, vring, elem, len, 0);
+    vring_flush(vdev, vring, 1);
+}
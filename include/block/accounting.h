@@ -24,9 +24,13 @@
 #ifndef BLOCK_ACCOUNTING_H
 #define BLOCK_ACCOUNTING_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "qemu/typedefs.h"
+#include "qemu/queue.h"
+#include "qemu/timed-average.h"
+#include "qapi-types.h"
 
 enum BlockAcctType {
     BLOCK_ACCT_READ,
@@ -35,12 +39,38 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+/*
+ * Request sizes are counted in power of two buckets: bucket 0 counts requests
+ * of up to 512 bytes, bucket i requests of more than 256 << i and up to
+ * 512 << i bytes, and the last bucket everything that is larger.
+ */
+#define BLOCK_ACCT_SIZE_MIN_BITS    9
+#define BLOCK_ACCT_SIZE_BUCKETS     15
+
+typedef struct BlockAcctTimedStats {
+    TimedAverage latency[BLOCK_MAX_IOTYPE];
+    unsigned interval_length; /* in seconds */
+    QSLIST_ENTRY(BlockAcctTimedStats) entries;
+} BlockAcctTimedStats;
+
+typedef struct BlockLatencyHistogram {
+    /* The histogram has nbins bins.  Bin i counts the requests whose
+     * latency is in [boundaries[i - 1], boundaries[i]), where the first bin
+     * starts at 0 and the last one is unbounded. */
+    int nbins;
+    uint64_t *boundaries; /* nbins - 1 boundaries in nanoseconds */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t merged[BLOCK_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    uint64_t size_histogram[BLOCK_MAX_IOTYPE][BLOCK_ACCT_SIZE_BUCKETS];
+    BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+    QSLIST_HEAD(, BlockAcctTimedStats) intervals;
 } BlockAcctStats;
 
 typedef struct BlockAcctCookie {
@@ -57,4 +87,13 @@ void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
 
+void block_acct_cleanup(BlockAcctStats *stats);
+void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length);
+BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
+                                              BlockAcctTimedStats *s);
+uint64_t block_acct_size_bucket_limit(int bucket);
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries);
+void block_latency_histograms_clear(BlockAcctStats *stats);
+
 #endif
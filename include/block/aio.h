@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -87,6 +88,32 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Adaptive polling, see aio_context_set_poll_params().  Zero
+     * poll_max_ns disables polling.
+     */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+
+    /* Polling statistics, reported by query-iothreads */
+    uint64_t poll_time_ns;  /* total time spent in poll handlers */
+    uint64_t poll_hits;     /* polling windows that found work */
+    uint64_t poll_misses;   /* polling windows that fell back to ppoll */
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* epoll(7) state, used instead of ppoll by aio_poll() once enough
+     * handlers are registered.  See aio-posix.c.
+     */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+    unsigned int epoll_threshold;   /* handlers needed to switch to epoll */
+#endif
+
+    /* Number of live (not deleted) entries in aio_handlers */
+    unsigned int nr_handlers;
 };
 
 /* Used internally to synchronize aio_poll against qemu_bh_schedule.  */
@@ -101,6 +128,23 @@ void aio_set_dispatching(AioContext *ctx, bool dispatching);
  */
 AioContext *aio_context_new(Error **errp);
 
+/**
+ * aio_context_setup:
+ * @ctx: the aio context
+ *
+ * Initialize the aio context's platform-specific event loop state.
+ * Called by aio_context_new().
+ */
+void aio_context_setup(AioContext *ctx, Error **errp);
+
+/**
+ * aio_context_destroy:
+ * @ctx: the aio context
+ *
+ * Release the state allocated by aio_context_setup().
+ */
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_ref:
  * @ctx: The AioContext to operate on.
@@ -264,6 +308,33 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Attach a poll handler to an event notifier previously registered with
+ * aio_set_event_notifier().  Before blocking, aio_poll() calls @io_poll
+ * (with the notifier as its argument) in a loop for up to the current
+ * polling time.  The handler should check for new work without making
+ * system calls, process it and return true if it made progress.  Pass
+ * NULL to remove the poll handler.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: polling time growth factor; 0 selects the default
+ * @shrink: polling time shrink factor; 0 selects the default
+ *
+ * Configure the adaptive polling window of @ctx.  The polling time starts
+ * small and grows when an event arrives shortly after aio_poll() has given
+ * up polling; it shrinks again when the event loop blocks for longer than
+ * @max_ns.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -16,6 +16,8 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -38,11 +40,19 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    IOThread *iothread;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
+typedef struct VirtIONetVring {
+    Vring vring;
+    EventNotifier host_notifier;
+    EventNotifier guest_notifier;
+    struct VirtIONetQueue *q;
+} VirtIONetVring;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -54,6 +64,11 @@ typedef struct VirtIONetQueue {
         ssize_t len;
     } async_tx;
     struct VirtIONet *n;
+
+    /* Used instead of rx_vq/tx_vq while dataplane is running */
+    VirtIONetVring *rx_vring;
+    VirtIONetVring *tx_vring;
+    QEMUBH *dp_tx_bh;
 } VirtIONetQueue;
 
 typedef struct VirtIONet {
@@ -98,6 +113,16 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+
+    /* Fields for dataplane below */
+    AioContext *ctx; /* one iothread per virtio-net device */
+    uint16_t dataplane_queues;
+    bool dataplane_started;
+    bool dataplane_starting;
+    bool dataplane_stopping;
+    bool dataplane_disabled;
+    bool dataplane_fenced;
+    Notifier migration_state_notifier;
 } VirtIONet;
 
 /*
@@ -141,4 +166,9 @@ typedef struct VirtIONet {
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
                                    const char *type);
 
+void virtio_net_tx_bh(void *opaque);
+void virtio_net_set_iothread(VirtIONet *n, IOThread *iothread, Error **errp);
+void virtio_net_dataplane_start(VirtIONet *n, int queues);
+void virtio_net_dataplane_stop(VirtIONet *n);
+
 #endif
@@ -18,6 +18,8 @@
 #include "qemu-common.h"
 #include "qemu/thread.h"
 #include "qemu/notify.h"
+#include "qemu/queue.h"
+#include "qemu/event_notifier.h"
 #include "qapi/error.h"
 #include "migration/vmstate.h"
 #include "qapi-types.h"
@@ -34,6 +36,41 @@
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
 #define QEMU_VM_VMDESCRIPTION        0x06
+#define QEMU_VM_COMMAND              0x07
+
+/* Commands sent in a QEMU_VM_COMMAND section, from source to destination */
+enum qemu_vm_cmd {
+    MIG_CMD_INVALID = 0,       /* Must be 0 */
+    MIG_CMD_OPEN_RETURN_PATH,  /* Tell the dest to open the Return path */
+    MIG_CMD_POSTCOPY_ADVISE,   /* Prior to any page transfers, just
+                                  warn we might want to do PC */
+    MIG_CMD_POSTCOPY_LISTEN,   /* Start listening for incoming
+                                  pages as it's running. */
+    MIG_CMD_POSTCOPY_RUN,      /* Start execution */
+    MIG_CMD_POSTCOPY_RAM_DISCARD, /* A list of pages to discard that
+                                     were previously sent during
+                                     precopy but are dirty. */
+    MIG_CMD_PACKAGED,          /* Send a wrapped stream within this stream */
+    MIG_CMD_MAX
+};
+
+/* Messages sent on the return path from destination to source */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,  /* Must be 0 */
+    MIG_RP_MSG_SHUT,         /* sibling will not send any more RP messages */
+    MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32, id: string) */
+    MIG_RP_MSG_MAX
+};
+
+/* State of the destination side of a postcopy migration */
+typedef enum {
+    POSTCOPY_INCOMING_NONE = 0,  /* Initial state - no postcopy */
+    POSTCOPY_INCOMING_ADVISE,
+    POSTCOPY_INCOMING_DISCARD,
+    POSTCOPY_INCOMING_LISTENING,
+    POSTCOPY_INCOMING_RUNNING,
+    POSTCOPY_INCOMING_END
+} PostcopyState;
 
 struct MigrationParams {
     bool blk;
@@ -42,6 +79,52 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+typedef struct LoadStateEntry LoadStateEntry;
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
+
+/* State for the incoming migration */
+struct MigrationIncomingState {
+    QEMUFile *from_src_file;
+
+    /* See savevm.c */
+    LoadStateEntry_Head loadvm_handlers;
+
+    /* Postcopy */
+    QemuThread fault_thread;
+    QemuSemaphore fault_thread_sem;
+    bool have_fault_thread;
+
+    bool have_listen_thread;
+    QemuThread listen_thread;
+    QemuSemaphore listen_thread_sem;
+
+    /* For the kernel to send us notifications */
+    int userfault_fd;
+    /* To tell the fault_thread to quit */
+    EventNotifier userfault_quit;
+
+    /* The return path to the source, written from several threads */
+    QEMUFile *to_src_file;
+    QemuMutex rp_mutex;
+
+    /* Page-aligned bounce buffer that incoming pages are placed from */
+    void *postcopy_tmp_page;
+};
+
+MigrationIncomingState *migration_incoming_get_current(void);
+MigrationIncomingState *migration_incoming_state_new(QEMUFile *f);
+void migration_incoming_state_destroy(void);
+void loadvm_free_handlers(MigrationIncomingState *mis);
+
+/* An outstanding page request from the destination, on the source */
+struct MigrationSrcPageRequest {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    ram_addr_t len;
+
+    QSIMPLEQ_ENTRY(MigrationSrcPageRequest) next_req;
+};
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -64,6 +147,24 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+
+    /* Set by migrate-start-postcopy, polled by the migration thread */
+    bool start_postcopy;
+
+    /* State for the return path, read by its own thread */
+    struct {
+        QEMUFile *from_dst_file;
+        QemuThread rp_thread;
+        bool error;
+    } rp_state;
+
+    /* Pages requested by the destination while in postcopy */
+    QemuMutex src_page_req_mutex;
+    QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest)
+        src_page_requests;
+
+    /* Where to open the extra multifd connections to */
+    char *multifd_host_port;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -80,6 +181,8 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp);
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp);
 
+int tcp_connect_multifd_channel(MigrationState *s, Error **errp);
+
 void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
@@ -103,12 +206,19 @@ void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+bool migration_in_postcopy(MigrationState *);
 MigrationState *migrate_get_current(void);
 
 void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void migrate_multifd_send_threads_create(void);
+void migrate_multifd_send_threads_join(void);
+void migrate_multifd_send_shutdown(void);
+void migrate_multifd_recv_threads_create(void);
+void migrate_multifd_recv_threads_join(void);
+bool migrate_multifd_recv_new_channel(int fd, Error **errp);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -130,6 +240,12 @@ double xbzrle_mig_cache_miss_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
+int ram_postcopy_send_discard_bitmap(MigrationState *ms);
+int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
+                      uint64_t start, size_t length);
+int ram_save_queue_pages(MigrationState *ms, const char *rbname,
+                         ram_addr_t start, ram_addr_t len);
+
 /**
  * @migrate_add_blocker - prevent migration from proceeding
  *
@@ -147,6 +263,11 @@ void migrate_del_blocker(Error *reason);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
+bool migrate_postcopy_ram(void);
+
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
@@ -161,6 +282,8 @@ bool migrate_use_compression(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
@@ -0,0 +1,53 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * Copyright 2015 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "migration/migration.h"
+
+/* Return true if the host supports everything we need to do postcopy-ram */
+bool postcopy_ram_supported_by_host(void);
+
+/*
+ * Make all of RAM sensitive to accesses to areas that haven't yet been
+ * written and start the thread that asks the source for them.
+ */
+int postcopy_ram_enable_notify(MigrationIncomingState *mis);
+
+/* Undo postcopy_ram_enable_notify at the end of an incoming migration */
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
+
+/*
+ * Discard the contents of memory start..start+length, so that the next
+ * access faults and the page is requested from the source.
+ */
+int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
+                               size_t length);
+
+/*
+ * Place a host page (from) at (host) atomically, waking any thread that
+ * is blocked on it.  An already present page is left alone.
+ */
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from);
+
+/* Place a zero page at (host) atomically */
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
+
+/*
+ * Allocate a page of memory that can be mapped at a later point in time
+ * using postcopy_place_page.  Returns NULL on failure.
+ */
+void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+
+PostcopyState postcopy_state_get(void);
+/* Set the state and return the old state */
+PostcopyState postcopy_state_set(PostcopyState new_state);
+
+#endif
@@ -41,6 +41,11 @@ typedef struct SaveVMHandlers {
 
     void (*cancel)(void *opaque);
     int (*save_live_complete)(QEMUFile *f, void *opaque);
+    /* Handlers that set this are left out of the device state sent when
+     * switching to postcopy, and are completed by this callback once the
+     * destination is already running.
+     */
+    int (*save_live_complete_postcopy)(QEMUFile *f, void *opaque);
 
     /* This runs both outside and inside the iothread lock.  */
     bool (*is_active)(void *opaque);
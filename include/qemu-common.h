@@ -109,6 +109,7 @@ void cpu_ticks_init(void);
 
 /* icount */
 void configure_icount(QemuOpts *opts, Error **errp);
+void qemu_tcg_configure(QemuOpts *opts, Error **errp);
 extern int use_icount;
 extern int icount_align_option;
 /* drift information for info jit command */
@@ -310,6 +311,13 @@ ssize_t qemu_co_send_recv(int sockfd, void *buf, size_t bytes, bool do_send);
 #define qemu_co_send(sockfd, buf, bytes) \
   qemu_co_send_recv(sockfd, buf, bytes, true)
 
+/**
+ * Send @bytes bytes of the file @fd, starting at @offset, without copying
+ * them to user space.  Returns the number of bytes sent, which is short at
+ * the end of the file, or -errno.  -ENOSYS means that the host cannot do it.
+ */
+ssize_t qemu_co_sendfile(int sockfd, int fd, off_t offset, size_t bytes);
+
 typedef struct QEMUIOVector {
     struct iovec *iov;
     int niov;
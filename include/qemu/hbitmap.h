@@ -87,6 +87,38 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size);
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b);
 
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes that hbitmap_serialize() stores for @hb.
+ * This only depends on the size and granularity of the bitmap, and is
+ * always a multiple of 8.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb);
+
+/**
+ * hbitmap_serialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size() bytes.
+ *
+ * Store the bottom level of @hb in @buf.  Bit N of the bitmap (that is,
+ * the group of items starting at N << granularity) is stored in bit N % 8
+ * of byte N / 8, independent of the host endianness and word size.
+ */
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf);
+
+/**
+ * hbitmap_deserialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size() bytes.
+ *
+ * Replace the contents of @hb with the data that hbitmap_serialize()
+ * stored in @buf for a bitmap of the same size and granularity.  This
+ * invalidates existing HBitmapIterators.
+ */
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf);
+
 /**
  * hbitmap_empty:
  * @hb: HBitmap to operate on.
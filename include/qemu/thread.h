@@ -9,6 +9,7 @@ typedef struct QemuCond QemuCond;
 typedef struct QemuSemaphore QemuSemaphore;
 typedef struct QemuEvent QemuEvent;
 typedef struct QemuThread QemuThread;
+typedef struct QemuSpin QemuSpin;
 
 #ifdef _WIN32
 #include "qemu/thread-win32.h"
@@ -58,6 +59,38 @@ bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
+/* Lightweight test-and-test-and-set spinlock, for very short critical
+ * sections where the cost of a QemuMutex would dominate.  Never hold it
+ * across anything that can sleep.
+ */
+struct QemuSpin {
+    int value;
+};
+
+static inline void qemu_spin_init(QemuSpin *spin)
+{
+    __sync_lock_release(&spin->value);
+}
+
+static inline void qemu_spin_lock(QemuSpin *spin)
+{
+    while (__sync_lock_test_and_set(&spin->value, true)) {
+        while (*(volatile int *)&spin->value) {
+            /* spin until the lock looks free, then retry the xchg */
+        }
+    }
+}
+
+static inline bool qemu_spin_trylock(QemuSpin *spin)
+{
+    return !__sync_lock_test_and_set(&spin->value, true);
+}
+
+static inline void qemu_spin_unlock(QemuSpin *spin)
+{
+    __sync_lock_release(&spin->value);
+}
+
 struct Notifier;
 void qemu_thread_atexit_add(struct Notifier *notifier);
 void qemu_thread_atexit_remove(struct Notifier *notifier);
@@ -0,0 +1,58 @@
+/*
+ * xxHash-based hashing of small fixed-size keys
+ *
+ * The mixing and avalanche steps follow the 32-bit variant of xxHash by
+ * Yann Collet (BSD 2-Clause License, http://www.xxhash.com), specialised
+ * for keys made of a handful of 64-bit words so that it compiles down to
+ * straight-line code.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_XXHASH_H
+#define QEMU_XXHASH_H
+
+#include <stdint.h>
+#include "qemu/bitops.h"
+
+#define QEMU_XXHASH_SEED 1
+
+#define QEMU_XXH_PRIME32_1 2654435761U
+#define QEMU_XXH_PRIME32_2 2246822519U
+#define QEMU_XXH_PRIME32_3 3266489917U
+#define QEMU_XXH_PRIME32_4  668265263U
+#define QEMU_XXH_PRIME32_5  374761393U
+
+static inline uint32_t qemu_xxhash_round(uint32_t h, uint64_t v)
+{
+    h += (uint32_t)v * QEMU_XXH_PRIME32_3;
+    h = rol32(h, 17) * QEMU_XXH_PRIME32_4;
+    h += (uint32_t)(v >> 32) * QEMU_XXH_PRIME32_3;
+    h = rol32(h, 17) * QEMU_XXH_PRIME32_4;
+    return h;
+}
+
+static inline uint32_t qemu_xxhash_avalanche(uint32_t h)
+{
+    h ^= h >> 15;
+    h *= QEMU_XXH_PRIME32_2;
+    h ^= h >> 13;
+    h *= QEMU_XXH_PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Hash four 64-bit words; callers pass 0 for unused words.  */
+static inline uint32_t qemu_xxhash4(uint64_t a, uint64_t b, uint64_t c,
+                                    uint64_t d)
+{
+    uint32_t h = QEMU_XXHASH_SEED + QEMU_XXH_PRIME32_5 + 32;
+
+    h = qemu_xxhash_round(h, a);
+    h = qemu_xxhash_round(h, b);
+    h = qemu_xxhash_round(h, c);
+    h = qemu_xxhash_round(h, d);
+    return qemu_xxhash_avalanche(h);
+}
+
+#endif
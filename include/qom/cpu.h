@@ -207,6 +207,8 @@ struct kvm_run;
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+#define CPU_TLB_FLUSH_MAX_PAGES 8
+
 /**
  * CPUState:
  * @cpu_index: CPU index (informative).
@@ -214,7 +216,8 @@ struct kvm_run;
  * @nr_threads: Number of threads within this CPU.
  * @numa_node: NUMA node this CPU is belonging to.
  * @host_tid: Host thread ID.
- * @running: #true if CPU is currently running (usermode).
+ * @running: #true if CPU is currently running guest code (usermode and
+ *           multi-threaded TCG).
  * @created: Indicates whether the CPU thread has been successfully created.
  * @interrupt_request: Indicates a pending interrupt request.
  * @halted: Nonzero if the CPU is in suspended state.
@@ -238,6 +241,9 @@ struct kvm_run;
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @tlb_flush_all: A full TLB flush was requested by another vCPU thread.
+ * @tlb_flush_nb_pages: Number of valid entries in @tlb_flush_pages.
+ * @tlb_flush_pages: Pages whose TLB entries other vCPU threads asked to flush.
  *
  * State of one CPU core or thread.
  */
@@ -276,6 +282,9 @@ struct CPUState {
     void *env_ptr; /* CPUArchState */
     struct TranslationBlock *current_tb;
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    bool tlb_flush_all;
+    int tlb_flush_nb_pages;
+    vaddr tlb_flush_pages[CPU_TLB_FLUSH_MAX_PAGES];
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
     int gdb_num_g_regs;
@@ -328,6 +337,16 @@ extern struct CPUTailQ cpus;
 DECLARE_TLS(CPUState *, current_cpu);
 #define current_cpu tls_var(current_cpu)
 
+extern bool mttcg_enabled;
+
+/**
+ * qemu_tcg_mttcg_enabled:
+ * Check whether each TCG vCPU runs in its own host thread.
+ *
+ * Returns: %true if multi-threaded TCG is enabled, %false otherwise.
+ */
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
 /**
  * cpu_paging_enabled:
  * @cpu: The CPU whose state is to be inspected.
@@ -533,6 +552,39 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * qemu_tcg_in_exclusive_section:
+ *
+ * Returns: %true if the calling thread has stopped every other TCG vCPU
+ * thread and may therefore modify state that translated code depends on.
+ */
+bool qemu_tcg_in_exclusive_section(void);
+
+/**
+ * qemu_tcg_request_tb_flush:
+ *
+ * Ask the TCG vCPU threads to flush the translation buffer.  The flush is
+ * performed asynchronously once all vCPUs are out of translated code.
+ */
+void qemu_tcg_request_tb_flush(void);
+
+/**
+ * qemu_tcg_request_tlb_flush:
+ * @cpu: The vCPU whose TLB must be flushed.
+ * @all: Whether to flush the whole TLB.
+ * @addr: The page to flush if @all is %false.
+ *
+ * Flush the TLB of another vCPU on behalf of translated code running in
+ * the calling vCPU thread.  The flush is only queued here: the calling
+ * vCPU leaves cpu_exec at the end of the current TB, and the flush is
+ * performed in an exclusive section before it executes another one.  Any
+ * instructions after the requesting one in the same TB may still run
+ * while the other vCPU uses its old TLB entries.
+ *
+ * Returns: %false if the calling thread is not executing translated code.
+ */
+bool qemu_tcg_request_tlb_flush(CPUState *cpu, bool all, vaddr addr);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -96,6 +96,52 @@ static int socket_shutdown(void *opaque, bool rd, bool wr)
     }
 }
 
+/* The return path shares the fd with the main stream; don't close it */
+static int socket_return_path_close(void *opaque)
+{
+    g_free(opaque);
+    return 0;
+}
+
+static const QEMUFileOps socket_return_path_read_ops = {
+    .get_fd     = socket_get_fd,
+    .get_buffer = socket_get_buffer,
+    .close      = socket_return_path_close,
+    .shut_down  = socket_shutdown
+};
+
+static const QEMUFileOps socket_return_path_write_ops = {
+    .get_fd        = socket_get_fd,
+    .writev_buffer = socket_writev_buffer,
+    .close         = socket_return_path_close,
+    .shut_down     = socket_shutdown
+};
+
+/*
+ * Give a QEMUFile* off the same socket but data in the opposite
+ * direction.
+ */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *forward = opaque;
+    QEMUFileSocket *reverse;
+
+    if (qemu_file_get_error(forward->file)) {
+        /* If the forward file is in error, don't try and open a return */
+        return NULL;
+    }
+
+    reverse = g_malloc0(sizeof(QEMUFileSocket));
+    reverse->fd = forward->fd;
+    /* I don't think there's a better way to tell which direction 'this' is */
+    if (qemu_file_is_writable(forward->file)) {
+        reverse->file = qemu_fopen_ops(reverse, &socket_return_path_read_ops);
+    } else {
+        reverse->file = qemu_fopen_ops(reverse, &socket_return_path_write_ops);
+    }
+    return reverse->file;
+}
+
 static ssize_t unix_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                   int64_t pos)
 {
@@ -204,18 +250,19 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 }
 
 static const QEMUFileOps socket_read_ops = {
-    .get_fd     = socket_get_fd,
-    .get_buffer = socket_get_buffer,
-    .close      = socket_close,
-    .shut_down  = socket_shutdown
-
+    .get_fd          = socket_get_fd,
+    .get_buffer      = socket_get_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path
 };
 
 static const QEMUFileOps socket_write_ops = {
-    .get_fd        = socket_get_fd,
-    .writev_buffer = socket_writev_buffer,
-    .close         = socket_close,
-    .shut_down     = socket_shutdown
+    .get_fd          = socket_get_fd,
+    .writev_buffer   = socket_writev_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path
 };
 
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
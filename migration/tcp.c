@@ -50,30 +50,90 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    s->multifd_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
-static void tcp_accept_incoming_migration(void *opaque)
+/* Called from the multifd send threads, so it's fine to block */
+int tcp_connect_multifd_channel(MigrationState *s, Error **errp)
+{
+    if (!s->multifd_host_port) {
+        error_setg(errp, "multifd needs a tcp: migration");
+        return -1;
+    }
+    return inet_connect(s->multifd_host_port, errp);
+}
+
+/* The main stream, held back until all the multifd channels are in */
+static QEMUFile *tcp_incoming_main_file;
+
+static void tcp_accept_multifd_channel(void *opaque)
 {
     struct sockaddr_in addr;
     socklen_t addrlen = sizeof(addr);
     int s = (intptr_t)opaque;
     QEMUFile *f;
+    Error *local_err = NULL;
     int c, err;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
         err = socket_error();
     } while (c < 0 && err == EINTR);
+
+    DPRINTF("accepted multifd channel\n");
+
+    if (c < 0) {
+        error_report("could not accept multifd connection (%s)",
+                     strerror(err));
+        goto fail;
+    }
+
+    if (!migrate_multifd_recv_new_channel(c, &local_err)) {
+        if (local_err) {
+            error_report_err(local_err);
+            goto fail;
+        }
+        return;
+    }
+
+    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+    closesocket(s);
+    f = tcp_incoming_main_file;
+    tcp_incoming_main_file = NULL;
+    process_incoming_migration(f);
+    return;
+
+fail:
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
     closesocket(s);
+    qemu_fclose(tcp_incoming_main_file);
+    tcp_incoming_main_file = NULL;
+    migrate_multifd_recv_threads_join();
+    /* Like a failed load; nothing else would end the incoming migration */
+    error_report("load of migration failed");
+    exit(EXIT_FAILURE);
+}
+
+static void tcp_accept_incoming_migration(void *opaque)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int s = (intptr_t)opaque;
+    QEMUFile *f;
+    int c, err;
+
+    do {
+        c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
+        err = socket_error();
+    } while (c < 0 && err == EINTR);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
         error_report("could not accept migration connection (%s)",
                      strerror(err));
-        return;
+        goto out_listen;
     }
 
     f = qemu_fopen_socket(c, "rb");
@@ -82,11 +142,25 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    if (migrate_use_multifd()) {
+        /* Keep listening for the channels; the main stream goes first */
+        tcp_incoming_main_file = f;
+        migrate_multifd_recv_threads_create();
+        qemu_set_fd_handler2(s, NULL, tcp_accept_multifd_channel, NULL,
+                             (void *)(intptr_t)s);
+        return;
+    }
+
+    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+    closesocket(s);
     process_incoming_migration(f);
     return;
 
 out:
     closesocket(c);
+out_listen:
+    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+    closesocket(s);
 }
 
 void tcp_start_incoming_migration(const char *host_port, Error **errp)
@@ -64,8 +64,10 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_CHUNK_HEADER_SIZE   (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
 #define NBD_REP_MAGIC           0x3e889045565a9LL
@@ -85,6 +87,17 @@
 #define NBD_OPT_EXPORT_NAME     (1)
 #define NBD_OPT_ABORT           (2)
 #define NBD_OPT_LIST            (3)
+#define NBD_OPT_STRUCTURED_REPLY (8)
+#define NBD_OPT_SET_META_CONTEXT (10)
+
+/* Longest option payload accepted by the server */
+#define NBD_MAX_OPTION_LENGTH   4096
+
+/* Id of the "base:allocation" meta context, the only one we support */
+#define NBD_META_ID_BASE_ALLOCATION 0
+
+/* Maximum number of extents in a block status reply */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 1024
 
 /* NBD errors are based on errno numbers, so there is a 1:1 mapping,
  * but only a limited set of errno values is specified in the protocol.
@@ -120,7 +133,7 @@ static int system_errno_to_nbd_errno(int err)
     }
 }
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -147,6 +160,7 @@ struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
     uint8_t *data;
+    int fd;             /* host file for zero-copy reads, or -1 */
 };
 
 struct NBDExport {
@@ -180,6 +194,10 @@ struct NBDClient {
 
     bool can_read;
 
+    bool fixed_newstyle;        /* client may send any option */
+    bool structured_reply;      /* structured replies were negotiated */
+    bool block_status;          /* "base:allocation" context was selected */
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -303,10 +321,11 @@ static ssize_t write_sync(int fd, void *buffer, size_t size)
 
 */
 
-static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+/* Send the header of an option reply, @len bytes of data must follow */
+static int nbd_send_rep_len(int csock, uint32_t type, uint32_t opt,
+                            uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -323,7 +342,7 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (write_sync(csock, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -331,6 +350,11 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+{
+    return nbd_send_rep_len(csock, type, opt, 0);
+}
+
 static int nbd_send_rep_list(int csock, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -392,6 +416,118 @@ static int nbd_handle_list(NBDClient *client, uint32_t length)
     return nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_LIST);
 }
 
+static int nbd_handle_structured_reply(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+
+    if (length) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    client->structured_reply = true;
+    return nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_STRUCTURED_REPLY);
+}
+
+static int nbd_send_rep_meta_context(int csock, uint32_t id, const char *name)
+{
+    uint32_t len = strlen(name);
+
+    if (nbd_send_rep_len(csock, NBD_REP_META_CONTEXT,
+                         NBD_OPT_SET_META_CONTEXT, sizeof(id) + len) < 0) {
+        return -EINVAL;
+    }
+    id = cpu_to_be32(id);
+    if (write_sync(csock, &id, sizeof(id)) != sizeof(id)) {
+        LOG("write failed (context id)");
+        return -EINVAL;
+    }
+    if (write_sync(csock, (char *)name, len) != len) {
+        LOG("write failed (context name)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_handle_set_meta_context(NBDClient *client, uint32_t length)
+{
+    int rc, csock = client->sock;
+    uint32_t reply = NBD_REP_ACK;
+    uint32_t pos, len, nb_queries;
+    uint8_t *buf;
+    char *name;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries
+        ...           for each query, its length and the query itself
+     */
+    client->block_status = false;
+
+    if (!client->structured_reply || length > NBD_MAX_OPTION_LENGTH) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_SET_META_CONTEXT);
+    }
+
+    buf = g_malloc(length);
+    if (read_sync(csock, buf, length) != length) {
+        LOG("read failed");
+        g_free(buf);
+        return -EIO;
+    }
+
+    if (length < 8 || (len = be32_to_cpup((uint32_t *)buf)) > length - 8) {
+        reply = NBD_REP_ERR_INVALID;
+        goto out;
+    }
+    name = g_strndup((char *)buf + 4, len);
+    if (!nbd_export_find(name)) {
+        reply = NBD_REP_ERR_UNKNOWN;
+    }
+    g_free(name);
+    if (reply != NBD_REP_ACK) {
+        goto out;
+    }
+
+    pos = 4 + len;
+    nb_queries = be32_to_cpup((uint32_t *)(buf + pos));
+    pos += 4;
+    for (; nb_queries > 0; nb_queries--) {
+        if (length - pos < 4 ||
+            (len = be32_to_cpup((uint32_t *)(buf + pos))) > length - pos - 4) {
+            client->block_status = false;
+            reply = NBD_REP_ERR_INVALID;
+            goto out;
+        }
+        pos += 4;
+        if (len == strlen(NBD_META_BASE_ALLOCATION) &&
+            !memcmp(buf + pos, NBD_META_BASE_ALLOCATION, len)) {
+            client->block_status = true;
+        }
+        pos += len;
+    }
+
+    if (client->block_status) {
+        rc = nbd_send_rep_meta_context(csock, NBD_META_ID_BASE_ALLOCATION,
+                                       NBD_META_BASE_ALLOCATION);
+        if (rc < 0) {
+            g_free(buf);
+            return rc;
+        }
+    }
+
+out:
+    g_free(buf);
+    return nbd_send_rep(csock, reply, NBD_OPT_SET_META_CONTEXT);
+}
+
 static int nbd_handle_export_name(NBDClient *client, uint32_t length)
 {
     int rc = -EINVAL, csock = client->sock;
@@ -453,6 +589,7 @@ static int nbd_receive_options(NBDClient *client)
         LOG("Bad client flags received");
         return -EIO;
     }
+    client->fixed_newstyle = (flags & NBD_FLAG_C_FIXED_NEWSTYLE) != 0;
 
     while (1) {
         int ret;
@@ -495,11 +632,36 @@ static int nbd_receive_options(NBDClient *client)
         case NBD_OPT_EXPORT_NAME:
             return nbd_handle_export_name(client, length);
 
+        case NBD_OPT_STRUCTURED_REPLY:
+            ret = nbd_handle_structured_reply(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
+        case NBD_OPT_SET_META_CONTEXT:
+            ret = nbd_handle_set_meta_context(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
         default:
             tmp = be32_to_cpu(tmp);
             LOG("Unsupported option 0x%x", tmp);
-            nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
-            return -EINVAL;
+            if (!client->fixed_newstyle) {
+                nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
+                return -EINVAL;
+            }
+            /* Fixed newstyle clients can go on with another option */
+            if (drop_sync(csock, length) != length) {
+                return -EIO;
+            }
+            ret = nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
         }
     }
 }
@@ -579,8 +741,157 @@ fail:
     return rc;
 }
 
+static int nbd_send_option_request(int csock, uint32_t opt, uint32_t len,
+                                   const void *data, Error **errp)
+{
+    uint64_t magic;
+    uint32_t be_len;
+
+    magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send option magic");
+        return -EINVAL;
+    }
+    opt = cpu_to_be32(opt);
+    if (write_sync(csock, &opt, sizeof(opt)) != sizeof(opt)) {
+        error_setg(errp, "Failed to send option number");
+        return -EINVAL;
+    }
+    be_len = cpu_to_be32(len);
+    if (write_sync(csock, &be_len, sizeof(be_len)) != sizeof(be_len)) {
+        error_setg(errp, "Failed to send option length");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        error_setg(errp, "Failed to send option data");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_receive_option_reply(int csock, uint32_t opt, uint32_t *type,
+                                    uint32_t *len, Error **errp)
+{
+    uint64_t magic;
+    uint32_t reply_opt;
+
+    /* Server sends:
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   NBD option
+        [12 ..  15]   reply type
+        [16 ..  19]   data length
+        ...           data
+     */
+    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to read option reply magic");
+        return -EINVAL;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC) {
+        error_setg(errp, "Bad option reply magic received");
+        return -EINVAL;
+    }
+    if (read_sync(csock, &reply_opt, sizeof(reply_opt)) != sizeof(reply_opt) ||
+        read_sync(csock, type, sizeof(*type)) != sizeof(*type) ||
+        read_sync(csock, len, sizeof(*len)) != sizeof(*len)) {
+        error_setg(errp, "Failed to read option reply");
+        return -EINVAL;
+    }
+    if (be32_to_cpu(reply_opt) != opt) {
+        error_setg(errp, "Unexpected option reply received");
+        return -EINVAL;
+    }
+    *type = be32_to_cpu(*type);
+    *len = be32_to_cpu(*len);
+    return 0;
+}
+
+/* Ask for structured replies and for the "base:allocation" meta context.
+ * Both are optional, so only I/O errors make this function fail.  Servers
+ * that predate option haggling drop the connection on the first option;
+ * that case returns -ECONNRESET, and the caller can connect again without
+ * asking for extensions.
+ */
+static int nbd_negotiate_extensions(int csock, const char *name,
+                                    NBDExtensions *ext, Error **errp)
+{
+    const char *query = NBD_META_BASE_ALLOCATION;
+    uint32_t name_len = strlen(name);
+    uint32_t query_len = strlen(query);
+    uint32_t type, len, id;
+    char context[64];
+    uint8_t *buf;
+    int rc;
+
+    if (nbd_send_option_request(csock, NBD_OPT_STRUCTURED_REPLY, 0, NULL,
+                                errp) < 0 ||
+        nbd_receive_option_reply(csock, NBD_OPT_STRUCTURED_REPLY, &type, &len,
+                                 errp) < 0) {
+        return -ECONNRESET;
+    }
+    if (len && drop_sync(csock, len) != len) {
+        error_setg(errp, "Failed to read option reply data");
+        return -EINVAL;
+    }
+    if (type != NBD_REP_ACK) {
+        return 0;
+    }
+    ext->structured_reply = true;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries (1)
+        [xx .. +3]    query length
+        ...           query
+     */
+    len = 4 + name_len + 4 + 4 + query_len;
+    buf = g_malloc(len);
+    cpu_to_be32w((uint32_t *)buf, name_len);
+    memcpy(buf + 4, name, name_len);
+    cpu_to_be32w((uint32_t *)(buf + 4 + name_len), 1);
+    cpu_to_be32w((uint32_t *)(buf + 8 + name_len), query_len);
+    memcpy(buf + 12 + name_len, query, query_len);
+    rc = nbd_send_option_request(csock, NBD_OPT_SET_META_CONTEXT, len, buf,
+                                 errp);
+    g_free(buf);
+    if (rc < 0) {
+        return rc;
+    }
+
+    for (;;) {
+        if (nbd_receive_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                     &type, &len, errp) < 0) {
+            return -EINVAL;
+        }
+        if (type == NBD_REP_META_CONTEXT && len >= sizeof(id) &&
+            len - sizeof(id) < sizeof(context)) {
+            if (read_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+                read_sync(csock, context, len - sizeof(id)) !=
+                len - sizeof(id)) {
+                error_setg(errp, "Failed to read meta context");
+                return -EINVAL;
+            }
+            context[len - sizeof(id)] = '\0';
+            if (!strcmp(context, query)) {
+                ext->block_status = true;
+                ext->meta_context_id = be32_to_cpu(id);
+            }
+            continue;
+        }
+
+        if (len && drop_sync(csock, len) != len) {
+            error_setg(errp, "Failed to read option reply data");
+            return -EINVAL;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            /* NBD_REP_ACK or an error, both end the reply */
+            return 0;
+        }
+    }
+}
+
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExtensions *ext, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
@@ -590,6 +901,9 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     TRACE("Receiving negotiation.");
 
     rc = -EINVAL;
+    if (ext) {
+        memset(ext, 0, sizeof(*ext));
+    }
 
     if (read_sync(csock, buf, 8) != 8) {
         error_setg(errp, "Failed to read data");
@@ -625,7 +939,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     TRACE("Magic is 0x%" PRIx64, magic);
 
     if (name) {
-        uint32_t reserved = 0;
+        uint32_t client_flags = 0;
         uint32_t opt;
         uint32_t namesize;
 
@@ -643,12 +957,23 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             goto fail;
         }
         *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
-        if (write_sync(csock, &reserved, sizeof(reserved)) !=
-            sizeof(reserved)) {
-            error_setg(errp, "Failed to read reserved field");
+        /* Options other than the export name need fixed newstyle */
+        if (ext && (*flags & (NBD_FLAG_FIXED_NEWSTYLE << 16))) {
+            client_flags = NBD_FLAG_C_FIXED_NEWSTYLE;
+        }
+        client_flags = cpu_to_be32(client_flags);
+        if (write_sync(csock, &client_flags, sizeof(client_flags)) !=
+            sizeof(client_flags)) {
+            error_setg(errp, "Failed to send client flags");
             goto fail;
         }
+        if (client_flags) {
+            rc = nbd_negotiate_extensions(csock, name, ext, errp);
+            if (rc < 0) {
+                goto fail;
+            }
+            rc = -EINVAL;
+        }
         /* write the export name */
         magic = cpu_to_be64(magic);
         if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -903,12 +1228,38 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
      */
 
     magic = be32_to_cpup((uint32_t*)buf);
-    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->magic  = magic;
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        reply->error  = 0;
+        reply->flags  = be16_to_cpup((uint16_t *)(buf + 4));
+        reply->type   = be16_to_cpup((uint16_t *)(buf + 6));
+        if (read_sync(csock, &reply->length, sizeof(reply->length)) !=
+            sizeof(reply->length)) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        reply->length = be32_to_cpu(reply->length);
+
+        TRACE("Got chunk: "
+              "{ .flags = 0x%x, .type = %d, handle = %" PRIu64
+              ", length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
+    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
     reply->error = nbd_errno_to_system_errno(reply->error);
 
     TRACE("Got reply: "
@@ -922,6 +1273,11 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
+bool nbd_reply_is_structured(struct nbd_reply *reply)
+{
+    return reply->magic == NBD_STRUCTURED_REPLY_MAGIC;
+}
+
 static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
 {
     uint8_t buf[NBD_REPLY_SIZE];
@@ -1008,6 +1364,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     req = g_slice_new0(NBDRequest);
     nbd_client_get(client);
     req->client = client;
+    req->fd = -1;
     return req;
 }
 
@@ -1018,6 +1375,9 @@ static void nbd_request_put(NBDRequest *req)
     if (req->data) {
         qemu_vfree(req->data);
     }
+    if (req->fd >= 0) {
+        close(req->fd);
+    }
     g_slice_free(NBDRequest, req);
 
     client->nb_requests--;
@@ -1177,6 +1537,82 @@ void nbd_export_close_all(void)
     }
 }
 
+static void nbd_co_send_lock(NBDClient *client)
+{
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+}
+
+static void nbd_co_send_unlock(NBDClient *client)
+{
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+}
+
+/* Return a host file descriptor from which the data of @exp can be sent
+ * to the client directly, or -errno if reads must go through the block
+ * layer.  The answer can change at any time, e.g. if a filter or a
+ * throttling group is inserted, so ask again for every request.
+ *
+ * The block layer may close its descriptor while the request waits for
+ * the socket, e.g. on reopen, so the caller gets a duplicate that it must
+ * close.
+ */
+static int nbd_export_dup_host_fd(NBDExport *exp)
+{
+#ifdef CONFIG_SENDFILE
+    int fd;
+
+    fd = bdrv_get_host_fd(blk_bs(exp->blk));
+    if (fd < 0) {
+        return fd;
+    }
+    fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    return fd < 0 ? -errno : fd;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+/* Send @len bytes of @fd starting at @offset.  The socket must be locked
+ * and corked.  A failure here leaves the client in the middle of a reply,
+ * so the only way out is to disconnect it.
+ */
+static ssize_t nbd_co_send_file(int csock, int fd, off_t offset, uint32_t len)
+{
+    ssize_t ret;
+
+    ret = qemu_co_sendfile(csock, fd, offset, len);
+    if (ret != len) {
+        LOG("sending file data failed");
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Reply to a read with a simple reply, sending the data straight from
+ * the host file @fd.
+ */
+static ssize_t nbd_co_send_reply_fd(NBDRequest *req, struct nbd_reply *reply,
+                                    int fd, off_t offset, uint32_t len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    ssize_t rc;
+
+    nbd_co_send_lock(client);
+    socket_set_cork(csock, 1);
+    rc = nbd_send_reply(csock, reply);
+    if (rc >= 0) {
+        rc = nbd_co_send_file(csock, fd, offset, len);
+    }
+    socket_set_cork(csock, 0);
+    nbd_co_send_unlock(client);
+    return rc;
+}
+
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
@@ -1184,9 +1620,7 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     int csock = client->sock;
     ssize_t rc, ret;
 
-    qemu_co_mutex_lock(&client->send_lock);
-    client->send_coroutine = qemu_coroutine_self();
-    nbd_set_handlers(client);
+    nbd_co_send_lock(client);
 
     if (!len) {
         rc = nbd_send_reply(csock, reply);
@@ -1202,9 +1636,229 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
         socket_set_cork(csock, 0);
     }
 
-    client->send_coroutine = NULL;
-    nbd_set_handlers(client);
-    qemu_co_mutex_unlock(&client->send_lock);
+    nbd_co_send_unlock(client);
+    return rc;
+}
+
+/* Send a structured reply chunk.  The data that follows the payload is
+ * taken from @data, or if it is NULL from the host file @fd at @fd_offset.
+ */
+static ssize_t nbd_co_send_chunk_fd(NBDRequest *req, uint64_t handle,
+                                    uint16_t flags, uint16_t type,
+                                    void *payload, uint32_t payload_len,
+                                    void *data, int fd, off_t fd_offset,
+                                    uint32_t data_len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t buf[NBD_CHUNK_HEADER_SIZE];
+    ssize_t rc = 0;
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    cpu_to_be32w((uint32_t *)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t *)(buf + 4), flags);
+    cpu_to_be16w((uint16_t *)(buf + 6), type);
+    cpu_to_be64w((uint64_t *)(buf + 8), handle);
+    cpu_to_be32w((uint32_t *)(buf + 16), payload_len + data_len);
+
+    TRACE("Sending chunk to client: "
+          "{ .flags = 0x%x, .type = %d, .length = %u }",
+          flags, type, payload_len + data_len);
+
+    nbd_co_send_lock(client);
+
+    socket_set_cork(csock, 1);
+    if (qemu_co_send(csock, buf, sizeof(buf)) != sizeof(buf) ||
+        (payload_len &&
+         qemu_co_send(csock, payload, payload_len) != payload_len)) {
+        rc = -EIO;
+    } else if (data_len && data) {
+        if (qemu_co_send(csock, data, data_len) != data_len) {
+            rc = -EIO;
+        }
+    } else if (data_len) {
+        rc = nbd_co_send_file(csock, fd, fd_offset, data_len);
+    }
+    socket_set_cork(csock, 0);
+
+    nbd_co_send_unlock(client);
+    return rc;
+}
+
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *payload, uint32_t payload_len,
+                                 void *data, uint32_t data_len)
+{
+    return nbd_co_send_chunk_fd(req, handle, flags, type,
+                                payload, payload_len, data, -1, 0, data_len);
+}
+
+static ssize_t nbd_co_send_error_chunk(NBDRequest *req, uint64_t handle,
+                                       int error)
+{
+    uint8_t payload[4 + 2];
+
+    /* Error chunk payload
+       [ 0 ..  3]    error
+       [ 4 ..  5]    length of the message (0)
+     */
+    cpu_to_be32w((uint32_t *)payload, system_errno_to_nbd_errno(error));
+    cpu_to_be16w((uint16_t *)(payload + 4), 0);
+
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, payload, sizeof(payload),
+                             NULL, 0);
+}
+
+/* Reply to a read with structured reply chunks.  Regions that read as
+ * zeroes are sent as holes, without any data.  If the request has a host
+ * file descriptor, data chunks are sent from it and req->data is not used.
+ */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req,
+                                       struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int64_t sector_num;
+    uint32_t offset, len;
+    uint8_t payload[8 + 4];
+    uint16_t flags;
+    int64_t status;
+    ssize_t rc;
+    int n, fd = req->fd;
+
+    if ((request->from | request->len) & (BDRV_SECTOR_SIZE - 1)) {
+        return nbd_co_send_error_chunk(req, request->handle, EINVAL);
+    }
+    if (request->len == 0) {
+        return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+    }
+
+    sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    for (offset = 0; offset < request->len; offset += len) {
+        n = (request->len - offset) / BDRV_SECTOR_SIZE;
+        status = bdrv_get_block_status_above(bs, NULL, sector_num, n, &n);
+        if (status < 0 || n == 0) {
+            /* Fall back to reading the data */
+            status = 0;
+            n = (request->len - offset) / BDRV_SECTOR_SIZE;
+        }
+        len = n * BDRV_SECTOR_SIZE;
+
+        if (!(status & BDRV_BLOCK_ZERO) && fd < 0) {
+            rc = blk_read(exp->blk, sector_num, req->data + offset, n);
+            if (rc < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_error_chunk(req, request->handle, -rc);
+            }
+        }
+
+        /* Data and hole chunks start with the offset of the region */
+        cpu_to_be64w((uint64_t *)payload, request->from + offset);
+        flags = offset + len == request->len ? NBD_REPLY_FLAG_DONE : 0;
+        if ((status & BDRV_BLOCK_ZERO) ||
+            (fd < 0 && buffer_is_zero(req->data + offset, len))) {
+            cpu_to_be32w((uint32_t *)(payload + 8), len);
+            rc = nbd_co_send_chunk(req, request->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_HOLE,
+                                   payload, 8 + 4, NULL, 0);
+        } else if (fd >= 0) {
+            rc = nbd_co_send_chunk_fd(req, request->handle, flags,
+                                      NBD_REPLY_TYPE_OFFSET_DATA,
+                                      payload, 8, NULL, fd,
+                                      sector_num * BDRV_SECTOR_SIZE, len);
+        } else {
+            rc = nbd_co_send_chunk(req, request->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_DATA,
+                                   payload, 8, req->data + offset, len);
+        }
+        if (rc < 0) {
+            return rc;
+        }
+        sector_num += n;
+    }
+
+    TRACE("Read %u byte(s)", request->len);
+    return 0;
+}
+
+/* Reply to a block status request with the extents of the
+ * "base:allocation" context.
+ */
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int64_t sector_num;
+    int nb_sectors, nb_extents = 0;
+    uint32_t length, flags, last_flags = 0;
+    uint8_t *payload;
+    int64_t status;
+    ssize_t rc;
+    int n;
+
+    if (request->len == 0 ||
+        ((request->from | request->len) & (BDRV_SECTOR_SIZE - 1))) {
+        return nbd_co_send_error_chunk(req, request->handle, EINVAL);
+    }
+
+    /* Block status payload
+       [ 0 ..  3]    context id
+       followed by up to NBD_MAX_BLOCK_STATUS_EXTENTS times
+       [ 0 ..  3]    length of the extent
+       [ 4 ..  7]    flags of the extent (NBD_STATE_*)
+     */
+    payload = g_malloc(4 + 8 * NBD_MAX_BLOCK_STATUS_EXTENTS);
+    cpu_to_be32w((uint32_t *)payload, NBD_META_ID_BASE_ALLOCATION);
+
+    sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    nb_sectors = request->len / BDRV_SECTOR_SIZE;
+    while (nb_sectors > 0) {
+        status = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                             &n);
+        if (status < 0 || n == 0) {
+            g_free(payload);
+            return nbd_co_send_error_chunk(req, request->handle,
+                                           status < 0 ? -status : EIO);
+        }
+
+        flags = (status & BDRV_BLOCK_ALLOCATED ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        length = n * BDRV_SECTOR_SIZE;
+        if (nb_extents > 0 && flags == last_flags) {
+            /* Merge with the previous extent */
+            uint8_t *p = payload + 4 + 8 * (nb_extents - 1);
+            cpu_to_be32w((uint32_t *)p, be32_to_cpup((uint32_t *)p) + length);
+        } else if (nb_extents < NBD_MAX_BLOCK_STATUS_EXTENTS) {
+            uint8_t *p = payload + 4 + 8 * nb_extents;
+            cpu_to_be32w((uint32_t *)p, length);
+            cpu_to_be32w((uint32_t *)(p + 4), flags);
+            nb_extents++;
+            last_flags = flags;
+        } else {
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        if (request->type & NBD_CMD_FLAG_REQ_ONE) {
+            break;
+        }
+    }
+
+    rc = nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                           NBD_REPLY_TYPE_BLOCK_STATUS,
+                           payload, 4 + 8 * nb_extents, NULL, 0);
+    g_free(payload);
     return rc;
 }
 
@@ -1226,7 +1880,9 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_MAX_BUFFER_SIZE) {
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if (command != NBD_CMD_BLOCK_STATUS &&
+        request->len > NBD_MAX_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_MAX_BUFFER_SIZE);
         rc = -EINVAL;
@@ -1242,8 +1898,12 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    command = request->type & NBD_CMD_MASK_COMMAND;
-    if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
+    /* Zero-copy reads need no buffer */
+    if (command == NBD_CMD_READ && request->len) {
+        req->fd = nbd_export_dup_host_fd(client->exp);
+    }
+    if ((command == NBD_CMD_READ && req->fd < 0) ||
+        command == NBD_CMD_WRITE) {
         req->data = blk_blockalign(client->exp->blk, request->len);
     }
     if (command == NBD_CMD_WRITE) {
@@ -1291,11 +1951,11 @@ static void nbd_trip(void *opaque)
     reply.handle = request.handle;
     reply.error = 0;
 
+    command = request.type & NBD_CMD_MASK_COMMAND;
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
     }
-    command = request.type & NBD_CMD_MASK_COMMAND;
     if (command != NBD_CMD_DISC && (request.from + request.len) > exp->size) {
             LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
             ", Offset: %" PRIu64 "\n",
@@ -1318,6 +1978,23 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
+        if (req->fd >= 0) {
+            TRACE("Sending %u byte(s) from file", request.len);
+            if (nbd_co_send_reply_fd(req, &reply, req->fd,
+                                     request.from + exp->dev_offset,
+                                     request.len) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_read(exp->blk,
                        (request.from + exp->dev_offset) / BDRV_SECTOR_SIZE,
                        req->data, request.len / BDRV_SECTOR_SIZE);
@@ -1393,12 +2070,29 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+
+        if (!client->block_status) {
+            LOG("block status was not negotiated");
+            goto invalid_request;
+        }
+        if (nbd_co_send_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
         reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        if (client->structured_reply &&
+            (command == NBD_CMD_READ || command == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_error_chunk(req, reply.handle, reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
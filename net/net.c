@@ -510,6 +510,23 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+bool qemu_net_has_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context;
+}
+
+/* Move the file descriptor handlers of @nc to @ctx, or back to the main
+ * loop if @ctx is NULL.  The caller must hold @ctx and the AioContext
+ * currently in use, if any.
+ */
+void qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    assert(qemu_net_has_aio_context(nc));
+
+    nc->info->set_aio_context(nc, ctx);
+    nc->aio_context = ctx;
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -585,6 +602,12 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
          * the file descriptor (for tap, for example).
          */
         qemu_notify_event();
+        if (nc->peer && nc->peer->aio_context) {
+            /* An AioContext has no can_read callback, so the peer stops
+             * polling while we cannot receive.  Let it resume.
+             */
+            qemu_net_set_aio_context(nc->peer, nc->peer->aio_context);
+        }
     } else if (purge) {
         /* Unable to empty the queue, purge remaining packets */
         qemu_net_queue_purge(nc->incoming_queue, nc);
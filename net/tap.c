@@ -43,6 +43,7 @@
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
+#include "block/aio.h"
 
 typedef struct TAPState {
     NetClientState nc;
@@ -55,6 +56,7 @@ typedef struct TAPState {
     bool using_vnet_hdr;
     bool has_ufo;
     bool enabled;
+    AioContext *ctx;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
 } TAPState;
@@ -66,8 +68,17 @@ static int tap_can_send(void *opaque);
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
 
+static void tap_aio_send(void *opaque);
+
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd,
+                           s->read_poll && s->enabled ? tap_aio_send : NULL,
+                           s->write_poll && s->enabled ? tap_writable : NULL,
+                           s);
+        return;
+    }
     qemu_set_fd_handler2(s->fd,
                          s->read_poll && s->enabled ? tap_can_send : NULL,
                          s->read_poll && s->enabled ? tap_send     : NULL,
@@ -226,6 +237,39 @@ static void tap_send(void *opaque)
     }
 }
 
+/* AioContext has no can_read callback, so stop polling until the peer
+ * flushes its queue and calls tap_set_aio_context() again.
+ */
+static void tap_aio_send(void *opaque)
+{
+    TAPState *s = opaque;
+
+    if (!tap_can_send(s)) {
+        tap_read_poll(s, false);
+        return;
+    }
+    tap_send(s);
+}
+
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (ctx == s->ctx && s->read_poll) {
+        return;
+    }
+
+    if (ctx != s->ctx) {
+        if (s->ctx) {
+            aio_set_fd_handler(s->ctx, s->fd, NULL, NULL, NULL);
+        } else {
+            qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+        }
+        s->ctx = ctx;
+    }
+    tap_read_poll(s, true);
+}
+
 static bool tap_has_ufo(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -341,6 +385,7 @@ static NetClientInfo net_tap_info = {
     .using_vnet_hdr = tap_using_vnet_hdr,
     .set_offload = tap_set_offload,
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -27,6 +27,9 @@
 #include "block/coroutine.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 ssize_t coroutine_fn
 qemu_co_sendv_recvv(int sockfd, struct iovec *iov, unsigned iov_cnt,
@@ -67,6 +70,44 @@ qemu_co_send_recv(int sockfd, void *buf, size_t bytes, bool do_send)
     return qemu_co_sendv_recvv(sockfd, &iov, 1, 0, bytes, do_send);
 }
 
+#ifdef CONFIG_SENDFILE
+ssize_t coroutine_fn
+qemu_co_sendfile(int sockfd, int fd, off_t offset, size_t bytes)
+{
+    size_t done = 0;
+    ssize_t ret;
+    int err;
+
+    while (done < bytes) {
+        ret = sendfile(sockfd, fd, &offset, bytes - done);
+        if (ret > 0) {
+            done += ret;
+        } else if (ret < 0) {
+            err = errno;
+            if (err == EAGAIN || err == EWOULDBLOCK) {
+                qemu_coroutine_yield();
+            } else if (err == EINTR) {
+                continue;
+            } else if (done == 0) {
+                return -err;
+            } else {
+                break;
+            }
+        } else {
+            /* end of file */
+            break;
+        }
+    }
+    return done;
+}
+#else
+ssize_t coroutine_fn
+qemu_co_sendfile(int sockfd, int fd, off_t offset, size_t bytes)
+{
+    return -ENOSYS;
+}
+#endif
+
 typedef struct {
     Coroutine *co;
     int fd;
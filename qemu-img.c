@@ -24,10 +24,12 @@
 #include "qapi-visit.h"
 #include "qapi/qmp-output-visitor.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/types.h"
 #include "qemu-common.h"
 #include "qemu/option.h"
 #include "qemu/error-report.h"
 #include "qemu/osdep.h"
+#include "qemu/timer.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/block-backend.h"
 #include "block/block_int.h"
@@ -46,6 +48,10 @@ typedef struct img_cmd_t {
 enum {
     OPTION_OUTPUT = 256,
     OPTION_BACKING_CHAIN = 257,
+    OPTION_FLUSH_INTERVAL = 258,
+    OPTION_PATTERN = 259,
+    OPTION_RANDOM = 260,
+    OPTION_SEED = 261,
 };
 
 typedef enum OutputFormat {
@@ -128,6 +134,9 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' number of parallel coroutines for convert (default 8, at most 16)\n"
+           "  '-W' allow out-of-order writes to the convert target, which is only\n"
+           "       recommended for preallocated targets like raw block devices\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -142,6 +151,18 @@ static void QEMU_NORETURN help(void)
            "  '-d' deletes a snapshot\n"
            "  '-l' lists all snapshots in the given image\n"
            "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of requests to send (default 75000)\n"
+           "  '-d' number of requests in flight at the same time (default 64)\n"
+           "  '-n' use native AIO\n"
+           "  '-o' offset of the first request, in bytes\n"
+           "  '-s' size of each request, in bytes (default 4k)\n"
+           "  '-S' distance between sequential requests (default: request size)\n"
+           "  '-w' send write requests instead of reads\n"
+           "  '--random' send requests to random offsets generated from '--seed'\n"
+           "  '--pattern' byte value to write (default 0xff)\n"
+           "  '--flush-interval' send a flush after this many writes\n"
+           "\n"
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
            "  '-F' second image format\n"
@@ -1220,6 +1241,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1227,24 +1250,36 @@ typedef struct ImgConvertState {
     int64_t src_cur_offset;
     int64_t total_sectors;
     int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool wr_in_order;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
@@ -1253,7 +1288,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     int64_t ret;
     int n;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &s->src_cur, &s->src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
@@ -1304,30 +1339,33 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
     int n;
     int ret;
 
-    if (s->status == BLK_ZERO || s->status == BLK_BACKING_FILE) {
-        return 0;
-    }
-
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
+        struct iovec iov;
+        QEMUIOVector qiov;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
-         * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
+         * read across multiple BDSes for one convert_co_read() call. */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
 
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_read(blk, sector_num - s->src_cur_offset, buf, n);
+        ret = blk_co_readv(blk, sector_num - src_cur_offset, n, &qiov);
         if (ret < 0) {
             return ret;
         }
@@ -1340,15 +1378,18 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
+        struct iovec iov;
+        QEMUIOVector qiov;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1382,7 +1423,11 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_write(s->target, sector_num, buf, n);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_writev(s->target, sector_num, n, &qiov);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1394,7 +1439,7 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_write_zeroes(s->target, sector_num, n, 0);
+            ret = blk_co_write_zeroes(s->target, sector_num, n, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1409,12 +1454,123 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+/* Let coroutines that wait for their turn to write see the error */
+static void convert_co_wake_waiters(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1) {
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
 {
+    ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
-    int n;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        /* save current sector and allocation status to local variables */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+        }
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            s->ret = ret;
+            break;
+        }
+
+        if (s->wr_in_order) {
+            /* reenter the coroutine that might have waited
+             * for this write to complete */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+    if (s->ret != -EINPROGRESS && s->ret != 0) {
+        convert_co_wake_waiters(s);
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int ret, i, n;
+    int64_t sector_num = 0;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     s->has_zero_init = s->min_sparse && !s->target_has_backing
@@ -1435,21 +1591,17 @@ static int convert_do_copy(ImgConvertState *s)
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
-            ret = -EINVAL;
-            goto fail;
+            return -EINVAL;
         }
         s->buf_sectors = s->cluster_sectors;
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     /* Calculate allocated sectors for progress */
     s->allocated_sectors = 0;
-    sector_num = 0;
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            ret = n;
-            goto fail;
+            return n;
         }
         if (s->status == BLK_DATA) {
             s->allocated_sectors += n;
@@ -1461,51 +1613,33 @@ static int convert_do_copy(ImgConvertState *s)
     s->src_cur = 0;
     s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->allocated_done = 0;
+    s->ret = -EINPROGRESS;
+    qemu_co_mutex_init(&s->lock);
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA) {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        ret = convert_read(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while reading sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
-
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        qemu_coroutine_enter(s->co[i], s);
+    }
 
-        sector_num += n;
+    while (s->running_coroutines) {
+        aio_poll(qemu_get_aio_context(), true);
     }
 
-    if (s->compressed) {
+    if (s->ret == 0 && s->compressed) {
         /* signal EOF to align */
         ret = blk_write_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    return ret;
+    return s->ret;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1531,6 +1665,8 @@ static int img_convert(int argc, char **argv)
     Error *local_err = NULL;
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
+    bool wr_in_order = true;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1540,7 +1676,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn");
+        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W");
         if (c == -1) {
             break;
         }
@@ -1630,6 +1766,23 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+            errno = 0;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (errno || *end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1781,7 +1934,7 @@ static int img_convert(int argc, char **argv)
         const char *preallocation =
             qemu_opt_get(opts, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -1863,6 +2016,14 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    /* Only drivers that compress in coroutines can take compressed clusters
+     * in any order */
+    if (compress && !wr_in_order && !out_bs->drv->bdrv_co_write_compressed) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
+
     state = (ImgConvertState) {
         .src                = blk,
         .src_sectors        = bs_sectors,
@@ -1874,6 +2035,8 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -3040,6 +3203,486 @@ out:
     return 0;
 }
 
+typedef struct BenchData {
+    BlockBackend *blk;
+    uint64_t image_size;
+    bool write;
+    bool random;
+    int bufsize;
+    int step;
+    int nrreq;
+    int n;
+    int flush_interval;
+    uint64_t offset;
+    GRand *rand;
+
+    int n_issued;
+    int n_done;
+    int n_flushes;
+    int in_flight;
+    int ret;
+    int64_t *latency;
+} BenchData;
+
+typedef struct BenchWorker {
+    BenchData *b;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} BenchWorker;
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t span = b->image_size - b->offset - b->bufsize;
+    uint64_t r;
+
+    if (b->random) {
+        r = ((uint64_t)g_rand_int(b->rand) << 32) | g_rand_int(b->rand);
+        return b->offset + (r % (span / b->bufsize + 1)) * b->bufsize;
+    }
+
+    r = ((uint64_t)b->n_issued * b->step) % (span + 1);
+    return b->offset + QEMU_ALIGN_DOWN(r, BDRV_SECTOR_SIZE);
+}
+
+static void coroutine_fn bench_co(void *opaque)
+{
+    BenchWorker *w = opaque;
+    BenchData *b = w->b;
+    int nb_sectors = b->bufsize >> BDRV_SECTOR_BITS;
+
+    while (b->n_issued < b->n && !b->ret) {
+        int64_t sector_num = bench_next_offset(b) >> BDRV_SECTOR_BITS;
+        int64_t start;
+        int ret;
+
+        b->n_issued++;
+        start = get_clock();
+        if (b->write) {
+            ret = blk_co_writev(b->blk, sector_num, nb_sectors, &w->qiov);
+        } else {
+            ret = blk_co_readv(b->blk, sector_num, nb_sectors, &w->qiov);
+        }
+        b->latency[b->n_done++] = get_clock() - start;
+
+        if (ret < 0) {
+            error_report("Failed request: %s", strerror(-ret));
+            b->ret = ret;
+            break;
+        }
+
+        if (b->write && b->flush_interval &&
+            b->n_done % b->flush_interval == 0) {
+            ret = blk_co_flush(b->blk);
+            if (ret < 0) {
+                error_report("Failed flush request: %s", strerror(-ret));
+                b->ret = ret;
+                break;
+            }
+            b->n_flushes++;
+        }
+    }
+
+    b->in_flight--;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of the sorted latency array, in nanoseconds */
+static int64_t bench_percentile(BenchData *b, double p)
+{
+    int i = MIN(b->n_done - 1, (int)(p / 100 * b->n_done));
+
+    return b->latency[i];
+}
+
+static const struct {
+    const char *name;
+    double p;
+} bench_percentiles[] = {
+    { "p50", 50 },
+    { "p90", 90 },
+    { "p99", 99 },
+    { "p99.9", 99.9 },
+};
+
+static void dump_bench_result(BenchData *b, OutputFormat output_format,
+                              unsigned int seed, double seconds)
+{
+    double iops = b->n_done / seconds;
+    double bandwidth = iops * b->bufsize;
+    int64_t total = 0;
+    int i;
+
+    qsort(b->latency, b->n_done, sizeof(b->latency[0]), compare_latency);
+    for (i = 0; i < b->n_done; i++) {
+        total += b->latency[i];
+    }
+
+    if (output_format == OFORMAT_JSON) {
+        QDict *result = qdict_new();
+        QDict *latency = qdict_new();
+        QString *str;
+
+        qdict_put(result, "operation",
+                  qstring_from_str(b->write ? "write" : "read"));
+        qdict_put(result, "requests", qint_from_int(b->n_done));
+        qdict_put(result, "size", qint_from_int(b->bufsize));
+        qdict_put(result, "depth", qint_from_int(b->nrreq));
+        qdict_put(result, "random", qbool_from_int(b->random));
+        if (b->random) {
+            qdict_put(result, "seed", qint_from_int(seed));
+        }
+        qdict_put(result, "flushes", qint_from_int(b->n_flushes));
+        qdict_put(result, "seconds", qfloat_from_double(seconds));
+        qdict_put(result, "iops", qfloat_from_double(iops));
+        qdict_put(result, "bandwidth", qfloat_from_double(bandwidth));
+
+        qdict_put(latency, "min", qint_from_int(b->latency[0]));
+        qdict_put(latency, "mean", qint_from_int(total / b->n_done));
+        for (i = 0; i < ARRAY_SIZE(bench_percentiles); i++) {
+            qdict_put(latency, bench_percentiles[i].name,
+                      qint_from_int(bench_percentile(b,
+                                                     bench_percentiles[i].p)));
+        }
+        qdict_put(latency, "max", qint_from_int(b->latency[b->n_done - 1]));
+        qdict_put(result, "latency-ns", latency);
+
+        str = qobject_to_json_pretty(QOBJECT(result));
+        printf("%s\n", qstring_get_str(str));
+        QDECREF(str);
+        QDECREF(result);
+        return;
+    }
+
+    printf("Run completed in %3.3f seconds.\n", seconds);
+    printf("%d requests, %.0f IOPS, %.2f MiB/s\n",
+           b->n_done, iops, bandwidth / (1024 * 1024));
+    if (b->n_flushes) {
+        printf("%d flushes\n", b->n_flushes);
+    }
+    printf("Latency (us): min %.1f, avg %.1f",
+           b->latency[0] / 1000.0, total / 1000.0 / b->n_done);
+    for (i = 0; i < ARRAY_SIZE(bench_percentiles); i++) {
+        printf(", %s %.1f", bench_percentiles[i].name,
+               bench_percentile(b, bench_percentiles[i].p) / 1000.0);
+    }
+    printf(", max %.1f\n", b->latency[b->n_done - 1] / 1000.0);
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0;
+    const char *fmt = NULL, *filename;
+    const char *cache = BDRV_DEFAULT_CACHE;
+    const char *output = NULL;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    bool quiet = false;
+    bool is_write = false;
+    bool random = false;
+    int count = 75000;
+    int depth = 64;
+    int64_t offset = 0;
+    size_t bufsize = 4096;
+    int pattern = 0xff;
+    int step = 0;
+    int flush_interval = 0;
+    unsigned int seed = 1;
+    int flags = 0;
+    BlockBackend *blk = NULL;
+    BenchWorker *workers = NULL;
+    BenchData data = {};
+    uint8_t *buf = NULL;
+    int64_t image_size, start, end;
+    int i;
+
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"flush-interval", required_argument, 0, OPTION_FLUSH_INTERVAL},
+            {"pattern", required_argument, 0, OPTION_PATTERN},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"seed", required_argument, 0, OPTION_SEED},
+            {"output", required_argument, 0, OPTION_OUTPUT},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "hc:d:f:no:qs:S:t:w", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+        {
+            unsigned long val;
+            char *end;
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val == 0 || val > INT_MAX) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            count = val;
+            break;
+        }
+        case 'd':
+        {
+            unsigned long val;
+            char *end;
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val == 0 || val > 4096) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            depth = val;
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'n':
+            flags |= BDRV_O_NATIVE_AIO;
+            break;
+        case 'o':
+        {
+            char *end;
+            offset = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (offset < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        }
+        case 'q':
+            quiet = true;
+            break;
+        case 's':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+
+            bufsize = sval;
+            break;
+        }
+        case 'S':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval < 0 || sval > INT_MAX || *end) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+
+            step = sval;
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            is_write = true;
+            break;
+        case OPTION_FLUSH_INTERVAL:
+        {
+            unsigned long val;
+            char *end;
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val > INT_MAX) {
+                error_report("Invalid flush interval specified");
+                return 1;
+            }
+            flush_interval = val;
+            break;
+        }
+        case OPTION_PATTERN:
+        {
+            unsigned long val;
+            char *end;
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val > 0xff) {
+                error_report("Invalid pattern byte specified");
+                return 1;
+            }
+            pattern = val;
+            break;
+        }
+        case OPTION_RANDOM:
+            random = true;
+            break;
+        case OPTION_SEED:
+        {
+            unsigned long val;
+            char *end;
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val > UINT_MAX) {
+                error_report("Invalid seed specified");
+                return 1;
+            }
+            seed = val;
+            break;
+        }
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+    if (output_format == OFORMAT_JSON) {
+        quiet = true;
+    }
+
+    if (!is_write && flush_interval) {
+        error_report("--flush-interval is only available in write tests");
+        return 1;
+    }
+    if (random && step) {
+        error_report("Step size cannot be used with --random");
+        return 1;
+    }
+    if (step == 0) {
+        step = bufsize;
+    }
+    if ((offset | bufsize | step) & (BDRV_SECTOR_SIZE - 1)) {
+        error_report("Offset, buffer size and step size must be multiples "
+                     "of 512 bytes");
+        return 1;
+    }
+
+    if (is_write) {
+        flags |= BDRV_O_RDWR;
+    }
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache mode");
+        return 1;
+    }
+
+    blk = img_open("image", filename, fmt, flags, true, quiet);
+    if (!blk) {
+        return 1;
+    }
+
+    image_size = blk_getlength(blk);
+    if (image_size < 0) {
+        error_report("Could not get image size: %s", strerror(-image_size));
+        ret = -1;
+        goto out;
+    }
+    if (offset + bufsize > image_size) {
+        error_report("Requests (offset %" PRId64 ", buffer size %zu) do not "
+                     "fit in the image (%" PRId64 " bytes)",
+                     offset, bufsize, image_size);
+        ret = -1;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .blk            = blk,
+        .image_size     = image_size,
+        .write          = is_write,
+        .random         = random,
+        .bufsize        = bufsize,
+        .step           = step,
+        .nrreq          = depth,
+        .n              = count,
+        .flush_interval = flush_interval,
+        .offset         = offset,
+        .rand           = g_rand_new_with_seed(seed),
+        .in_flight      = depth,
+        .latency        = g_new(int64_t, count),
+    };
+
+    if (random) {
+        qprintf(quiet, "Sending %d %s requests, %zu bytes each, %d in "
+                "parallel (random offsets from %" PRId64 ", seed %u)\n",
+                count, is_write ? "write" : "read", bufsize, depth,
+                offset, seed);
+    } else {
+        qprintf(quiet, "Sending %d %s requests, %zu bytes each, %d in "
+                "parallel (starting at offset %" PRId64 ", step size %d)\n",
+                count, is_write ? "write" : "read", bufsize, depth,
+                offset, step);
+    }
+    if (flush_interval) {
+        qprintf(quiet, "Sending flush every %d requests\n", flush_interval);
+    }
+
+    buf = blk_blockalign(blk, (size_t)depth * bufsize);
+    memset(buf, pattern, (size_t)depth * bufsize);
+
+    workers = g_new(BenchWorker, depth);
+    for (i = 0; i < depth; i++) {
+        workers[i].b = &data;
+        workers[i].iov.iov_base = buf + (size_t)i * bufsize;
+        workers[i].iov.iov_len = bufsize;
+        qemu_iovec_init_external(&workers[i].qiov, &workers[i].iov, 1);
+    }
+
+    start = get_clock();
+    for (i = 0; i < depth; i++) {
+        Coroutine *co = qemu_coroutine_create(bench_co);
+        qemu_coroutine_enter(co, &workers[i]);
+    }
+    while (data.in_flight > 0) {
+        aio_poll(blk_get_aio_context(blk), true);
+    }
+    end = get_clock();
+
+    ret = data.ret;
+    if (ret == 0) {
+        dump_bench_result(&data, output_format, seed,
+                          (end - start) / 1000000000.0);
+    }
+
+out:
+    qemu_vfree(buf);
+    g_free(workers);
+    g_free(data.latency);
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
+    blk_unref(blk);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
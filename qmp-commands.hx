@@ -659,6 +659,30 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch an in-progress migration with the postcopy-ram capability enabled
+over to postcopy mode.  The destination starts running the guest and the
+source sends the remaining pages, prioritising the ones the destination
+faults on.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1309,7 +1333,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
     },
 
@@ -1326,6 +1350,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image, so that it is loaded again
+                the next time the image is opened read-write
+                (json-bool, optional, default false)
 
 Example:
 
@@ -1503,7 +1530,7 @@ EQMP
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "node-name:s?,replaces:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1542,6 +1569,10 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": "background" to only copy data in the background, or
+  "write-blocking" to also write guest writes to already copied regions
+  to the target before completing them (MirrorCopyMode, default
+  'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1853,7 +1884,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1879,6 +1910,7 @@ Arguments:
 - "iops_rd_max":  read I/O operations max (json-int)
 - "iops_wr_max":  write I/O operations max (json-int)
 - "iops_size":  I/O size in bytes when limiting (json-int)
+- "group": throttle group name (json-string)
 
 Example:
 
@@ -1895,7 +1927,8 @@ Example:
                                                "iops_max": 0,
                                                "iops_rd_max": 0,
                                                "iops_wr_max": 0,
-                                               "iops_size": 0 } }
+                                               "iops_size": 0,
+                                               "group": "group0" } }
 <- { "return": {} }
 
 EQMP
@@ -2292,6 +2325,7 @@ Each json-object contain the following:
          - "iops_rd_max":  read I/O operations max (json-int)
          - "iops_wr_max":  write I/O operations max (json-int)
          - "iops_size": I/O size when limiting by iops (json-int)
+         - "group": throttle group name (json-string, optional)
          - "detect_zeroes": detect and optimize zero writing (json-string)
              - Possible values: "off", "on", "unmap"
          - "write_threshold": write offset threshold in bytes, a event will be
@@ -2458,10 +2492,44 @@ Each json-object contain the following:
                    another request (json-int)
     - "wr_merged": number of write requests that have been merged into
                    another request (json-int)
+    - "rd_size_histogram", "wr_size_histogram": distribution of request
+      sizes (json-object), containing:
+        - "boundaries": request sizes in bytes; bin i counts the requests
+                        that are larger than boundaries[i - 1] and not
+                        larger than boundaries[i] (json-array of json-int)
+        - "bins": request counts, one more than the boundaries
+                  (json-array of json-int)
+    - "timed_stats": latency statistics for each interval configured with
+                     the stats-intervals drive option (json-array), each
+                     containing:
+        - "interval_length": interval length in seconds (json-int)
+        - "min_rd_latency_ns", "max_rd_latency_ns", "avg_rd_latency_ns",
+          "min_wr_latency_ns", "max_wr_latency_ns", "avg_wr_latency_ns",
+          "min_flush_latency_ns", "max_flush_latency_ns",
+          "avg_flush_latency_ns": latency of the requests completed in the
+                                  interval, in nanoseconds (json-int)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms, only present if enabled
+                                 with block-latency-histogram-set
+                                 (json-object, optional), containing:
+        - "boundaries": bin boundaries in nanoseconds (json-array of
+                        json-int)
+        - "bins": request counts, one more than the boundaries
+                  (json-array of json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "format-specific": Statistics specific to the image format, with a "type"
+                     key naming the format (json-object, optional).  For
+                     qcow2, "l2-cache" and "refcount-cache" contain:
+    - "hits": lookups served from the cache (json-int)
+    - "misses": lookups that had to load the table (json-int)
+    - "evictions": cached tables replaced by another one (json-int)
+    - "readahead": tables loaded ahead of being needed (json-int)
+    - "tables-written": dirty tables written back (json-int)
+    - "write-requests": write requests used to write back dirty tables,
+                        adjacent tables are written together (json-int)
 
 Example:
 
@@ -2623,6 +2691,13 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling time growth factor, 0 for the default (json-int)
+- "poll-shrink": polling time shrink factor, 0 for the default (json-int)
+- "poll-ns": current polling time in ns (json-int)
+- "poll-time-ns": total time spent busy polling in ns (json-int)
+- "poll-hits": polling windows that found new work (json-int)
+- "poll-misses": polling windows that fell back to blocking (json-int)
 
 Example:
 
@@ -2631,11 +2706,25 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-ns":16000,
+            "poll-time-ns":1250000,
+            "poll-hits":412,
+            "poll-misses":37
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-ns":0,
+            "poll-time-ns":0,
+            "poll-hits":0,
+            "poll-misses":0
          }
       ]
    }
@@ -3227,7 +3316,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "setup", "active", "completed", "failed", "cancelled"
+     - Possible values: "setup", "active", "postcopy-active", "completed",
+       "failed", "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -3402,6 +3492,8 @@ Enable/Disable migration capabilities
 - "rdma-pin-all": pin all pages when using RDMA during migration
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
+- "postcopy-ram": allow switching to postcopy with migrate-start-postcopy
+- "multifd": send RAM pages over several extra connections
 
 Arguments:
 
@@ -3429,6 +3521,8 @@ Query current migration capabilities
          - "rdma-pin-all" : RDMA Pin Page state (json-bool)
          - "auto-converge" : Auto Converge state (json-bool)
          - "zero-blocks" : Zero Blocks state (json-bool)
+         - "postcopy-ram" : Postcopy RAM state (json-bool)
+         - "multifd" : Multiple connections state (json-bool)
 
 Arguments:
 
@@ -3454,6 +3548,7 @@ Set migration parameters
 - "compress-level": set compression level during migration (json-int)
 - "compress-threads": set compression thread count for migration (json-int)
 - "decompress-threads": set decompression thread count for migration (json-int)
+- "multifd-channels": set the number of multifd connections (json-int)
 
 Arguments:
 
@@ -3467,7 +3562,8 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "multifd-channels:i?",
 	.mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
     },
 SQMP
@@ -3480,6 +3576,7 @@ Query current migration parameters
          - "compress-level" : compression level value (json-int)
          - "compress-threads" : compression thread count value (json-int)
          - "decompress-threads" : decompression thread count value (json-int)
+         - "multifd-channels" : number of multifd connections (json-int)
 
 Arguments:
 
@@ -3490,7 +3587,8 @@ Example:
       "return": {
          "decompress-threads", 2,
          "compress-threads", 8,
-         "compress-level", 1
+         "compress-level", 1,
+         "multifd-channels", 2
       }
    }
 
@@ -4136,6 +4234,45 @@ Move mouse pointer to absolute coordinates (20000, 400).
                { "type": "abs", "data" : { "axis": "Y", "value" : 400 } } ] } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,"
+                      "boundaries-write:q?,boundaries-flush:q?,log2:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Manage the read, write and flush latency histograms of a block device.  Each
+request type uses its own boundaries if given, otherwise "boundaries", otherwise
+power of two boundaries from 1024 ns to 2^34 ns if "log2" is true.  Without any
+of them, the histogram is disabled.  Setting a histogram resets its bins.
+
+Arguments:
+
+- "device": the block device name (json-string)
+- "boundaries": bin boundaries in nanoseconds for all request types, strictly
+                ascending (json-array of json-int, optional)
+- "boundaries-read": bin boundaries for reads (json-array of json-int, optional)
+- "boundaries-write": bin boundaries for writes (json-array of json-int,
+                      optional)
+- "boundaries-flush": bin boundaries for flushes (json-array of json-int,
+                      optional)
+- "log2": use power of two boundaries for the request types without explicit
+          boundaries (json-bool, optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "drive0",
+                    "boundaries": [ 100000, 1000000, 10000000 ],
+                    "boundaries-flush": [ 1000000 ] } }
+<- { "return": {} }
+
 EQMP
 
     {
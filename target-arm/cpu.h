@@ -1492,6 +1492,9 @@ bool write_cpustate_to_list(ARMCPU *cpu);
 #  define TARGET_VIRT_ADDR_SPACE_BITS 32
 #endif
 
+/* store exclusive and the TLB are safe for -accel tcg,thread=multi */
+#define TARGET_SUPPORTS_MTTCG
+
 static inline bool arm_excp_unmasked(CPUState *cs, unsigned int excp_idx,
                                      unsigned int target_el)
 {
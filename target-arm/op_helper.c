@@ -339,6 +339,20 @@ void HELPER(wfe)(CPUARMState *env)
  * the guest (those must all have syndrome information and thus should
  * use exception_with_syndrome).
  */
+/* Store exclusive is emulated by comparing the current memory contents
+ * with the value seen by the load exclusive; with multi-threaded TCG the
+ * compare and the store must not interleave with another vCPU's.
+ */
+void HELPER(exclusive_lock)(void)
+{
+    tcg_atomic_lock();
+}
+
+void HELPER(exclusive_unlock)(void)
+{
+    tcg_atomic_unlock();
+}
+
 void HELPER(exception_internal)(CPUARMState *env, uint32_t excp)
 {
     CPUState *cs = CPU(arm_env_get_cpu(env));
@@ -1661,9 +1661,11 @@ static void disas_b_exc_sys(DisasContext *s, uint32_t insn)
  * mandated semantics, but it works for typical guest code sequences
  * and avoids having to monitor regular stores.
  *
- * In system emulation mode only one CPU will be running at once, so
- * this sequence is effectively atomic.  In user emulation mode we
- * throw an exception and handle the atomic operation elsewhere.
+ * In system emulation mode with a single TCG thread only one CPU will
+ * be running at once, so this sequence is effectively atomic; with
+ * multi-threaded TCG the store is done under a global lock.  In user
+ * emulation mode we throw an exception and handle the atomic operation
+ * elsewhere.
  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i64 addr, int size, bool is_pair)
@@ -1724,6 +1726,10 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     TCGv_i64 addr = tcg_temp_local_new_i64();
     TCGv_i64 tmp;
 
+    if (qemu_tcg_mttcg_enabled()) {
+        gen_helper_exclusive_lock();
+    }
+
     /* Copy input into a local temp so it is not trashed when the
      * basic block ends at the branch insn.
      */
@@ -1766,6 +1772,9 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_gen_movi_i64(cpu_reg(s, rd), 1);
     gen_set_label(done_label);
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
+    if (qemu_tcg_mttcg_enabled()) {
+        gen_helper_exclusive_unlock();
+    }
 
 }
 #endif
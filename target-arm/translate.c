@@ -7384,9 +7384,11 @@ static void gen_logicq_cc(TCGv_i32 lo, TCGv_i32 hi)
    the architecturally mandated semantics, and avoids having to monitor
    regular stores.
 
-   In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   In system emulation mode with a single TCG thread only one CPU will
+   be running at once, so this sequence is effectively atomic; with
+   multi-threaded TCG the store is done under a global lock.  In user
+   emulation mode we throw an exception and handle the atomic operation
+   elsewhere.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i32 addr, int size)
 {
@@ -7455,6 +7457,9 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
        } else {
          {Rd} = 1;
        } */
+    if (qemu_tcg_mttcg_enabled()) {
+        gen_helper_exclusive_lock();
+    }
     fail_label = gen_new_label();
     done_label = gen_new_label();
     extaddr = tcg_temp_new_i64();
@@ -7523,6 +7528,9 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_gen_movi_i32(cpu_R[rd], 1);
     gen_set_label(done_label);
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
+    if (qemu_tcg_mttcg_enabled()) {
+        gen_helper_exclusive_unlock();
+    }
 }
 #endif
 
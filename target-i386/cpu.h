@@ -1159,6 +1159,9 @@ uint64_t cpu_get_tsc(CPUX86State *env);
 #define TARGET_VIRT_ADDR_SPACE_BITS 32
 #endif
 
+/* lock prefixed insns and the TLB are safe for -accel tcg,thread=multi */
+#define TARGET_SUPPORTS_MTTCG
+
 /* XXX: This value should match the one returned by CPUID
  * and in exec.c */
 # if defined(TARGET_X86_64)
@@ -21,18 +21,17 @@
 #include "exec/helper-proto.h"
 #include "exec/cpu_ldst.h"
 
-/* broken thread support */
-
-static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
+/* Lock prefixed instructions are serialized with a global lock; this is
+   only needed in user mode and with multi-threaded TCG.  */
 
 void helper_lock(void)
 {
-    spin_lock(&global_cpu_lock);
+    tcg_atomic_lock();
 }
 
 void helper_unlock(void)
 {
-    spin_unlock(&global_cpu_lock);
+    tcg_atomic_unlock();
 }
 
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
@@ -0,0 +1,124 @@
+/*
+ * QTest testcase for TLB flushes across vCPUs with multi-threaded TCG
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libqtest.h"
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+
+/* Written by the secondary vCPU: number of loop iterations so far */
+#define CPU1_COUNT      0x40020000
+/* Written by the boot vCPU: number of TLBIALLIS executed so far */
+#define CPU0_COUNT      0x40020004
+
+#define CPU0_FLUSHES    0x1000
+
+/*
+ * The virt board loads this as a raw kernel image at 0x40010000 and
+ * jumps to it.  The boot vCPU starts the secondary one with PSCI CPU_ON,
+ * then executes TLBIALLIS, which flushes the TLB of every vCPU,
+ * CPU0_FLUSHES times before spinning.  The secondary vCPU keeps counting
+ * and executing TLBIALLIS forever, so each vCPU keeps asking for flushes
+ * of the other one while the latter runs translated code.
+ */
+static const uint32_t guest_code[] = {
+    0xe3000003, /* 0x00: movw  r0, #0x0003                                */
+    0xe3480400, /* 0x04: movt  r0, #0x8400     PSCI 0.2 CPU_ON            */
+    0xe3a01001, /* 0x08: mov   r1, #1          target MPIDR               */
+    0xe3002040, /* 0x0c: movw  r2, #0x0040                                */
+    0xe3442001, /* 0x10: movt  r2, #0x4001     entry point, cpu1 below    */
+    0xe3a03000, /* 0x14: mov   r3, #0          context id                 */
+    0xe1400070, /* 0x18: hvc   #0                                         */
+    0xe3004000, /* 0x1c: movw  r4, #0x0000                                */
+    0xe3444002, /* 0x20: movt  r4, #0x4002                                */
+    0xe3a05000, /* 0x24: mov   r5, #0                                     */
+    0xee080f13, /* 0x28: 1: mcr p15, 0, r0, c8, c3, 0    TLBIALLIS        */
+    0xe2855001, /* 0x2c: add   r5, r5, #1                                 */
+    0xe5845004, /* 0x30: str   r5, [r4, #4]                               */
+    0xe3550a01, /* 0x34: cmp   r5, #0x1000                                */
+    0x1afffffa, /* 0x38: bne   1b                                         */
+    0xeafffffe, /* 0x3c: b     .                                          */
+    0xe3004000, /* 0x40: cpu1: movw r4, #0x0000                           */
+    0xe3444002, /* 0x44: movt  r4, #0x4002                                */
+    0xe3a05000, /* 0x48: mov   r5, #0                                     */
+    0xe2855001, /* 0x4c: 2: add r5, r5, #1                                */
+    0xe5845000, /* 0x50: str   r5, [r4]                                   */
+    0xee080f13, /* 0x54: mcr   p15, 0, r0, c8, c3, 0    TLBIALLIS         */
+    0xeafffffb, /* 0x58: b     2b                                         */
+};
+
+static char *write_guest_code(void)
+{
+    uint32_t buf[ARRAY_SIZE(guest_code)];
+    char *path;
+    int fd, i;
+
+    for (i = 0; i < ARRAY_SIZE(guest_code); i++) {
+        buf[i] = cpu_to_le32(guest_code[i]);
+    }
+
+    fd = g_file_open_tmp("qtest-tlb-flush-XXXXXX", &path, NULL);
+    g_assert(fd >= 0);
+    g_assert_cmpint(write(fd, buf, sizeof(buf)), ==, sizeof(buf));
+    close(fd);
+
+    return path;
+}
+
+/* Wait up to a minute for a guest counter to reach at least @value */
+static uint32_t wait_for_count(uint64_t addr, uint32_t value)
+{
+    uint32_t count = 0;
+    int i;
+
+    for (i = 0; i < 6000; i++) {
+        count = readl(addr);
+        if (count >= value) {
+            break;
+        }
+        g_usleep(10 * 1000);
+    }
+    return count;
+}
+
+static void test_cross_vcpu_flush(void)
+{
+    char *path = write_guest_code();
+    char *args;
+    uint32_t count;
+
+    args = g_strdup_printf("-machine virt -cpu cortex-a15 -smp 2 "
+                           "-accel tcg,thread=multi -kernel %s", path);
+    qtest_start(args);
+
+    /* All the flushes of the running secondary vCPU have completed */
+    g_assert_cmpuint(wait_for_count(CPU0_COUNT, CPU0_FLUSHES), ==,
+                     CPU0_FLUSHES);
+
+    /* The secondary vCPU is still making progress, and so are its own
+     * flushes of the boot vCPU */
+    count = wait_for_count(CPU1_COUNT, 1);
+    g_assert_cmpuint(count, !=, 0);
+    g_assert_cmpuint(wait_for_count(CPU1_COUNT, count + 1000), >=,
+                     count + 1000);
+
+    qtest_end();
+    unlink(path);
+    g_free(path);
+    g_free(args);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/tcg/tlb-flush/cross-vcpu", test_cross_vcpu_flush);
+
+    return g_test_run();
+}
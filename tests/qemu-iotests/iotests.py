@@ -98,10 +98,13 @@ def event_match(event, match=None):
 class VM(object):
     '''A QEMU VM'''
 
-    def __init__(self):
-        self._monitor_path = os.path.join(test_dir, 'qemu-mon.%d' % os.getpid())
-        self._qemu_log_path = os.path.join(test_dir, 'qemu-log.%d' % os.getpid())
-        self._qtest_path = os.path.join(test_dir, 'qemu-qtest.%d' % os.getpid())
+    def __init__(self, path_suffix=''):
+        self._monitor_path = os.path.join(test_dir, 'qemu-mon%s.%d' %
+                                          (path_suffix, os.getpid()))
+        self._qemu_log_path = os.path.join(test_dir, 'qemu-log%s.%d' %
+                                           (path_suffix, os.getpid()))
+        self._qtest_path = os.path.join(test_dir, 'qemu-qtest%s.%d' %
+                                        (path_suffix, os.getpid()))
         self._args = qemu_args + ['-chardev',
                      'socket,id=mon,path=' + self._monitor_path,
                      '-mon', 'chardev=mon,mode=control',
@@ -117,6 +120,12 @@ class VM(object):
         self._args.append('-monitor')
         self._args.append(args)
 
+    def add_incoming(self, addr):
+        '''Start the VM as a migration destination'''
+        self._args.append('-incoming')
+        self._args.append(addr)
+        return self
+
     def add_drive(self, path, opts=''):
         '''Add a virtio-blk drive to the VM'''
         options = ['if=virtio',
@@ -192,10 +201,20 @@ class VM(object):
             os.remove(self._monitor_path)
             raise
 
+    def wait(self):
+        '''Wait for the VM to exit on its own and return its exit code'''
+        return self._popen.wait()
+
+    def get_log(self):
+        '''Return the output of the VM so far'''
+        with open(self._qemu_log_path, 'r') as f:
+            return f.read()
+
     def shutdown(self):
         '''Terminate the VM and clean up'''
         if not self._popen is None:
-            self._qmp.cmd('quit')
+            if self._popen.poll() is None:
+                self._qmp.cmd('quit')
             self._popen.wait()
             os.remove(self._monitor_path)
             os.remove(self._qtest_path)
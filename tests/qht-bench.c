@@ -0,0 +1,208 @@
+/*
+ * QHT lookup benchmark
+ *
+ * Fills a QHT with TB-like keys (phys_pc, pc, cs_base, flags) and measures
+ * the cost of a successful lookup as the number of entries grows, optionally
+ * with several concurrent reader threads.
+ *
+ * usage: qht-bench [-n threads] [-d duration_ms] [-s max_shift] [-r]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/xxhash.h"
+
+struct bench_key {
+    uint64_t phys_pc;
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+};
+
+struct thread_info {
+    QemuThread thread;
+    uint64_t seed;
+    uint64_t lookups;
+    uint64_t misses;
+};
+
+static struct qht ht;
+static struct bench_key *keys;
+static size_t n_keys;
+static unsigned int n_threads = 1;
+static unsigned int duration_ms = 200;
+static unsigned int max_shift = 20;
+static bool resize_mode;
+
+static volatile bool test_stop;
+static int n_ready_threads;
+
+static inline uint32_t key_hash(const struct bench_key *k)
+{
+    return qemu_xxhash4(k->phys_pc, k->pc, k->cs_base, k->flags);
+}
+
+static bool key_cmp(const void *obj, const void *userp)
+{
+    const struct bench_key *a = obj;
+    const struct bench_key *b = userp;
+
+    return a->phys_pc == b->phys_pc && a->pc == b->pc &&
+           a->cs_base == b->cs_base && a->flags == b->flags;
+}
+
+/* xorshift64*, good enough to pick keys uniformly */
+static inline uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return x * UINT64_C(2685821657736338717);
+}
+
+static void *lookup_thread(void *opaque)
+{
+    struct thread_info *info = opaque;
+    uint64_t r = info->seed;
+
+    rcu_register_thread();
+    atomic_inc(&n_ready_threads);
+
+    rcu_read_lock();
+    while (!test_stop) {
+        const struct bench_key *k;
+
+        r = xorshift64star(r);
+        k = &keys[r % n_keys];
+        if (unlikely(!qht_lookup(&ht, key_cmp, k, key_hash(k)))) {
+            info->misses++;
+        }
+        info->lookups++;
+    }
+    rcu_read_unlock();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void fill_keys(size_t n)
+{
+    size_t i;
+
+    keys = g_renew(struct bench_key, keys, n);
+    for (i = n_keys; i < n; i++) {
+        /* mimic guest code: mostly sequential pcs, a few different modes */
+        keys[i].pc = 0x400000 + i * 24;
+        keys[i].phys_pc = 0x10000000 + keys[i].pc;
+        keys[i].cs_base = 0;
+        keys[i].flags = i & 3;
+    }
+}
+
+static void run_one(size_t n)
+{
+    struct thread_info *info;
+    struct qht_stats stats;
+    uint64_t lookups = 0;
+    uint64_t misses = 0;
+    int64_t t0, t1;
+    unsigned int i;
+
+    fill_keys(n);
+    qht_init(&ht, resize_mode ? 0 : n,
+             resize_mode ? QHT_MODE_AUTO_RESIZE : 0);
+    for (i = 0; i < n; i++) {
+        qht_insert(&ht, &keys[i], key_hash(&keys[i]));
+    }
+    n_keys = n;
+
+    info = g_new0(struct thread_info, n_threads);
+    test_stop = false;
+    n_ready_threads = 0;
+    for (i = 0; i < n_threads; i++) {
+        info[i].seed = i + 1;
+        qemu_thread_create(&info[i].thread, "qht-bench", lookup_thread,
+                           &info[i], QEMU_THREAD_JOINABLE);
+    }
+    while (atomic_read(&n_ready_threads) < n_threads) {
+        g_usleep(100);
+    }
+
+    t0 = get_clock();
+    g_usleep(duration_ms * 1000);
+    test_stop = true;
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&info[i].thread);
+        lookups += info[i].lookups;
+        misses += info[i].misses;
+    }
+    t1 = get_clock();
+
+    qht_statistics_init(&ht, &stats);
+    printf("%10zu %12.2f %10.1f %10zu %8zu %8" PRIu64 "\n",
+           n, (double)(t1 - t0) * n_threads / lookups,
+           (double)lookups / (t1 - t0) * 1000.0,
+           stats.head_buckets, stats.max_chain, misses);
+
+    qht_destroy(&ht);
+    g_free(info);
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [-n threads] [-d duration_ms] [-s max_shift] [-r]\n"
+           "  -n  number of concurrent lookup threads (default 1)\n"
+           "  -d  measurement time per table size in ms (default 200)\n"
+           "  -s  largest table holds 2^max_shift entries (default 20)\n"
+           "  -r  start from an empty table and rely on auto-resize\n",
+           name);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int shift;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:d:s:rh")) != -1) {
+        switch (c) {
+        case 'n':
+            n_threads = atoi(optarg);
+            break;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        case 's':
+            max_shift = atoi(optarg);
+            break;
+        case 'r':
+            resize_mode = true;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (n_threads == 0 || max_shift < 10 || max_shift > 26) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("%10s %12s %10s %10s %8s %8s\n",
+           "entries", "ns/lookup", "Mlookup/s", "buckets", "chain", "misses");
+    for (shift = 10; shift <= max_shift; shift += 2) {
+        run_one((size_t)1 << shift);
+    }
+    g_free(keys);
+    return 0;
+}
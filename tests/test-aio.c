@@ -15,6 +15,7 @@
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 
 static AioContext *ctx;
 
@@ -428,6 +429,153 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+static bool event_poll_cb(void *opaque)
+{
+    EventNotifierTestData *data = container_of(opaque, EventNotifierTestData,
+                                               e);
+    if (data->active == 0) {
+        return false;
+    }
+    data->n++;
+    data->active--;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    uint64_t hits = ctx->poll_hits;
+    uint64_t misses = ctx->poll_misses;
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+    aio_context_set_poll_params(ctx, 1000000000, 0, 0, &error_abort);
+
+    /* Non-blocking aio_poll never busy waits */
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+    g_assert_cmpint(ctx->poll_hits, ==, hits);
+
+    /* The poll handler finds work before aio_poll would block */
+    ctx->poll_ns = ctx->poll_max_ns;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.active, ==, 0);
+    g_assert_cmpint(ctx->poll_hits, ==, hits + 1);
+
+    /* The window expires and the file descriptor is used instead; the
+     * window grows since the event arrived well within poll_max_ns.
+     */
+    ctx->poll_ns = 1000;
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert_cmpint(ctx->poll_misses, ==, misses + 1);
+    g_assert_cmpint(ctx->poll_ns, >, 1000);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+
+#ifdef CONFIG_EPOLL_CREATE1
+static void test_epoll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    unsigned int threshold = ctx->epoll_threshold;
+
+    if (!ctx->epoll_available) {
+        g_test_message("epoll not available, skipping");
+        return;
+    }
+
+    /* Switch to epoll on the next aio_poll */
+    ctx->epoll_threshold = 0;
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb);
+    g_assert(!aio_poll(ctx, false));
+    g_assert(ctx->epoll_enabled);
+    g_assert_cmpint(data.n, ==, 0);
+
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.active, ==, 0);
+    g_assert(!aio_poll(ctx, false));
+
+    /* Removed handlers leave the epoll set as well */
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    event_notifier_set(&data.e);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    /* And back to ppoll */
+    ctx->epoll_threshold = threshold;
+    g_assert(!aio_poll(ctx, false));
+    g_assert(!ctx->epoll_enabled);
+    event_notifier_cleanup(&data.e);
+}
+
+static int64_t time_aio_poll(int iterations)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        aio_poll(ctx, false);
+    }
+    return (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / iterations;
+}
+
+/* Not a pass/fail test: prints the cost of a non-blocking aio_poll with
+ * ppoll and with epoll as the number of handlers grows, to help pick
+ * EPOLL_ENABLE_THRESHOLD.  Run with -m perf.
+ */
+static void test_bench_epoll_crossover(void)
+{
+    enum { MAX_HANDLERS = 512, ITERATIONS = 20000 };
+    EventNotifierTestData *data = g_new0(EventNotifierTestData, MAX_HANDLERS);
+    unsigned int threshold = ctx->epoll_threshold;
+    int n = 0, target;
+
+    if (!ctx->epoll_available) {
+        g_test_message("epoll not available, skipping");
+        g_free(data);
+        return;
+    }
+
+    for (target = 1; target <= MAX_HANDLERS; target *= 2) {
+        int64_t ppoll_ns, epoll_ns;
+
+        for (; n < target; n++) {
+            event_notifier_init(&data[n].e, false);
+            aio_set_event_notifier(ctx, &data[n].e, event_ready_cb);
+        }
+
+        ctx->epoll_threshold = UINT_MAX;
+        aio_poll(ctx, false);
+        ppoll_ns = time_aio_poll(ITERATIONS);
+
+        ctx->epoll_threshold = 0;
+        aio_poll(ctx, false);
+        epoll_ns = time_aio_poll(ITERATIONS);
+
+        g_test_message("%4d handlers: ppoll %6" PRId64 " ns/iter, "
+                       "epoll %6" PRId64 " ns/iter", n, ppoll_ns, epoll_ns);
+    }
+
+    ctx->epoll_threshold = threshold;
+    while (n--) {
+        aio_set_event_notifier(ctx, &data[n].e, NULL);
+        event_notifier_cleanup(&data[n].e);
+    }
+    aio_poll(ctx, false);
+    g_free(data);
+}
+#endif
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -846,6 +994,14 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+#ifdef CONFIG_EPOLL_CREATE1
+    g_test_add_func("/aio/event/epoll",             test_epoll_event_notifier);
+    if (g_test_perf()) {
+        g_test_add_func("/aio/bench/epoll-crossover",
+                        test_bench_epoll_crossover);
+    }
+#endif
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
@@ -12,6 +12,8 @@
  */
 
 #include <glib.h>
+#include "qemu-common.h"
+#include "qemu/sockets.h"
 #include "block/coroutine.h"
 #include "block/coroutine_int.h"
 
@@ -228,6 +230,104 @@ static void test_order(void)
         g_assert_cmpint(records[i].state, ==, expected_pos[i].state);
     }
 }
+#ifdef CONFIG_SENDFILE
+/*
+ * Check that qemu_co_sendfile() resumes after short writes and EAGAIN
+ */
+
+#define SENDFILE_SIZE (1024 * 1024)
+
+typedef struct {
+    int sockfd;
+    int fd;
+    off_t offset;
+    size_t bytes;
+    ssize_t ret;
+    bool done;
+} SendfileData;
+
+static void coroutine_fn sendfile_co(void *opaque)
+{
+    SendfileData *data = opaque;
+
+    data->ret = qemu_co_sendfile(data->sockfd, data->fd, data->offset,
+                                 data->bytes);
+    data->done = true;
+}
+
+/* Returns how often the coroutine yielded because the socket was full */
+static int do_test_sendfile(const uint8_t *pattern, int fd, off_t offset,
+                            size_t bytes, size_t expected)
+{
+    SendfileData data = {
+        .fd = fd,
+        .offset = offset,
+        .bytes = bytes,
+    };
+    Coroutine *co;
+    uint8_t *received = g_malloc(bytes);
+    size_t len = 0;
+    ssize_t n;
+    int yields = 0;
+    int sv[2];
+
+    g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    qemu_set_nonblock(sv[0]);
+    data.sockfd = sv[0];
+
+    co = qemu_coroutine_create(sendfile_co);
+    qemu_coroutine_enter(co, &data);
+    while (!data.done) {
+        /* The socket is full; make room and let the coroutine retry */
+        n = read(sv[1], received + len, bytes - len);
+        g_assert(n > 0);
+        len += n;
+        yields++;
+        qemu_coroutine_enter(co, NULL);
+    }
+
+    closesocket(sv[0]);
+    while ((n = read(sv[1], received + len, bytes - len)) > 0) {
+        len += n;
+    }
+    closesocket(sv[1]);
+
+    g_assert_cmpint(data.ret, ==, expected);
+    g_assert_cmpint(len, ==, expected);
+    g_assert(memcmp(received, pattern + offset, expected) == 0);
+
+    g_free(received);
+    return yields;
+}
+
+static void test_sendfile(void)
+{
+    uint8_t *pattern = g_malloc(SENDFILE_SIZE);
+    char *path;
+    int fd, i;
+
+    for (i = 0; i < SENDFILE_SIZE; i++) {
+        pattern[i] = i % 251;
+    }
+    fd = g_file_open_tmp("qemu-test-coroutine-XXXXXX", &path, NULL);
+    g_assert(fd >= 0);
+    g_assert_cmpint(write(fd, pattern, SENDFILE_SIZE), ==, SENDFILE_SIZE);
+
+    /* Much more than fits into the socket buffer */
+    g_assert_cmpint(do_test_sendfile(pattern, fd, 4096,
+                                     SENDFILE_SIZE - 4096,
+                                     SENDFILE_SIZE - 4096), >, 0);
+
+    /* A range that ends past the end of the file is cut short */
+    do_test_sendfile(pattern, fd, SENDFILE_SIZE - 1000, 4096, 1000);
+
+    close(fd);
+    unlink(path);
+    g_free(path);
+    g_free(pattern);
+}
+#endif
+
 /*
  * Lifecycle benchmark
  */
@@ -375,6 +475,9 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
     g_test_add_func("/basic/order", test_order);
+#ifdef CONFIG_SENDFILE
+    g_test_add_func("/basic/sendfile", test_sendfile);
+#endif
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
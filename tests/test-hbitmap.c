@@ -602,6 +602,55 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void hbitmap_test_serialize(TestHBitmapData *data, uint64_t size,
+                                   int granularity)
+{
+    HBitmapIter hbi1, hbi2;
+    HBitmap *hb;
+    uint8_t *buf;
+    uint64_t len;
+    int64_t next;
+
+    hbitmap_test_init(data, size, granularity);
+    hbitmap_set(data->hb, 0, 1);
+    hbitmap_set(data->hb, L1 - 1, 2);
+    hbitmap_set(data->hb, L2 + 3, L1 + 5);
+    hbitmap_set(data->hb, size - 1, 1);
+
+    len = hbitmap_serialization_size(data->hb);
+    g_assert_cmpint(len % 8, ==, 0);
+    buf = g_malloc(len);
+    hbitmap_serialize(data->hb, buf);
+
+    /* Deserialize into a full bitmap to check that old bits are dropped */
+    hb = hbitmap_alloc(size, granularity);
+    hbitmap_set(hb, 0, size);
+    hbitmap_deserialize(hb, buf);
+    g_free(buf);
+
+    g_assert_cmpint(hbitmap_count(hb), ==, hbitmap_count(data->hb));
+    hbitmap_iter_init(&hbi1, data->hb, 0);
+    hbitmap_iter_init(&hbi2, hb, 0);
+    do {
+        next = hbitmap_iter_next(&hbi1);
+        g_assert_cmpint(hbitmap_iter_next(&hbi2), ==, next);
+    } while (next >= 0);
+
+    hbitmap_free(hb);
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_serialize(data, L3 + 17, 0);
+}
+
+static void test_hbitmap_serialize_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_serialize(data, L3 + 17, 1);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -628,6 +677,9 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/serialize/general", test_hbitmap_serialize);
+    hbitmap_test_add("/hbitmap/serialize/granularity",
+                     test_hbitmap_serialize_granularity);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
     hbitmap_test_add("/hbitmap/truncate/grow/negligible",
@@ -33,6 +33,7 @@
 #define QVIRTIO_BLK_F_WCE           0x00000200
 #define QVIRTIO_BLK_F_TOPOLOGY      0x00000400
 #define QVIRTIO_BLK_F_CONFIG_WCE    0x00000800
+#define QVIRTIO_BLK_F_MQ            0x00001000
 
 #define QVIRTIO_BLK_T_IN            0
 #define QVIRTIO_BLK_T_OUT           1
@@ -48,6 +49,9 @@
 #define PCI_SLOT                0x04
 #define PCI_FN                  0x00
 
+/* Offset of num_queues in struct virtio_blk_config */
+#define QVIRTIO_BLK_CFG_NUM_QUEUES  34
+
 #define MMIO_PAGE_SIZE          4096
 #define MMIO_DEV_BASE_ADDR      0x0A003E00
 #define MMIO_RAM_ADDR           0x40000000
@@ -76,7 +80,7 @@ static char *drive_create(void)
     return tmp_path;
 }
 
-static QPCIBus *pci_test_start(void)
+static QPCIBus *pci_test_start_opts(const char *opts)
 {
     char *cmdline;
     char *tmp_path;
@@ -86,8 +90,8 @@ static QPCIBus *pci_test_start(void)
     cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
                         "-drive if=none,id=drive1,file=/dev/null,format=raw "
                         "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                        "addr=%x.%x",
-                        tmp_path, PCI_SLOT, PCI_FN);
+                        "addr=%x.%x%s",
+                        tmp_path, PCI_SLOT, PCI_FN, opts);
     qtest_start(cmdline);
     unlink(tmp_path);
     g_free(tmp_path);
@@ -96,6 +100,11 @@ static QPCIBus *pci_test_start(void)
     return qpci_init_pc();
 }
 
+static QPCIBus *pci_test_start(void)
+{
+    return pci_test_start_opts("");
+}
+
 static void arm_test_start(void)
 {
     char *cmdline;
@@ -702,6 +711,128 @@ static void pci_idx(void)
     test_end();
 }
 
+static uint16_t used_idx(QVirtQueue *vq)
+{
+    return readw(vq->used + 2);
+}
+
+static void pci_mq(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci[2];
+    QGuestAllocator *alloc;
+    QVirtioBlkReq req;
+    void *addr;
+    uint64_t req_addr;
+    uint32_t features;
+    uint32_t free_head;
+    uint16_t num_queues;
+    uint8_t status;
+    char *data;
+    int i;
+
+    bus = pci_test_start_opts(",num-queues=2");
+    alloc = pc_alloc_init();
+
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+    qpci_msix_enable(dev->pdev);
+
+    qvirtio_pci_set_msix_configuration_vector(dev, alloc, 0);
+
+    /* MSI-X is enabled */
+    addr = dev->addr + QVIRTIO_PCI_DEVICE_SPECIFIC_MSIX;
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    g_assert_cmphex(features & QVIRTIO_BLK_F_MQ, ==, QVIRTIO_BLK_F_MQ);
+
+    num_queues = qvirtio_config_readw(&qvirtio_pci, &dev->vdev,
+                        (uint64_t)(uintptr_t)addr + QVIRTIO_BLK_CFG_NUM_QUEUES);
+    g_assert_cmpint(num_queues, ==, 2);
+
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            QVIRTIO_F_RING_INDIRECT_DESC |
+                            QVIRTIO_F_RING_EVENT_IDX | QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    /* Each queue gets its own MSI-X vector, after the configuration one */
+    for (i = 0; i < 2; i++) {
+        vqpci[i] = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                     alloc, i);
+        qvirtqueue_pci_msix_setup(dev, vqpci[i], alloc, i + 1);
+    }
+
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Write request on the second queue */
+    req.type = QVIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = g_malloc0(512);
+    strcpy(req.data, "TEST");
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(&vqpci[1]->vq, req_addr, 16, false, true);
+    qvirtqueue_add(&vqpci[1]->vq, req_addr + 16, 512, false, true);
+    qvirtqueue_add(&vqpci[1]->vq, req_addr + 528, 1, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci[1]->vq, free_head);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci[1]->vq,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    /* It completed on the queue it was submitted to */
+    g_assert_cmpint(used_idx(&vqpci[0]->vq), ==, 0);
+    g_assert_cmpint(used_idx(&vqpci[1]->vq), ==, 1);
+
+    guest_free(alloc, req_addr);
+
+    /* Read the data back on the first queue */
+    req.type = QVIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = g_malloc0(512);
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(&vqpci[0]->vq, req_addr, 16, false, true);
+    qvirtqueue_add(&vqpci[0]->vq, req_addr + 16, 512, true, true);
+    qvirtqueue_add(&vqpci[0]->vq, req_addr + 528, 1, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci[0]->vq, free_head);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci[0]->vq,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    g_assert_cmpint(used_idx(&vqpci[0]->vq), ==, 1);
+    g_assert_cmpint(used_idx(&vqpci[1]->vq), ==, 1);
+
+    data = g_malloc0(512);
+    memread(req_addr + 16, data, 512);
+    g_assert_cmpstr(data, ==, "TEST");
+    g_free(data);
+
+    guest_free(alloc, req_addr);
+
+    /* End test */
+    for (i = 0; i < 2; i++) {
+        guest_free(alloc, vqpci[i]->vq.desc);
+    }
+    pc_alloc_uninit(alloc);
+    qpci_msix_disable(dev->pdev);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
 static void pci_hotplug(void)
 {
     QPCIBus *bus;
@@ -778,6 +909,7 @@ int main(int argc, char **argv)
         qtest_add_func("/virtio/blk/pci/config", pci_config);
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
+        qtest_add_func("/virtio/blk/pci/mq", pci_mq);
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
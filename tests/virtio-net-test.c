@@ -26,6 +26,25 @@ static void hotplug(void)
     qpci_unplug_acpi_device_test("net1", PCI_SLOT_HP);
 }
 
+static void pci_iothread(void)
+{
+    QTestState *s;
+    QDict *response;
+
+    s = qtest_init("-object iothread,id=iothread0 "
+                   "-device virtio-net-pci,id=net2,iothread=iothread0");
+
+    response = qtest_qmp(s, "{ 'execute': 'qom-get', 'arguments': {"
+                         " 'path': '/machine/peripheral/net2',"
+                         " 'property': 'iothread' } }");
+    g_assert(qdict_haskey(response, "return"));
+    g_assert_cmpstr(qdict_get_str(response, "return"), ==,
+                    "/objects/iothread0");
+    QDECREF(response);
+
+    qtest_quit(s);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -33,6 +52,7 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/virtio/net/pci/nop", pci_nop);
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
+    qtest_add_func("/virtio/net/pci/iothread", pci_iothread);
 
     qtest_start("-device virtio-net-pci");
     ret = g_test_run();
@@ -480,3 +480,70 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 
     return true;
 }
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb)
+{
+    /* Pad to 64 bits so that the result does not depend on BITS_PER_LONG */
+    return ((hb->size + 63) >> 6) << 3;
+}
+
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf)
+{
+    const unsigned long *cur = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t i;
+    unsigned j;
+
+    memset(buf, 0, hbitmap_serialization_size(hb));
+    for (i = 0; i < hb->sizes[HBITMAP_LEVELS - 1]; i++) {
+        unsigned long el = cur[i];
+
+        /* Bits past hb->size are never set, so this stays in the buffer */
+        for (j = 0; el; j++, el >>= 8) {
+            buf[i * sizeof(unsigned long) + j] = el & 0xff;
+        }
+    }
+}
+
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf)
+{
+    unsigned long *cur = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t len = hbitmap_serialization_size(hb);
+    uint64_t i, pos;
+    unsigned j;
+    int level;
+
+    hb->count = 0;
+    for (i = 0; i < hb->sizes[HBITMAP_LEVELS - 1]; i++) {
+        unsigned long el = 0;
+
+        for (j = 0; j < sizeof(unsigned long); j++) {
+            pos = i * sizeof(unsigned long) + j;
+            if (pos < len) {
+                el |= (unsigned long)buf[pos] << (j * 8);
+            }
+        }
+        cur[i] = el;
+    }
+
+    /* Drop stray bits past the end of the bitmap */
+    if (hb->size & (BITS_PER_LONG - 1)) {
+        cur[hb->size >> BITS_PER_LEVEL] &=
+            (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+    }
+    for (i = 0; i < hb->sizes[HBITMAP_LEVELS - 1]; i++) {
+        hb->count += ctpopl(cur[i]);
+    }
+
+    /* Rebuild the upper levels from the bottom up */
+    for (level = HBITMAP_LEVELS - 1; level > 0; level--) {
+        memset(hb->levels[level - 1], 0,
+               hb->sizes[level - 1] * sizeof(unsigned long));
+        for (i = 0; i < hb->sizes[level]; i++) {
+            if (hb->levels[level][i]) {
+                hb->levels[level - 1][i >> BITS_PER_LEVEL] |=
+                    1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+}